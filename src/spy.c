@@ -5,6 +5,10 @@
 #define NOB_IMPLEMENTATION
 #include "nob.h"
 #include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 bool str_eq(char *str_a, char *str_b)
 {
@@ -75,6 +79,8 @@ char *pretty_token(long token)
         return ">>=";
     case PLEX_shreq:
         return "<<=";
+    case PLEX_floordiv:
+        return "//";
     case PLEX_indent:
         return "indentation block";
     case PLEX_deindent:
@@ -128,11 +134,116 @@ void print_loc(stb_lexer *lexer, char *file_path, const char *where)
     fprintf(stderr, "%s:%d:%d", file_path, loc.line_number, loc.line_offset + 1);
 }
 
-void dump_lexer(stb_lexer *lexer, char *input_path, Nob_String_Builder *output)
+/*
+    OUTPUT FILE
+*/
+
+// Backends append to `buffer` and drain it between functions, so memory stays flat however
+// big the output gets. Everything goes to a temporary file next to the output which is only
+// renamed over it once the compile succeeded, a failed compile leaves nothing behind.
+
+#define SPY_WRITER_BUFFER_SIZE (64 * 1024)
+
+typedef struct
+{
+    Nob_String_Builder buffer;
+    int fd;
+    const char *path;
+    char *temp_path; // NULL when writing straight through a symlink, to a device or to a pipe
+    int error;
+} spy_writer;
+
+bool spy_writer_open(spy_writer *writer, const char *path)
+{
+    writer->path = path;
+    writer->error = 0;
+    struct stat st;
+    if (lstat(path, &st) == 0 && !S_ISREG(st.st_mode))
+    {
+        // Renaming over a symlink, /dev/null or a fifo would replace it with a regular file.
+        // /dev/stdout is a symlink too, to whatever file or pipe stdout is.
+        writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    else
+    {
+        Nob_String_Builder temp_path = {0};
+        nob_sb_appendf(&temp_path, "%s.%d.tmp", path, (int)getpid());
+        nob_sb_append_null(&temp_path);
+        writer->temp_path = temp_path.items;
+        writer->fd = open(writer->temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (writer->fd < 0)
+    {
+        fprintf(stderr, "ERROR: Unable to open %s: %s\n", writer->temp_path ? writer->temp_path : path, strerror(errno));
+        free(writer->temp_path);
+        writer->temp_path = NULL;
+        return false;
+    }
+    nob_da_reserve(&writer->buffer, SPY_WRITER_BUFFER_SIZE);
+    return true;
+}
+
+void spy_writer_flush(spy_writer *writer)
+{
+    size_t written = 0;
+    while (written < writer->buffer.count && writer->error == 0)
+    {
+        ssize_t n = write(writer->fd, writer->buffer.items + written, writer->buffer.count - written);
+        if (n < 0 && errno != EINTR)
+            writer->error = errno;
+        else if (n > 0)
+            written += n;
+    }
+    // Once a write failed the rest is dropped, the output is thrown away anyway
+    writer->buffer.count = 0;
+}
+
+void spy_writer_drain(spy_writer *writer)
+{
+    if (writer->buffer.count >= SPY_WRITER_BUFFER_SIZE)
+        spy_writer_flush(writer);
+}
+
+void spy_writer_abort(spy_writer *writer)
+{
+    if (writer->fd >= 0)
+    {
+        close(writer->fd);
+        if (writer->temp_path != NULL)
+            unlink(writer->temp_path);
+    }
+    writer->fd = -1;
+    free(writer->temp_path);
+    writer->temp_path = NULL;
+    nob_sb_free(writer->buffer);
+    writer->buffer = (Nob_String_Builder){0};
+}
+
+bool spy_writer_close(spy_writer *writer)
+{
+    spy_writer_flush(writer);
+    if (close(writer->fd) < 0 && writer->error == 0)
+        writer->error = errno;
+    writer->fd = -1;
+    if (writer->error == 0 && writer->temp_path != NULL && rename(writer->temp_path, writer->path) < 0)
+        writer->error = errno;
+    if (writer->error != 0)
+    {
+        fprintf(stderr, "ERROR: Unable to write to %s: %s\n", writer->path, strerror(writer->error));
+        if (writer->temp_path != NULL)
+            unlink(writer->temp_path);
+    }
+    spy_writer_abort(writer);
+    return writer->error == 0;
+}
+
+void dump_lexer(stb_lexer *lexer, char *input_path, spy_writer *writer)
 {
+    Nob_String_Builder *output = &writer->buffer;
     stb_lex_location loc = {0};
     for (;;)
     {
+        spy_writer_drain(writer);
         p_lexer_get_token(lexer);
         p_lexer_get_location(lexer, lexer->where_firstchar, &loc);
         nob_sb_appendf(output, "%s:%d:%d-%ld: ", input_path, loc.line_number, loc.line_offset + 1, loc.line_offset + 1 + lexer->where_lastchar - lexer->where_firstchar);
@@ -270,6 +381,7 @@ enum spy_op_stmt_type
     SPY_OP_assign_binop,
     SPY_OP_declare_assign_binop,
     SPY_OP_func_call,
+    SPY_OP_tail_call,
     SPY_OP_jump,
     SPY_OP_conditional_jump,
     SPY_OP_block_mark_start,
@@ -293,15 +405,18 @@ enum spy_op_expr_binop_type
     SPY_OP_EXPR_BINOP_gte,
     SPY_OP_EXPR_BINOP_eq,
     SPY_OP_EXPR_BINOP_neq,
+    SPY_OP_EXPR_BINOP_floordiv,
+    SPY_OP_EXPR_BINOP_mod,
 };
 
+// Operands are 32 bit, which also makes `int` a 32 bit integer on every target.
 typedef struct
 {
     enum spy_op_term_type type;
     union
     {
-        size_t var_index;
-        long intlit;
+        uint32_t var_index;
+        int32_t intlit;
     } data;
 } spy_op_term;
 
@@ -312,43 +427,25 @@ typedef struct
     size_t capacity;
 } spy_op_terms;
 
+// Statements are flat 16 byte records. What the fields mean depends on `type`:
+//     SPY_OP_(declare_)assign:       index = var,    lhs = term
+//     SPY_OP_(declare_)assign_binop: index = var,    lhs, rhs = terms, binop = operation
+//     SPY_OP_func_call/tail_call:    index = callee, lhs = first argument in `operands`, rhs = argument count
+//     SPY_OP_jump, block marks:      index = target
+//     SPY_OP_conditional_jump:       index = target, lhs = condition (jumps when it is zero)
 typedef struct
 {
-    size_t var_index;
-    spy_op_term term;
-} spy_op_assign;
-
-typedef struct
-{
-    size_t var_index;
-    enum spy_op_expr_binop_type type;
-    spy_op_term lhs;
-    spy_op_term rhs;
-} spy_op_assign_binop;
-
-typedef struct
-{
-    char *name;
-    spy_op_terms args;
-} spy_op_func_call;
-
-typedef struct
-{
-    size_t index;
-} spy_op_jump;
-
-typedef struct
-{
-    enum spy_op_stmt_type type;
-    union
-    {
-        spy_op_assign assign;
-        spy_op_assign_binop assign_binop;
-        spy_op_func_call func_call;
-        spy_op_jump jump;
-    } data;
+    uint8_t type;
+    uint8_t binop;
+    uint8_t lhs_type;
+    uint8_t rhs_type;
+    uint32_t index;
+    int32_t lhs;
+    int32_t rhs;
 } spy_op_stmt;
 
+static_assert(sizeof(spy_op_stmt) == 16, "spy_op_stmt is meant to stay a 16 byte record");
+
 typedef struct
 {
     spy_op_stmt *items;
@@ -359,16 +456,113 @@ typedef struct
 typedef struct
 {
     spy_op_stmts stmts;
+    // Call arguments of every call in the function, calls index into it
+    spy_op_terms operands;
     char *name;
 } spy_op_function;
 
+typedef struct
+{
+    char **items;
+    size_t count;
+    size_t capacity;
+} spy_op_names;
+
 typedef struct
 {
     spy_op_function *items;
     size_t count;
     size_t capacity;
+    // Names of called functions, calls index into it
+    spy_op_names names;
 } spy_ops;
 
+spy_op_term spy_op_lhs(spy_op_stmt *op)
+{
+    spy_op_term term = {
+        .type = op->lhs_type,
+        .data.intlit = op->lhs,
+    };
+    return term;
+}
+
+spy_op_term spy_op_rhs(spy_op_stmt *op)
+{
+    spy_op_term term = {
+        .type = op->rhs_type,
+        .data.intlit = op->rhs,
+    };
+    return term;
+}
+
+void spy_op_set_lhs(spy_op_stmt *op, spy_op_term term)
+{
+    op->lhs_type = term.type;
+    op->lhs = term.data.intlit;
+}
+
+void spy_op_set_rhs(spy_op_stmt *op, spy_op_term term)
+{
+    op->rhs_type = term.type;
+    op->rhs = term.data.intlit;
+}
+
+spy_op_term *spy_op_args(spy_op_function *function, spy_op_stmt *op)
+{
+    return function->operands.items + op->lhs;
+}
+
+size_t spy_op_name_index(spy_op_names *names, char *name)
+{
+    for (size_t i = 0; i < names->count; i++)
+    {
+        if (str_eq(names->items[i], name))
+            return i;
+    }
+    nob_da_append(names, name);
+    return names->count - 1;
+}
+
+size_t function_vars_count(spy_op_function *function)
+{
+    size_t max = 0;
+    for (size_t i = 0; i < function->stmts.count; i++)
+    {
+        spy_op_stmt *op = function->stmts.items + i;
+        switch ((enum spy_op_stmt_type)op->type)
+        {
+        case SPY_OP_assign:
+        case SPY_OP_declare_assign:
+        case SPY_OP_assign_binop:
+        case SPY_OP_declare_assign_binop:
+            if (op->index > max)
+                max = op->index;
+            // fallthrough
+        case SPY_OP_conditional_jump:
+            if (op->lhs_type == SPY_OP_TERM_var && (size_t)op->lhs > max)
+                max = op->lhs;
+            if (op->rhs_type == SPY_OP_TERM_var && (size_t)op->rhs > max)
+                max = op->rhs;
+            break;
+        case SPY_OP_func_call:
+        case SPY_OP_tail_call:
+            // A var can be only ever read as a call argument, it still needs a slot
+            for (int32_t j = 0; j < op->rhs; j++)
+            {
+                spy_op_term *arg = spy_op_args(function, op) + j;
+                if (arg->type == SPY_OP_TERM_var && arg->data.var_index > max)
+                    max = arg->data.var_index;
+            }
+            break;
+        case SPY_OP_jump:
+        case SPY_OP_block_mark_start:
+        case SPY_OP_block_mark_end:
+            break;
+        }
+    }
+    return max + 1;
+}
+
 bool is_keyword(char *name)
 {
     for (size_t i = 0; i < sizeof KEYWORDS / sizeof(char *); i++)
@@ -386,8 +580,8 @@ bool is_keyword(char *name)
 bool token_is_at_binop_precedence(long token, size_t precedence_level)
 {
     // Get compiler error to add new types here
-    spy_op_assign_binop binop = {0};
-    switch (binop.type)
+    enum spy_op_expr_binop_type binop_type = SPY_OP_EXPR_BINOP_add;
+    switch (binop_type)
     {
     case SPY_OP_EXPR_BINOP_add:
     case SPY_OP_EXPR_BINOP_sub:
@@ -398,6 +592,8 @@ bool token_is_at_binop_precedence(long token, size_t precedence_level)
     case SPY_OP_EXPR_BINOP_gte:
     case SPY_OP_EXPR_BINOP_eq:
     case SPY_OP_EXPR_BINOP_neq:
+    case SPY_OP_EXPR_BINOP_floordiv:
+    case SPY_OP_EXPR_BINOP_mod:
         break;
     }
     switch (precedence_level)
@@ -407,7 +603,7 @@ bool token_is_at_binop_precedence(long token, size_t precedence_level)
     case 1:
         return token == '+' || token == '-';
     case 2:
-        return token == '*';
+        return token == '*' || token == PLEX_floordiv || token == '%';
     }
     fprintf(stderr, "Unreachable. Please update the precedence tables. Trying to grab %s from precedence %zu\n", pretty_token(token), precedence_level);
     exit(1);
@@ -416,8 +612,8 @@ bool token_is_at_binop_precedence(long token, size_t precedence_level)
 enum spy_op_expr_binop_type expr_binop_type_from_token_precedence(long token, size_t precedence_level)
 {
     // Get compiler error to add new types here
-    spy_op_assign_binop binop = {0};
-    switch (binop.type)
+    enum spy_op_expr_binop_type binop_type = SPY_OP_EXPR_BINOP_add;
+    switch (binop_type)
     {
     case SPY_OP_EXPR_BINOP_add:
     case SPY_OP_EXPR_BINOP_sub:
@@ -428,6 +624,8 @@ enum spy_op_expr_binop_type expr_binop_type_from_token_precedence(long token, si
     case SPY_OP_EXPR_BINOP_gte:
     case SPY_OP_EXPR_BINOP_eq:
     case SPY_OP_EXPR_BINOP_neq:
+    case SPY_OP_EXPR_BINOP_floordiv:
+    case SPY_OP_EXPR_BINOP_mod:
         break;
     }
     switch (precedence_level)
@@ -465,7 +663,11 @@ enum spy_op_expr_binop_type expr_binop_type_from_token_precedence(long token, si
         switch (token)
         {
         case '*':
-            return SPY_OP_EXPR_BINOP_add;
+            return SPY_OP_EXPR_BINOP_mul;
+        case PLEX_floordiv:
+            return SPY_OP_EXPR_BINOP_floordiv;
+        case '%':
+            return SPY_OP_EXPR_BINOP_mod;
         }
     }
     }
@@ -487,8 +689,15 @@ bool parse_expression_term(stb_lexer *lexer, char *file_path, spy_vars *vars, si
     if (lexer->token == PLEX_intlit)
     {
         expect_plex(lexer, file_path, PLEX_intlit);
+        if (lexer->int_number > INT32_MAX)
+        {
+            print_loc(lexer, file_path, lexer->where_firstchar);
+            fprintf(stderr, ": ERROR: Integer literal does not fit in 32 bits.\n");
+            print_line(lexer, lexer->where_firstchar, lexer->where_lastchar);
+            return false;
+        }
         term->type = SPY_OP_TERM_intlit;
-        term->data.intlit = lexer->int_number;
+        term->data.intlit = (int32_t)lexer->int_number;
     }
     else if (lexer->token == PLEX_id)
     {
@@ -545,21 +754,19 @@ bool parse_expression_precedence(stb_lexer *lexer, char *file_path, spy_vars *va
         (*local_variables_count)++;
         size_t index = *local_variables_count;
         spy_op_term rhs = {0};
-        spy_op_assign_binop binop = {0};
         spy_op_stmt stmt = {0};
         size_t count = 0;
-        long token = lexer->token;
         while (token_is_at_binop_precedence(lexer->token, precedence_level))
         {
+            long token = lexer->token;
             p_lexer_get_token(lexer);
             if (!parse_expression_precedence(lexer, file_path, vars, local_variables_count, ops, &rhs, precedence_level + 1))
                 return false;
-            binop.type = expr_binop_type_from_token_precedence(token, precedence_level);
-            binop.lhs = lhs;
-            binop.rhs = rhs;
-            binop.var_index = index;
             stmt.type = count > 0 ? SPY_OP_assign_binop : SPY_OP_declare_assign_binop;
-            stmt.data.assign_binop = binop;
+            stmt.binop = expr_binop_type_from_token_precedence(token, precedence_level);
+            stmt.index = index;
+            spy_op_set_lhs(&stmt, lhs);
+            spy_op_set_rhs(&stmt, rhs);
             nob_da_append(ops, stmt);
             lhs.type = SPY_OP_TERM_var;
             lhs.data.var_index = index;
@@ -580,17 +787,19 @@ bool parse_expression(stb_lexer *lexer, char *file_path, spy_vars *vars, size_t
     return parse_expression_precedence(lexer, file_path, vars, local_variables_count, ops, term, 0);
 }
 
-bool parse_statement(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_vars *vars, size_t *local_variables_count, spy_op_stmts *ops)
+bool parse_statement(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_vars *vars, size_t *local_variables_count, spy_op_names *names, spy_op_function *op_func)
 {
+    spy_op_stmts *ops = &op_func->stmts;
     // Get compiler error to add new types here
-    spy_op_stmt temp_op = {0};
-    switch (temp_op.type)
+    enum spy_op_stmt_type temp_op_type = SPY_OP_assign;
+    switch (temp_op_type)
     {
     case SPY_OP_assign:
     case SPY_OP_declare_assign:
     case SPY_OP_assign_binop:
     case SPY_OP_declare_assign_binop:
     case SPY_OP_func_call:
+    case SPY_OP_tail_call:
     case SPY_OP_conditional_jump:
     case SPY_OP_jump:
     case SPY_OP_block_mark_start:
@@ -611,9 +820,7 @@ bool parse_statement(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_va
                 size_t start_block_index = ops->count;
                 spy_op_stmt op = {
                     .type = SPY_OP_block_mark_start,
-                    .data.jump = {
-                        .index = start_block_index,
-                    },
+                    .index = start_block_index,
                 };
                 nob_da_append(ops, op);
                 spy_op_term term = {0};
@@ -630,24 +837,26 @@ bool parse_statement(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_va
                     return false;
                 size_t replace_conditional_jump_index_index = ops->count;
                 op.type = SPY_OP_conditional_jump;
+                spy_op_set_lhs(&op, term);
                 nob_da_append(ops, op);
+                spy_op_set_lhs(&op, (spy_op_term){0});
                 p_lexer_get_token(lexer);
                 while (lexer->token != PLEX_deindent && lexer->token != PLEX_eof)
                 {
-                    if (!parse_statement(lexer, file_path, funcs, vars, local_variables_count, ops))
+                    if (!parse_statement(lexer, file_path, funcs, vars, local_variables_count, names, op_func))
                         return false;
                     p_lexer_get_token(lexer);
                 }
                 long lexes[] = {PLEX_deindent, PLEX_eof};
                 expect_plexes(lexer, file_path, lexes, 2);
                 op.type = SPY_OP_jump;
-                op.data.jump.index = start_block_index;
+                op.index = start_block_index;
                 nob_da_append(ops, op);
                 size_t end_block_index = ops->count;
                 op.type = SPY_OP_block_mark_end;
-                op.data.jump.index = end_block_index;
+                op.index = end_block_index;
                 nob_da_append(ops, op);
-                (ops->items + replace_conditional_jump_index_index)->data.jump.index = end_block_index;
+                (ops->items + replace_conditional_jump_index_index)->index = end_block_index;
 
                 // print_loc(lexer, file_path, id_where);
                 // fprintf(stderr, ": ERROR: While loops are currently unsupported.\n");
@@ -659,9 +868,7 @@ bool parse_statement(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_va
                 size_t start_block_index = ops->count;
                 spy_op_stmt op = {
                     .type = SPY_OP_block_mark_start,
-                    .data.jump = {
-                        .index = start_block_index,
-                    },
+                    .index = start_block_index,
                 };
                 nob_da_append(ops, op);
                 spy_op_term term = {0};
@@ -678,11 +885,13 @@ bool parse_statement(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_va
                     return false;
                 size_t replace_conditional_jump_index_index = ops->count;
                 op.type = SPY_OP_conditional_jump;
+                spy_op_set_lhs(&op, term);
                 nob_da_append(ops, op);
+                spy_op_set_lhs(&op, (spy_op_term){0});
                 p_lexer_get_token(lexer);
                 while (lexer->token != PLEX_deindent && lexer->token != PLEX_eof)
                 {
-                    if (!parse_statement(lexer, file_path, funcs, vars, local_variables_count, ops))
+                    if (!parse_statement(lexer, file_path, funcs, vars, local_variables_count, names, op_func))
                         return false;
                     p_lexer_get_token(lexer);
                 }
@@ -690,9 +899,9 @@ bool parse_statement(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_va
                 expect_plexes(lexer, file_path, lexes, 2);
                 size_t end_block_index = ops->count;
                 op.type = SPY_OP_block_mark_end;
-                op.data.jump.index = end_block_index;
+                op.index = end_block_index;
                 nob_da_append(ops, op);
-                (ops->items + replace_conditional_jump_index_index)->data.jump.index = end_block_index;
+                (ops->items + replace_conditional_jump_index_index)->index = end_block_index;
 
                 // print_loc(lexer, file_path, id_where);
                 // fprintf(stderr, ": ERROR: While loops are currently unsupported.\n");
@@ -723,27 +932,25 @@ bool parse_statement(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_va
                 }
             }
 
-            // Function args
-            spy_op_terms terms = {0};
+            // Function args, calls cannot be nested so they end up next to each other in the operands
+            size_t first_arg = op_func->operands.count;
             p_lexer_get_token(lexer);
             while (lexer->token != ')')
             {
                 spy_op_term term = {0};
                 if (!parse_expression(lexer, file_path, vars, local_variables_count, ops, &term))
                     return false;
-                nob_da_append(&terms, term);
+                nob_da_append(&op_func->operands, term);
                 p_lexer_get_token(lexer);
             }
             // End of function call
             if (!expect_plex(lexer, file_path, ')'))
                 return false;
-            spy_op_func_call op_func_call = {
-                .name = id,
-                .args = terms,
-            };
             spy_op_stmt op = {
                 .type = SPY_OP_func_call,
-                .data.func_call = op_func_call,
+                .index = spy_op_name_index(names, id),
+                .lhs = first_arg,
+                .rhs = op_func->operands.count - first_arg,
             };
             nob_da_append(ops, op);
             p_lexer_get_token(lexer);
@@ -798,14 +1005,11 @@ bool parse_statement(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_va
                 .index = *local_variables_count,
             };
             nob_da_append(vars, var);
-            spy_op_assign op_assign = {
-                .var_index = *local_variables_count,
-                .term = term,
-            };
             spy_op_stmt op = {
                 .type = SPY_OP_declare_assign,
-                .data.assign = op_assign,
+                .index = *local_variables_count,
             };
+            spy_op_set_lhs(&op, term);
             nob_da_append(ops, op);
             p_lexer_get_token(lexer);
             if (!expect_plex(lexer, file_path, PLEX_newline))
@@ -835,14 +1039,11 @@ bool parse_statement(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_va
             spy_op_term term = {0};
             if (!parse_expression(lexer, file_path, vars, local_variables_count, ops, &term))
                 return false;
-            spy_op_assign op_assign = {
-                .var_index = var_check->index,
-                .term = term,
-            };
             spy_op_stmt op = {
                 .type = SPY_OP_assign,
-                .data.assign = op_assign,
+                .index = var_check->index,
             };
+            spy_op_set_lhs(&op, term);
             nob_da_append(ops, op);
             p_lexer_get_token(lexer);
             if (!expect_plex(lexer, file_path, PLEX_newline))
@@ -866,7 +1067,7 @@ bool parse_statement(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_va
     return true;
 }
 
-bool parse_function(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_vars *vars, spy_op_function *op_func)
+bool parse_function(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_vars *vars, spy_op_names *names, spy_op_function *op_func)
 {
     // def
     if (!expect_id(lexer, file_path, "def"))
@@ -924,7 +1125,7 @@ bool parse_function(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_var
     size_t local_variables_count = 0;
     while (lexer->token != PLEX_deindent && lexer->token != PLEX_eof)
     {
-        if (!parse_statement(lexer, file_path, funcs, vars, &local_variables_count, &op_func->stmts))
+        if (!parse_statement(lexer, file_path, funcs, vars, &local_variables_count, names, op_func))
             return false;
         p_lexer_get_token(lexer);
     }
@@ -943,7 +1144,7 @@ bool parse_program(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_vars
     while (lexer->token != PLEX_eof)
     {
         spy_op_function op_function = {0};
-        if (!parse_function(lexer, file_path, funcs, vars, &op_function))
+        if (!parse_function(lexer, file_path, funcs, vars, &ops->names, &op_function))
         {
             return false;
         }
@@ -966,579 +1167,7852 @@ bool parse_program(stb_lexer *lexer, char *file_path, spy_funcs *funcs, spy_vars
 }
 
 /*
-    COMPILER (OUTPUT)
+    OPTIMIZATIONS
 */
 
-enum spy_output_target
+bool is_tail_position(spy_op_stmts *stmts, size_t index)
 {
-    SPY_OUTPUT_TARGET_x86_64_macos,
-    SPY_OUTPUT_TARGET_aarch64_mac_m1,
-    SPY_OUTPUT_TARGET_python311,
-    SPY_OUTPUT_TARGET_dump_ir,
-    SPY_OUTPUT_TARGET_dump_lexer,
-};
+    // A statement is in tail position when nothing but labels and unconditional jumps
+    // can run between it and the end of the function.
+    size_t i = index + 1;
+    for (size_t steps = 0; i < stmts->count && steps <= stmts->count; steps++)
+    {
+        spy_op_stmt *op = stmts->items + i;
+        switch ((enum spy_op_stmt_type)op->type)
+        {
+        case SPY_OP_block_mark_start:
+        case SPY_OP_block_mark_end:
+            i++;
+            break;
+        case SPY_OP_jump:
+            i = op->index;
+            break;
+        case SPY_OP_assign:
+        case SPY_OP_declare_assign:
+        case SPY_OP_assign_binop:
+        case SPY_OP_declare_assign_binop:
+        case SPY_OP_func_call:
+        case SPY_OP_tail_call:
+        case SPY_OP_conditional_jump:
+            return false;
+        }
+    }
+    return i >= stmts->count;
+}
 
-char *TARGET_STRINGS[] = {
-    "x86-64-macos",
-    "aarch64-mac-m1",
-    "python311",
-    "ir",
-    "lexer",
-};
+bool is_spy_function(spy_ops *ops, char *name)
+{
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        if (str_eq(ops->items[i].name, name))
+            return true;
+    }
+    return false;
+}
 
-bool compile_dump_ir_term(spy_op_term *term, Nob_String_Builder *output)
+void insert_entry_block_mark(spy_op_stmts *stmts)
 {
-    switch (term->type)
+    // Jump indices are statement positions, so everything moves down by one.
+    spy_op_stmt entry = {
+        .type = SPY_OP_block_mark_start,
+        .index = 0,
+    };
+    nob_da_append(stmts, entry);
+    memmove(stmts->items + 1, stmts->items, (stmts->count - 1) * sizeof(spy_op_stmt));
+    stmts->items[0] = entry;
+    for (size_t i = 1; i < stmts->count; i++)
     {
-    case SPY_OP_TERM_intlit:
-        nob_sb_appendf(output, "(int literal) %ld", term->data.intlit);
-        break;
-    case SPY_OP_TERM_var:
-        nob_sb_appendf(output, "var_%ld", term->data.var_index);
-        break;
+        spy_op_stmt *op = stmts->items + i;
+        switch ((enum spy_op_stmt_type)op->type)
+        {
+        case SPY_OP_jump:
+        case SPY_OP_conditional_jump:
+        case SPY_OP_block_mark_start:
+        case SPY_OP_block_mark_end:
+            op->index++;
+            break;
+        case SPY_OP_assign:
+        case SPY_OP_declare_assign:
+        case SPY_OP_assign_binop:
+        case SPY_OP_declare_assign_binop:
+        case SPY_OP_func_call:
+        case SPY_OP_tail_call:
+            break;
+        }
     }
-    return true;
 }
 
-bool compile_dump_ir(spy_ops *ops, Nob_String_Builder *output)
+void optimize_tail_calls(spy_ops *ops)
 {
-    nob_sb_appendf(output, "OPS (count: %zu)\n", ops->count);
     for (size_t i = 0; i < ops->count; i++)
     {
-        spy_op_function op_function = ops->items[i];
-        spy_op_stmts op_stmts = op_function.stmts;
-        nob_sb_appendf(output, "FUNCTION `%s` (count: %zu) {\n", op_function.name, op_stmts.count);
-        for (size_t j = 0; j < op_stmts.count; j++)
+        spy_op_function *function = ops->items + i;
+        spy_op_stmts *stmts = &function->stmts;
+        bool has_self_tail_call = false;
+        for (size_t j = 0; j < stmts->count; j++)
         {
-            spy_op_stmt op_stmt = op_stmts.items[j];
-            switch (op_stmt.type)
-            {
-            case SPY_OP_assign:
-            {
-                spy_op_assign *assign = &op_stmt.data.assign;
-                spy_op_term *term = &assign->term;
-                nob_sb_appendf(output, "    OP_STATEMENT_ASSIGN [ var_%ld, ", assign->var_index);
-                if (!compile_dump_ir_term(term, output))
-                    return false;
-                nob_sb_appendf(output, " ]\n");
-                break;
-            }
-            case SPY_OP_declare_assign:
-            {
-                spy_op_assign *assign = &op_stmt.data.assign;
-                spy_op_term *term = &assign->term;
-                nob_sb_appendf(output, "    OP_STATEMENT_DECLARE_ASSIGN [ var_%ld, ", assign->var_index);
-                if (!compile_dump_ir_term(term, output))
-                    return false;
-                nob_sb_appendf(output, " ]\n");
-                break;
-            }
-            case SPY_OP_assign_binop:
-            {
-                switch (op_stmt.data.assign_binop.type)
-                {
-                case SPY_OP_EXPR_BINOP_add:
-                    nob_sb_appendf(output, "    OP_STATEMENT_ASSIGN_ADD [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_sub:
-                    nob_sb_appendf(output, "    OP_STATEMENT_ASSIGN_SUB [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_mul:
-                    nob_sb_appendf(output, "    OP_STATEMENT_ASSIGN_MUL [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_lt:
-                    nob_sb_appendf(output, "    OP_STATEMENT_ASSIGN_LT [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_gt:
-                    nob_sb_appendf(output, "    OP_STATEMENT_ASSIGN_GT [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_lte:
-                    nob_sb_appendf(output, "    OP_STATEMENT_ASSIGN_LTE [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_gte:
-                    nob_sb_appendf(output, "    OP_STATEMENT_ASSIGN_GTE [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_eq:
-                    nob_sb_appendf(output, "    OP_STATEMENT_ASSIGN_EQ [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_neq:
-                    nob_sb_appendf(output, "    OP_STATEMENT_ASSIGN_NEQ [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                }
-                if (!compile_dump_ir_term(&op_stmt.data.assign_binop.lhs, output))
-                    return false;
-                nob_sb_appendf(output, ", ");
-                if (!compile_dump_ir_term(&op_stmt.data.assign_binop.rhs, output))
-                    return false;
-                nob_sb_appendf(output, " ]\n");
-                break;
-            }
-            case SPY_OP_declare_assign_binop:
-            {
-                switch (op_stmt.data.assign_binop.type)
-                {
-                case SPY_OP_EXPR_BINOP_add:
-                    nob_sb_appendf(output, "    OP_STATEMENT_DECLARE_ASSIGN_ADD [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_sub:
-                    nob_sb_appendf(output, "    OP_STATEMENT_DECLARE_ASSIGN_SUB [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_mul:
-                    nob_sb_appendf(output, "    OP_STATEMENT_DECLARE_ASSIGN_MUL [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_lt:
-                    nob_sb_appendf(output, "    OP_STATEMENT_DECLARE_ASSIGN_LT [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_gt:
-                    nob_sb_appendf(output, "    OP_STATEMENT_DECLARE_ASSIGN_GT [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_lte:
-                    nob_sb_appendf(output, "    OP_STATEMENT_DECLARE_ASSIGN_LTE [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_gte:
-                    nob_sb_appendf(output, "    OP_STATEMENT_DECLARE_ASSIGN_GTE [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_eq:
-                    nob_sb_appendf(output, "    OP_STATEMENT_DECLARE_ASSIGN_EQ [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                case SPY_OP_EXPR_BINOP_neq:
-                    nob_sb_appendf(output, "    OP_STATEMENT_DECLARE_ASSIGN_NEQ [ var_%ld, ", op_stmt.data.assign.var_index);
-                    break;
-                }
-                if (!compile_dump_ir_term(&op_stmt.data.assign_binop.lhs, output))
-                    return false;
-                nob_sb_appendf(output, ", ");
-                if (!compile_dump_ir_term(&op_stmt.data.assign_binop.rhs, output))
-                    return false;
-                nob_sb_appendf(output, " ]\n");
-                break;
-            }
-            case SPY_OP_func_call:
+            spy_op_stmt *op = stmts->items + j;
+            if (op->type != SPY_OP_func_call || !is_tail_position(stmts, j))
+                continue;
+            // Only calls to Spy functions, they all return 0 like we do. Builtins like `putchar` return something else.
+            char *callee = ops->names.items[op->index];
+            if (!is_spy_function(ops, callee))
+                continue;
+            if (str_eq(callee, function->name))
             {
-                spy_op_func_call func_call = op_stmt.data.func_call;
-                nob_sb_appendf(output, "    OP_STATEMENT_FUNCTION_CALL [ %s, ", func_call.name);
-                for (size_t i = 0; i < func_call.args.count; i++)
-                {
-                    if (!compile_dump_ir_term(func_call.args.items + i, output))
-                        return false;
-                    if (i < func_call.args.count - 1)
-                    {
-                        nob_sb_appendf(output, ", ");
-                    }
-                }
-                nob_sb_appendf(output, " ]\n");
-                break;
-            }
-            case SPY_OP_jump:
-                nob_sb_appendf(output, "    OP_STATEMENT_JUMP [ %zu ]\n", op_stmt.data.jump.index);
-                break;
-            case SPY_OP_conditional_jump:
-                nob_sb_appendf(output, "    OP_STATEMENT_CONDITIONAL_JUMP [ %zu ]\n", op_stmt.data.jump.index);
-                break;
-            case SPY_OP_block_mark_start:
-                nob_sb_appendf(output, "    BLOCK_START [ %zu ]\n", op_stmt.data.jump.index);
-                break;
-            case SPY_OP_block_mark_end:
-                nob_sb_appendf(output, "    BLOCK_END [ %zu ]\n", op_stmt.data.jump.index);
-                break;
+                has_self_tail_call = true;
+                continue;
             }
+            op->type = SPY_OP_tail_call;
+        }
+        if (!has_self_tail_call)
+            continue;
+
+        insert_entry_block_mark(stmts);
+        spy_op_stmt entry_jump = {
+            .type = SPY_OP_jump,
+            .index = 0,
+        };
+        for (size_t j = 0; j < stmts->count; j++)
+        {
+            spy_op_stmt *op = stmts->items + j;
+            if (op->type != SPY_OP_func_call || !str_eq(ops->names.items[op->index], function->name) || !is_tail_position(stmts, j))
+                continue;
+            *op = entry_jump;
         }
-        nob_sb_appendf(output, "}\n");
     }
-    return true;
 }
 
-bool compile_dump_python311_term(spy_op_term *term, Nob_String_Builder *output)
+// `//` and `%` round towards negative infinity like Python. INT32_MIN // -1 wraps around
+// to INT32_MIN, callers check for a zero divisor first.
+int32_t spy_floordiv(int32_t lhs, int32_t rhs)
 {
-    switch (term->type)
+    if (rhs == -1)
+        return (int32_t)(0u - (uint32_t)lhs);
+    int32_t quotient = lhs / rhs;
+    if (lhs % rhs != 0 && (lhs < 0) != (rhs < 0))
+        quotient--;
+    return quotient;
+}
+
+int32_t spy_mod(int32_t lhs, int32_t rhs)
+{
+    if (rhs == -1)
+        return 0;
+    int32_t remainder = lhs % rhs;
+    if (remainder != 0 && (remainder < 0) != (rhs < 0))
+        remainder += rhs;
+    return remainder;
+}
+
+bool is_compare_binop(enum spy_op_expr_binop_type type)
+{
+    switch (type)
     {
-    case SPY_OP_TERM_intlit:
-        nob_sb_appendf(output, "%ld", term->data.intlit);
-        break;
-    case SPY_OP_TERM_var:
-        nob_sb_appendf(output, "var_%ld", term->data.var_index);
-        break;
+    case SPY_OP_EXPR_BINOP_add:
+    case SPY_OP_EXPR_BINOP_sub:
+    case SPY_OP_EXPR_BINOP_mul:
+    case SPY_OP_EXPR_BINOP_floordiv:
+    case SPY_OP_EXPR_BINOP_mod:
+        return false;
+    case SPY_OP_EXPR_BINOP_lt:
+    case SPY_OP_EXPR_BINOP_lte:
+    case SPY_OP_EXPR_BINOP_gt:
+    case SPY_OP_EXPR_BINOP_gte:
+    case SPY_OP_EXPR_BINOP_eq:
+    case SPY_OP_EXPR_BINOP_neq:
+        return true;
     }
-    return true;
+    return false;
 }
 
-bool compile_python311(spy_ops *ops, Nob_String_Builder *output)
+bool term_is_var(spy_op_term term, size_t var_index)
 {
-    for (size_t i = 0; i < ops->count; i++)
-    {
-        spy_op_function op_function = ops->items[i];
-        spy_op_stmts op_stmts = op_function.stmts;
-        nob_sb_appendf(output, "def %s() -> None:\n", op_function.name);
-        for (size_t j = 0; j < op_stmts.count; j++)
-        {
-            spy_op_stmt op_stmt = op_stmts.items[j];
-            switch (op_stmt.type)
-            {
-            case SPY_OP_assign:
+    return term.type == SPY_OP_TERM_var && term.data.var_index == var_index;
+}
+
+bool is_division_binop(enum spy_op_expr_binop_type type)
+{
+    return type == SPY_OP_EXPR_BINOP_floordiv || type == SPY_OP_EXPR_BINOP_mod;
+}
+
+int32_t fold_binop(enum spy_op_expr_binop_type type, int32_t lhs, int32_t rhs)
+{
+    // Wrap around like the 32 bit registers on the native targets do
+    switch (type)
+    {
+    case SPY_OP_EXPR_BINOP_add:
+        return (int32_t)((uint32_t)lhs + (uint32_t)rhs);
+    case SPY_OP_EXPR_BINOP_sub:
+        return (int32_t)((uint32_t)lhs - (uint32_t)rhs);
+    case SPY_OP_EXPR_BINOP_mul:
+        return (int32_t)((uint32_t)lhs * (uint32_t)rhs);
+    case SPY_OP_EXPR_BINOP_lt:
+        return lhs < rhs;
+    case SPY_OP_EXPR_BINOP_lte:
+        return lhs <= rhs;
+    case SPY_OP_EXPR_BINOP_gt:
+        return lhs > rhs;
+    case SPY_OP_EXPR_BINOP_gte:
+        return lhs >= rhs;
+    case SPY_OP_EXPR_BINOP_eq:
+        return lhs == rhs;
+    case SPY_OP_EXPR_BINOP_neq:
+        return lhs != rhs;
+    case SPY_OP_EXPR_BINOP_floordiv:
+        return spy_floordiv(lhs, rhs);
+    case SPY_OP_EXPR_BINOP_mod:
+        return spy_mod(lhs, rhs);
+    }
+    return 0;
+}
+
+void optimize_fold_constants(spy_ops *ops)
+{
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        spy_op_stmts *stmts = &ops->items[i].stmts;
+        for (size_t j = 0; j < stmts->count; j++)
+        {
+            spy_op_stmt *op = stmts->items + j;
+            if (op->type != SPY_OP_assign_binop && op->type != SPY_OP_declare_assign_binop)
+                continue;
+            if (op->lhs_type != SPY_OP_TERM_intlit || op->rhs_type != SPY_OP_TERM_intlit)
+                continue;
+            // Dividing by zero stays a runtime error
+            if (is_division_binop(op->binop) && op->rhs == 0)
+                continue;
+            spy_op_term folded = {
+                .type = SPY_OP_TERM_intlit,
+                .data.intlit = fold_binop(op->binop, op->lhs, op->rhs),
+            };
+            op->type = op->type == SPY_OP_declare_assign_binop ? SPY_OP_declare_assign : SPY_OP_assign;
+            op->binop = 0;
+            spy_op_set_lhs(op, folded);
+            spy_op_set_rhs(op, (spy_op_term){0});
+        }
+    }
+}
+
+// `while` lowers to the start mark, the condition, a conditional jump out, the body and a
+// jump back to the start, so every iteration takes two branches. Rotation tests the condition
+// once on entry and again at the bottom, where a branch back to the top of the body continues
+// the loop. The body becomes the fall-through of the entry test and the exit the fall-through
+// of the bottom test, so the only branch taken per iteration is the back edge.
+
+enum spy_op_expr_binop_type invert_compare_binop(enum spy_op_expr_binop_type type)
+{
+    switch (type)
+    {
+    case SPY_OP_EXPR_BINOP_lt:
+        return SPY_OP_EXPR_BINOP_gte;
+    case SPY_OP_EXPR_BINOP_lte:
+        return SPY_OP_EXPR_BINOP_gt;
+    case SPY_OP_EXPR_BINOP_gt:
+        return SPY_OP_EXPR_BINOP_lte;
+    case SPY_OP_EXPR_BINOP_gte:
+        return SPY_OP_EXPR_BINOP_lt;
+    case SPY_OP_EXPR_BINOP_eq:
+        return SPY_OP_EXPR_BINOP_neq;
+    case SPY_OP_EXPR_BINOP_neq:
+        return SPY_OP_EXPR_BINOP_eq;
+    case SPY_OP_EXPR_BINOP_add:
+    case SPY_OP_EXPR_BINOP_sub:
+    case SPY_OP_EXPR_BINOP_mul:
+    case SPY_OP_EXPR_BINOP_floordiv:
+    case SPY_OP_EXPR_BINOP_mod:
+        break;
+    }
+    fprintf(stderr, "Unreachable! Only comparisons can be inverted!\n");
+    exit(1);
+}
+
+bool is_binop_assign(spy_op_stmt *op)
+{
+    return op->type == SPY_OP_assign_binop || op->type == SPY_OP_declare_assign_binop;
+}
+
+// Matches a loop the parser emitted: the condition is only binops, and the statement before
+// the end mark jumps back to the start
+bool is_unrotated_loop(spy_op_stmts *stmts, size_t start, size_t *test)
+{
+    if (stmts->items[start].type != SPY_OP_block_mark_start)
+        return false;
+    size_t i = start + 1;
+    while (i < stmts->count && is_binop_assign(stmts->items + i))
+        i++;
+    if (i >= stmts->count || stmts->items[i].type != SPY_OP_conditional_jump)
+        return false;
+    size_t end = stmts->items[i].index;
+    if (end < i + 2 || end >= stmts->count || stmts->items[end].type != SPY_OP_block_mark_end)
+        return false;
+    spy_op_stmt *back = stmts->items + end - 1;
+    if (back->type != SPY_OP_jump || back->index != start)
+        return false;
+    // A loop that never runs has nothing to rotate
+    spy_op_term condition = spy_op_lhs(stmts->items + i);
+    if (condition.type == SPY_OP_TERM_intlit && condition.data.intlit == 0)
+        return false;
+    *test = i;
+    return true;
+}
+
+void rotate_loop(spy_op_function *function, size_t start, size_t test)
+{
+    spy_op_stmts *stmts = &function->stmts;
+    size_t end = stmts->items[test].index;
+    spy_op_term condition = spy_op_lhs(stmts->items + test);
+    // Jump indices are statement positions, `positions` maps the old ones to the new ones
+    size_t *positions = malloc((stmts->count + 1) * sizeof(size_t));
+    bool *moved = calloc(stmts->count * 2 + 4, sizeof(bool));
+    spy_op_stmts rotated = {0};
+    for (size_t i = 0; i < stmts->count; i++)
+    {
+        if (i == end - 1)
+        {
+            // The jump back becomes a copy of the test that branches to the top of the body
+            positions[i] = rotated.count;
+            size_t head = test + 1;
+            if (condition.type == SPY_OP_TERM_intlit)
+            {
+                spy_op_stmt jump = {.type = SPY_OP_jump, .index = head};
+                nob_da_append(&rotated, jump);
+                continue;
+            }
+            // The copy writes a fresh variable, so each comparison is only read by its own jump
+            uint32_t fresh = function_vars_count(function);
+            bool inverted = false;
+            for (size_t j = start + 1; j < test; j++)
+            {
+                spy_op_stmt op = stmts->items[j];
+                op.type = SPY_OP_assign_binop;
+                if (j + 1 == test && is_compare_binop(op.binop) && term_is_var(condition, op.index))
+                {
+                    op.binop = invert_compare_binop(op.binop);
+                    op.index = fresh;
+                    op.type = SPY_OP_declare_assign_binop;
+                    inverted = true;
+                }
+                nob_da_append(&rotated, op);
+            }
+            if (!inverted)
+            {
+                spy_op_stmt op = {.type = SPY_OP_declare_assign_binop, .binop = SPY_OP_EXPR_BINOP_eq, .index = fresh};
+                spy_op_set_lhs(&op, condition);
+                spy_op_set_rhs(&op, (spy_op_term){.type = SPY_OP_TERM_intlit, .data.intlit = 0});
+                nob_da_append(&rotated, op);
+            }
+            spy_op_stmt branch = {.type = SPY_OP_conditional_jump, .index = head};
+            spy_op_set_lhs(&branch, (spy_op_term){.type = SPY_OP_TERM_var, .data.var_index = fresh});
+            nob_da_append(&rotated, branch);
+            continue;
+        }
+        positions[i] = rotated.count;
+        moved[rotated.count] = true;
+        nob_da_append(&rotated, stmts->items[i]);
+        if (i == test)
+        {
+            spy_op_stmt head = {.type = SPY_OP_block_mark_start, .index = rotated.count};
+            nob_da_append(&rotated, head);
+        }
+    }
+    for (size_t i = 0; i < rotated.count; i++)
+    {
+        spy_op_stmt *op = rotated.items + i;
+        if (!moved[i])
+            continue;
+        switch ((enum spy_op_stmt_type)op->type)
+        {
+        case SPY_OP_jump:
+        case SPY_OP_conditional_jump:
+        case SPY_OP_block_mark_start:
+        case SPY_OP_block_mark_end:
+            op->index = positions[op->index];
+            break;
+        case SPY_OP_assign:
+        case SPY_OP_declare_assign:
+        case SPY_OP_assign_binop:
+        case SPY_OP_declare_assign_binop:
+        case SPY_OP_func_call:
+        case SPY_OP_tail_call:
+            break;
+        }
+    }
+    nob_da_free(*stmts);
+    *stmts = rotated;
+    free(moved);
+    free(positions);
+}
+
+void optimize_rotate_loops(spy_ops *ops)
+{
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        spy_op_function *function = ops->items + i;
+        size_t test = 0;
+        // Rotated loops no longer match, so every loop is rotated once
+        for (size_t j = 0; j < function->stmts.count; j++)
+        {
+            if (is_unrotated_loop(&function->stmts, j, &test))
+                rotate_loop(function, j, test);
+        }
+    }
+}
+
+/*
+    PASS MANAGER
+*/
+
+typedef struct
+{
+    char *name;
+    void (*run)(spy_ops *ops);
+} spy_pass;
+
+enum spy_opt_level
+{
+    SPY_OPT_LEVEL_O0,
+    SPY_OPT_LEVEL_O1,
+    SPY_OPT_LEVEL_O2,
+    SPY_OPT_LEVEL_Os,
+};
+
+spy_pass PASSES_O1[] = {
+    {"fold-constants", optimize_fold_constants},
+    {"tail-calls", optimize_tail_calls},
+};
+
+spy_pass PASSES_O2[] = {
+    {"fold-constants", optimize_fold_constants},
+    {"tail-calls", optimize_tail_calls},
+    {"rotate-loops", optimize_rotate_loops},
+};
+
+// Like O1, passes that trade code size for speed do not belong here
+spy_pass PASSES_Os[] = {
+    {"fold-constants", optimize_fold_constants},
+    {"tail-calls", optimize_tail_calls},
+};
+
+typedef struct
+{
+    char *name;
+    double milliseconds;
+    size_t stmts_count;
+    size_t ir_bytes;
+} spy_pass_stat;
+
+typedef struct
+{
+    spy_pass_stat *items;
+    size_t count;
+    size_t capacity;
+} spy_pass_stats;
+
+double time_in_milliseconds(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+void ir_size(spy_ops *ops, size_t *stmts_count, size_t *ir_bytes)
+{
+    *stmts_count = 0;
+    *ir_bytes = 0;
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        *stmts_count += ops->items[i].stmts.count;
+        *ir_bytes += ops->items[i].stmts.count * sizeof(spy_op_stmt) + ops->items[i].operands.count * sizeof(spy_op_term);
+    }
+}
+
+void passes_for_level(enum spy_opt_level level, spy_pass **passes, size_t *passes_count)
+{
+    switch (level)
+    {
+    case SPY_OPT_LEVEL_O0:
+        *passes = NULL;
+        *passes_count = 0;
+        return;
+    case SPY_OPT_LEVEL_O1:
+        *passes = PASSES_O1;
+        *passes_count = sizeof PASSES_O1 / sizeof(spy_pass);
+        return;
+    case SPY_OPT_LEVEL_O2:
+        *passes = PASSES_O2;
+        *passes_count = sizeof PASSES_O2 / sizeof(spy_pass);
+        return;
+    case SPY_OPT_LEVEL_Os:
+        *passes = PASSES_Os;
+        *passes_count = sizeof PASSES_Os / sizeof(spy_pass);
+        return;
+    }
+}
+
+void run_passes(spy_ops *ops, enum spy_opt_level level, spy_pass_stats *stats)
+{
+    spy_pass *passes = NULL;
+    size_t passes_count = 0;
+    passes_for_level(level, &passes, &passes_count);
+
+    spy_pass_stat stat = {.name = "(input)"};
+    ir_size(ops, &stat.stmts_count, &stat.ir_bytes);
+    nob_da_append(stats, stat);
+    for (size_t i = 0; i < passes_count; i++)
+    {
+        double start = time_in_milliseconds();
+        passes[i].run(ops);
+        stat.name = passes[i].name;
+        stat.milliseconds = time_in_milliseconds() - start;
+        ir_size(ops, &stat.stmts_count, &stat.ir_bytes);
+        nob_da_append(stats, stat);
+    }
+}
+
+void print_pass_stats(spy_pass_stats *stats, FILE *stream)
+{
+    fprintf(stream, "%-20s %12s %10s %10s\n", "PASS", "TIME (ms)", "STMTS", "IR BYTES");
+    for (size_t i = 0; i < stats->count; i++)
+    {
+        spy_pass_stat *stat = stats->items + i;
+        fprintf(stream, "%-20s %12.3f %10zu %10zu\n", stat->name, stat->milliseconds, stat->stmts_count, stat->ir_bytes);
+    }
+}
+
+/*
+    SERIALIZED IR (.spyir)
+*/
+
+// A .spyir file is the lowered IR laid out so that it can be mmap-ed and handed to the backends as is:
+//
+//     spy_ir_header
+//     spy_ir_function[functions_count]
+//     uint32_t[names_count]            offsets of the call names in the string table
+//     per function: spy_op_stmt[stmts_count], then spy_op_term[operands_count]
+//     string table                     NUL terminated strings
+//
+// Every section starts 8 byte aligned. Numbers are in host byte order, `endian` tells if that matches.
+
+#define SPY_IR_MAGIC "SPYIR\0\0\0"
+#define SPY_IR_VERSION 2
+#define SPY_IR_ENDIAN 0x01020304
+// Backends size frames and register allocations by the number of vars, a corrupted count must not get that far
+#define SPY_IR_VARS_MAX (1 << 20)
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t functions_count;
+    uint32_t names_count;
+    uint64_t functions_offset;
+    uint64_t names_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+} spy_ir_header;
+
+typedef struct
+{
+    uint32_t name;
+    uint32_t stmts_count;
+    uint32_t operands_count;
+    uint32_t vars_count; // Every var index in the function is below it
+    uint64_t stmts_offset;
+    uint64_t operands_offset;
+} spy_ir_function;
+
+static_assert(sizeof(spy_op_term) == 8, "spy_op_term is written to .spyir files as is");
+static_assert(sizeof(spy_ir_header) == 56, "spy_ir_header is written to .spyir files as is");
+static_assert(sizeof(spy_ir_function) == 32, "spy_ir_function is written to .spyir files as is");
+
+typedef struct
+{
+    void *data;
+    size_t size;
+} spy_ir_file;
+
+void spyir_align(Nob_String_Builder *output)
+{
+    while (output->count % 8 != 0)
+        nob_da_append(output, '\0');
+}
+
+uint32_t spyir_append_string(Nob_String_Builder *strings, char *string)
+{
+    uint32_t offset = strings->count;
+    nob_sb_append_cstr(strings, string);
+    nob_sb_append_null(strings);
+    return offset;
+}
+
+bool compile_spyir(spy_ops *ops, Nob_String_Builder *output)
+{
+    Nob_String_Builder strings = {0};
+    spy_ir_header header = {
+        .magic = SPY_IR_MAGIC,
+        .version = SPY_IR_VERSION,
+        .endian = SPY_IR_ENDIAN,
+        .functions_count = ops->count,
+        .names_count = ops->names.count,
+    };
+    size_t header_start = output->count;
+    nob_sb_append_buf(output, &header, sizeof header);
+
+    header.functions_offset = output->count - header_start;
+    size_t functions_start = output->count;
+    spy_ir_function empty_function = {0};
+    for (size_t i = 0; i < ops->count; i++)
+        nob_sb_append_buf(output, &empty_function, sizeof empty_function);
+
+    header.names_offset = output->count - header_start;
+    for (size_t i = 0; i < ops->names.count; i++)
+    {
+        uint32_t offset = spyir_append_string(&strings, ops->names.items[i]);
+        nob_sb_append_buf(output, &offset, sizeof offset);
+    }
+    spyir_align(output);
+
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        spy_op_function *function = ops->items + i;
+        spy_ir_function ir_function = {
+            .name = spyir_append_string(&strings, function->name),
+            .stmts_count = function->stmts.count,
+            .operands_count = function->operands.count,
+            .vars_count = function_vars_count(function),
+        };
+        ir_function.stmts_offset = output->count - header_start;
+        // Functions without calls have no operands, and memcpy must not be given their NULL items
+        if (function->stmts.count > 0)
+            nob_sb_append_buf(output, function->stmts.items, function->stmts.count * sizeof(spy_op_stmt));
+        ir_function.operands_offset = output->count - header_start;
+        if (function->operands.count > 0)
+            nob_sb_append_buf(output, function->operands.items, function->operands.count * sizeof(spy_op_term));
+        memcpy(output->items + functions_start + i * sizeof ir_function, &ir_function, sizeof ir_function);
+    }
+
+    header.strings_offset = output->count - header_start;
+    header.strings_size = strings.count;
+    nob_sb_append_buf(output, strings.items, strings.count);
+    spyir_align(output);
+    memcpy(output->items + header_start, &header, sizeof header);
+    nob_sb_free(strings);
+    return true;
+}
+
+bool spyir_range_ok(uint64_t offset, uint64_t count, uint64_t size, size_t file_size)
+{
+    return offset % 8 == 0 && offset <= file_size && count <= (file_size - offset) / size;
+}
+
+bool spyir_string_ok(spy_ir_header *header, uint32_t offset)
+{
+    return offset < header->strings_size;
+}
+
+bool spyir_var_ok(enum spy_op_term_type type, uint32_t var_index, uint32_t vars_count)
+{
+    return type != SPY_OP_TERM_var || var_index < vars_count;
+}
+
+bool validate_spyir_function(spy_ir_header *header, spy_op_function *function, uint32_t vars_count)
+{
+    for (size_t i = 0; i < function->stmts.count; i++)
+    {
+        spy_op_stmt *op = function->stmts.items + i;
+        if (op->binop > SPY_OP_EXPR_BINOP_mod || op->lhs_type > SPY_OP_TERM_var || op->rhs_type > SPY_OP_TERM_var)
+            return false;
+        switch ((enum spy_op_stmt_type)op->type)
+        {
+        case SPY_OP_assign:
+        case SPY_OP_declare_assign:
+        case SPY_OP_assign_binop:
+        case SPY_OP_declare_assign_binop:
+            if (op->index >= vars_count || !spyir_var_ok(op->lhs_type, op->lhs, vars_count) || !spyir_var_ok(op->rhs_type, op->rhs, vars_count))
+                return false;
+            break;
+        case SPY_OP_func_call:
+        case SPY_OP_tail_call:
+            if (op->index >= header->names_count || op->lhs < 0 || op->rhs < 0 || (size_t)op->lhs + op->rhs > function->operands.count)
+                return false;
+            for (int32_t j = 0; j < op->rhs; j++)
+            {
+                spy_op_term *arg = spy_op_args(function, op) + j;
+                if (arg->type > SPY_OP_TERM_var || !spyir_var_ok(arg->type, arg->data.var_index, vars_count))
+                    return false;
+            }
+            break;
+        case SPY_OP_conditional_jump:
+            if (!spyir_var_ok(op->lhs_type, op->lhs, vars_count) || !spyir_var_ok(op->rhs_type, op->rhs, vars_count))
+                return false;
+            // fallthrough
+        case SPY_OP_jump:
+        case SPY_OP_block_mark_start:
+        case SPY_OP_block_mark_end:
+            if (op->index >= function->stmts.count)
+                return false;
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+bool load_spyir(char *file_path, spy_ir_file *file, spy_ops *ops)
+{
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Unable to read file `%s`: %s\n", file_path, strerror(errno));
+        return false;
+    }
+    struct stat st = {0};
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(spy_ir_header))
+    {
+        fprintf(stderr, "%s: ERROR: Not a .spyir file.\n", file_path);
+        close(fd);
+        return false;
+    }
+    file->size = st.st_size;
+    file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file->data == MAP_FAILED)
+    {
+        fprintf(stderr, "Unable to map file `%s`: %s\n", file_path, strerror(errno));
+        file->data = NULL;
+        return false;
+    }
+
+    char *data = file->data;
+    spy_ir_header *header = file->data;
+    if (memcmp(header->magic, SPY_IR_MAGIC, sizeof header->magic) != 0)
+    {
+        fprintf(stderr, "%s: ERROR: Not a .spyir file.\n", file_path);
+        return false;
+    }
+    if (header->endian != SPY_IR_ENDIAN)
+    {
+        fprintf(stderr, "%s: ERROR: .spyir file was written on a host with a different byte order.\n", file_path);
+        return false;
+    }
+    if (header->version != SPY_IR_VERSION)
+    {
+        fprintf(stderr, "%s: ERROR: Unsupported .spyir version %u, expected %u.\n", file_path, header->version, SPY_IR_VERSION);
+        return false;
+    }
+    if (!spyir_range_ok(header->functions_offset, header->functions_count, sizeof(spy_ir_function), file->size) ||
+        !spyir_range_ok(header->names_offset, header->names_count, sizeof(uint32_t), file->size) ||
+        !spyir_range_ok(header->strings_offset, header->strings_size, 1, file->size) ||
+        header->strings_size == 0 || data[header->strings_offset + header->strings_size - 1] != '\0')
+    {
+        fprintf(stderr, "%s: ERROR: Corrupted .spyir file.\n", file_path);
+        return false;
+    }
+
+    char *strings = data + header->strings_offset;
+    uint32_t *names = (uint32_t *)(data + header->names_offset);
+    for (size_t i = 0; i < header->names_count; i++)
+    {
+        if (!spyir_string_ok(header, names[i]))
+        {
+            fprintf(stderr, "%s: ERROR: Corrupted .spyir file.\n", file_path);
+            return false;
+        }
+        nob_da_append(&ops->names, strings + names[i]);
+    }
+
+    // The statements and operands are used straight from the mapping. Their capacity stays 0, nothing may append to them.
+    spy_ir_function *functions = (spy_ir_function *)(data + header->functions_offset);
+    bool found_main = false;
+    for (size_t i = 0; i < header->functions_count; i++)
+    {
+        spy_ir_function *ir_function = functions + i;
+        if (!spyir_string_ok(header, ir_function->name) ||
+            !spyir_range_ok(ir_function->stmts_offset, ir_function->stmts_count, sizeof(spy_op_stmt), file->size) ||
+            !spyir_range_ok(ir_function->operands_offset, ir_function->operands_count, sizeof(spy_op_term), file->size) ||
+            ir_function->vars_count > SPY_IR_VARS_MAX)
+        {
+            fprintf(stderr, "%s: ERROR: Corrupted .spyir file.\n", file_path);
+            return false;
+        }
+        spy_op_function function = {
+            .name = strings + ir_function->name,
+            .stmts = {
+                .items = (spy_op_stmt *)(data + ir_function->stmts_offset),
+                .count = ir_function->stmts_count,
+            },
+            .operands = {
+                .items = (spy_op_term *)(data + ir_function->operands_offset),
+                .count = ir_function->operands_count,
+            },
+        };
+        if (!validate_spyir_function(header, &function, ir_function->vars_count))
+        {
+            fprintf(stderr, "%s: ERROR: Corrupted .spyir file, invalid statement in function `%s`.\n", file_path, function.name);
+            return false;
+        }
+        if (str_eq(function.name, "main"))
+        {
+            found_main = true;
+        }
+        nob_da_append(ops, function);
+    }
+
+    if (!found_main)
+    {
+        fprintf(stderr, "%s: ERROR: Program does not contain a main function (no entry point).\n", file_path);
+        return false;
+    }
+    return true;
+}
+
+void unload_spyir(spy_ir_file *file)
+{
+    if (file->data != NULL)
+        munmap(file->data, file->size);
+    file->data = NULL;
+}
+
+/*
+    COMPILER (OUTPUT)
+*/
+
+enum spy_output_target
+{
+    SPY_OUTPUT_TARGET_x86_64_macos,
+    SPY_OUTPUT_TARGET_x86_64_linux,
+    SPY_OUTPUT_TARGET_aarch64_mac_m1,
+    SPY_OUTPUT_TARGET_python311,
+    SPY_OUTPUT_TARGET_dump_ir,
+    SPY_OUTPUT_TARGET_dump_lexer,
+    SPY_OUTPUT_TARGET_spyir,
+    SPY_OUTPUT_TARGET_run,
+    SPY_OUTPUT_TARGET_spyc,
+    SPY_OUTPUT_TARGET_jit,
+    SPY_OUTPUT_TARGET_aarch64_linux,
+    SPY_OUTPUT_TARGET_c,
+    SPY_OUTPUT_TARGET_llvm,
+    SPY_OUTPUT_TARGET_pyc311,
+};
+
+char *TARGET_STRINGS[] = {
+    "x86-64-macos",
+    "x86-64-linux",
+    "aarch64-mac-m1",
+    "python311",
+    "ir",
+    "lexer",
+    "spyir",
+    "run",
+    "spyc",
+    "jit",
+    "aarch64-linux",
+    "c",
+    "llvm",
+    "pyc311",
+};
+
+bool compile_dump_ir_term(spy_op_term *term, Nob_String_Builder *output)
+{
+    switch (term->type)
+    {
+    case SPY_OP_TERM_intlit:
+        nob_sb_appendf(output, "(int literal) %d", term->data.intlit);
+        break;
+    case SPY_OP_TERM_var:
+        nob_sb_appendf(output, "var_%u", term->data.var_index);
+        break;
+    }
+    return true;
+}
+
+char *dump_ir_binop_name(enum spy_op_expr_binop_type type)
+{
+    switch (type)
+    {
+    case SPY_OP_EXPR_BINOP_add:
+        return "ADD";
+    case SPY_OP_EXPR_BINOP_sub:
+        return "SUB";
+    case SPY_OP_EXPR_BINOP_mul:
+        return "MUL";
+    case SPY_OP_EXPR_BINOP_lt:
+        return "LT";
+    case SPY_OP_EXPR_BINOP_gt:
+        return "GT";
+    case SPY_OP_EXPR_BINOP_lte:
+        return "LTE";
+    case SPY_OP_EXPR_BINOP_gte:
+        return "GTE";
+    case SPY_OP_EXPR_BINOP_eq:
+        return "EQ";
+    case SPY_OP_EXPR_BINOP_neq:
+        return "NEQ";
+    case SPY_OP_EXPR_BINOP_floordiv:
+        return "FLOORDIV";
+    case SPY_OP_EXPR_BINOP_mod:
+        return "MOD";
+    }
+    return "UNKNOWN";
+}
+
+bool compile_dump_ir(spy_ops *ops, spy_writer *writer)
+{
+    Nob_String_Builder *output = &writer->buffer;
+    nob_sb_appendf(output, "OPS (count: %zu)\n", ops->count);
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        spy_writer_drain(writer);
+        spy_op_function *op_function = ops->items + i;
+        spy_op_stmts op_stmts = op_function->stmts;
+        nob_sb_appendf(output, "FUNCTION `%s` (count: %zu) {\n", op_function->name, op_stmts.count);
+        for (size_t j = 0; j < op_stmts.count; j++)
+        {
+            spy_op_stmt *op_stmt = op_stmts.items + j;
+            spy_op_term lhs = spy_op_lhs(op_stmt);
+            spy_op_term rhs = spy_op_rhs(op_stmt);
+            switch ((enum spy_op_stmt_type)op_stmt->type)
+            {
+            case SPY_OP_assign:
+                nob_sb_appendf(output, "    OP_STATEMENT_ASSIGN [ var_%u, ", op_stmt->index);
+                if (!compile_dump_ir_term(&lhs, output))
+                    return false;
+                nob_sb_appendf(output, " ]\n");
+                break;
+            case SPY_OP_declare_assign:
+                nob_sb_appendf(output, "    OP_STATEMENT_DECLARE_ASSIGN [ var_%u, ", op_stmt->index);
+                if (!compile_dump_ir_term(&lhs, output))
+                    return false;
+                nob_sb_appendf(output, " ]\n");
+                break;
+            case SPY_OP_assign_binop:
+            case SPY_OP_declare_assign_binop:
+                nob_sb_appendf(output, "    OP_STATEMENT_%sASSIGN_%s [ var_%u, ",
+                               op_stmt->type == SPY_OP_declare_assign_binop ? "DECLARE_" : "",
+                               dump_ir_binop_name(op_stmt->binop), op_stmt->index);
+                if (!compile_dump_ir_term(&lhs, output))
+                    return false;
+                nob_sb_appendf(output, ", ");
+                if (!compile_dump_ir_term(&rhs, output))
+                    return false;
+                nob_sb_appendf(output, " ]\n");
+                break;
+            case SPY_OP_func_call:
+            case SPY_OP_tail_call:
+            {
+                char *name = ops->names.items[op_stmt->index];
+                spy_op_term *args = spy_op_args(op_function, op_stmt);
+                if (op_stmt->type == SPY_OP_tail_call)
+                    nob_sb_appendf(output, "    OP_STATEMENT_TAIL_CALL [ %s, ", name);
+                else
+                    nob_sb_appendf(output, "    OP_STATEMENT_FUNCTION_CALL [ %s, ", name);
+                for (int32_t i = 0; i < op_stmt->rhs; i++)
+                {
+                    if (!compile_dump_ir_term(args + i, output))
+                        return false;
+                    if (i < op_stmt->rhs - 1)
+                    {
+                        nob_sb_appendf(output, ", ");
+                    }
+                }
+                nob_sb_appendf(output, " ]\n");
+                break;
+            }
+            case SPY_OP_jump:
+                nob_sb_appendf(output, "    OP_STATEMENT_JUMP [ %u ]\n", op_stmt->index);
+                break;
+            case SPY_OP_conditional_jump:
+                nob_sb_appendf(output, "    OP_STATEMENT_CONDITIONAL_JUMP [ %u, ", op_stmt->index);
+                if (!compile_dump_ir_term(&lhs, output))
+                    return false;
+                nob_sb_appendf(output, " ]\n");
+                break;
+            case SPY_OP_block_mark_start:
+                nob_sb_appendf(output, "    BLOCK_START [ %u ]\n", op_stmt->index);
+                break;
+            case SPY_OP_block_mark_end:
+                nob_sb_appendf(output, "    BLOCK_END [ %u ]\n", op_stmt->index);
+                break;
+            }
+        }
+        nob_sb_appendf(output, "}\n");
+    }
+    return true;
+}
+
+bool compile_dump_python311_term(spy_op_term *term, Nob_String_Builder *output)
+{
+    switch (term->type)
+    {
+    case SPY_OP_TERM_intlit:
+        nob_sb_appendf(output, "%d", term->data.intlit);
+        break;
+    case SPY_OP_TERM_var:
+        nob_sb_appendf(output, "var_%u", term->data.var_index);
+        break;
+    }
+    return true;
+}
+
+char *python311_binop(enum spy_op_expr_binop_type type)
+{
+    switch (type)
+    {
+    case SPY_OP_EXPR_BINOP_add:
+        return " + ";
+    case SPY_OP_EXPR_BINOP_sub:
+        return " - ";
+    case SPY_OP_EXPR_BINOP_mul:
+        return " * ";
+    case SPY_OP_EXPR_BINOP_lt:
+        return " < ";
+    case SPY_OP_EXPR_BINOP_gt:
+        return " > ";
+    case SPY_OP_EXPR_BINOP_lte:
+        return " <= ";
+    case SPY_OP_EXPR_BINOP_gte:
+        return " >= ";
+    case SPY_OP_EXPR_BINOP_eq:
+        return " == ";
+    case SPY_OP_EXPR_BINOP_neq:
+        return " != ";
+    case SPY_OP_EXPR_BINOP_floordiv:
+        return " // ";
+    case SPY_OP_EXPR_BINOP_mod:
+        return " % ";
+    }
+    return " ? ";
+}
+
+bool is_var_read(spy_op_function *function, spy_op_stmt *op, size_t var_index)
+{
+    switch ((enum spy_op_stmt_type)op->type)
+    {
+    case SPY_OP_assign:
+    case SPY_OP_declare_assign:
+    case SPY_OP_conditional_jump:
+        return term_is_var(spy_op_lhs(op), var_index);
+    case SPY_OP_assign_binop:
+    case SPY_OP_declare_assign_binop:
+        return term_is_var(spy_op_lhs(op), var_index) || term_is_var(spy_op_rhs(op), var_index);
+    case SPY_OP_func_call:
+    case SPY_OP_tail_call:
+    {
+        spy_op_term *args = spy_op_args(function, op);
+        for (int32_t i = 0; i < op->rhs; i++)
+        {
+            if (term_is_var(args[i], var_index))
+                return true;
+        }
+        return false;
+    }
+    case SPY_OP_jump:
+    case SPY_OP_block_mark_start:
+    case SPY_OP_block_mark_end:
+        return false;
+    }
+    return false;
+}
+
+bool spy_op_defines_var(spy_op_stmt *op, uint32_t var_index)
+{
+    switch ((enum spy_op_stmt_type)op->type)
+    {
+    case SPY_OP_assign:
+    case SPY_OP_declare_assign:
+    case SPY_OP_assign_binop:
+    case SPY_OP_declare_assign_binop:
+        return op->index == var_index;
+    default:
+        return false;
+    }
+}
+
+bool compile_c_term(spy_op_term *term, Nob_String_Builder *output)
+{
+    switch (term->type)
+    {
+    case SPY_OP_TERM_intlit:
+        // -2147483648 is a negated long in C
+        if (term->data.intlit == INT32_MIN)
+            nob_sb_appendf(output, "INT32_MIN");
+        else
+            nob_sb_appendf(output, "%d", term->data.intlit);
+        break;
+    case SPY_OP_TERM_var:
+        nob_sb_appendf(output, "var_%u", term->data.var_index);
+        break;
+    }
+    return true;
+}
+
+char *c_binop(enum spy_op_expr_binop_type type)
+{
+    switch (type)
+    {
+    case SPY_OP_EXPR_BINOP_add:
+        return " + ";
+    case SPY_OP_EXPR_BINOP_sub:
+        return " - ";
+    case SPY_OP_EXPR_BINOP_mul:
+        return " * ";
+    case SPY_OP_EXPR_BINOP_lt:
+        return " < ";
+    case SPY_OP_EXPR_BINOP_gt:
+        return " > ";
+    case SPY_OP_EXPR_BINOP_lte:
+        return " <= ";
+    case SPY_OP_EXPR_BINOP_gte:
+        return " >= ";
+    case SPY_OP_EXPR_BINOP_eq:
+        return " == ";
+    case SPY_OP_EXPR_BINOP_neq:
+        return " != ";
+    case SPY_OP_EXPR_BINOP_floordiv:
+        return "spy_floordiv";
+    case SPY_OP_EXPR_BINOP_mod:
+        return "spy_mod";
+    }
+    return " ? ";
+}
+
+bool compile_c_binop(spy_op_stmt *op_stmt, Nob_String_Builder *output)
+{
+    spy_op_term lhs = spy_op_lhs(op_stmt);
+    spy_op_term rhs = spy_op_rhs(op_stmt);
+    if (is_division_binop(op_stmt->binop))
+    {
+        nob_sb_appendf(output, "%s(", c_binop(op_stmt->binop));
+        compile_c_term(&lhs, output);
+        nob_sb_appendf(output, ", ");
+        compile_c_term(&rhs, output);
+        nob_sb_appendf(output, ")");
+        return true;
+    }
+    if (is_compare_binop(op_stmt->binop))
+    {
+        compile_c_term(&lhs, output);
+        nob_sb_appendf(output, "%s", c_binop(op_stmt->binop));
+        compile_c_term(&rhs, output);
+        return true;
+    }
+    // Signed overflow is undefined in C, Spy wraps around
+    nob_sb_appendf(output, "(int32_t)((uint32_t)");
+    compile_c_term(&lhs, output);
+    nob_sb_appendf(output, "%s(uint32_t)", c_binop(op_stmt->binop));
+    compile_c_term(&rhs, output);
+    nob_sb_appendf(output, ")");
+    return true;
+}
+
+// Division and modulo round towards negative infinity like Python
+const char *C_PRELUDE =
+    "#include <stdint.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "\n"
+    "static void spy_division_by_zero(void)\n"
+    "{\n"
+    "    fprintf(stderr, \"ERROR: Division by zero.\\n\");\n"
+    "    exit(1);\n"
+    "}\n"
+    "\n"
+    "static inline int32_t spy_floordiv(int32_t lhs, int32_t rhs)\n"
+    "{\n"
+    "    if (rhs == 0)\n"
+    "        spy_division_by_zero();\n"
+    "    if (rhs == -1)\n"
+    "        return (int32_t)(0u - (uint32_t)lhs);\n"
+    "    int32_t quotient = lhs / rhs;\n"
+    "    if (lhs % rhs != 0 && (lhs < 0) != (rhs < 0))\n"
+    "        quotient--;\n"
+    "    return quotient;\n"
+    "}\n"
+    "\n"
+    "static inline int32_t spy_mod(int32_t lhs, int32_t rhs)\n"
+    "{\n"
+    "    if (rhs == 0)\n"
+    "        spy_division_by_zero();\n"
+    "    if (rhs == -1)\n"
+    "        return 0;\n"
+    "    int32_t remainder = lhs % rhs;\n"
+    "    if (remainder != 0 && (remainder < 0) != (rhs < 0))\n"
+    "        remainder += rhs;\n"
+    "    return remainder;\n"
+    "}\n"
+    "\n";
+
+bool compile_c_function(spy_ops *ops, spy_op_function *op_function, Nob_String_Builder *output)
+{
+    spy_op_stmts op_stmts = op_function->stmts;
+    nob_sb_appendf(output, "static void spy_%s(void)\n{\n", op_function->name);
+    // Only vars that are used and the targets of jumps are declared, anything else warns
+    size_t vars_count = function_vars_count(op_function);
+    bool *is_used = calloc(vars_count + 1, sizeof(bool));
+    bool *is_target = calloc(op_stmts.count + 1, sizeof(bool));
+    for (size_t j = 0; j < op_stmts.count; j++)
+    {
+        spy_op_stmt *op_stmt = op_stmts.items + j;
+        switch ((enum spy_op_stmt_type)op_stmt->type)
+        {
+        case SPY_OP_assign:
+        case SPY_OP_declare_assign:
+        case SPY_OP_assign_binop:
+        case SPY_OP_declare_assign_binop:
+            is_used[op_stmt->index] = true;
+            break;
+        case SPY_OP_func_call:
+        case SPY_OP_tail_call:
+            for (int32_t k = 0; k < op_stmt->rhs; k++)
+            {
+                spy_op_term *arg = spy_op_args(op_function, op_stmt) + k;
+                if (arg->type == SPY_OP_TERM_var)
+                    is_used[arg->data.var_index] = true;
+            }
+            break;
+        case SPY_OP_jump:
+        case SPY_OP_conditional_jump:
+            is_target[op_stmt->index] = true;
+            break;
+        default:
+            break;
+        }
+    }
+    // Every var is a C local, the C compiler does register allocation
+    for (size_t j = 0; j < vars_count; j++)
+    {
+        if (is_used[j])
+            nob_sb_appendf(output, "    int32_t var_%zu = 0;\n", j);
+    }
+    bool result = true;
+    for (size_t j = 0; j < op_stmts.count && result; j++)
+    {
+        spy_op_stmt *op_stmt = op_stmts.items + j;
+        spy_op_term lhs = spy_op_lhs(op_stmt);
+        switch ((enum spy_op_stmt_type)op_stmt->type)
+        {
+        case SPY_OP_assign:
+        case SPY_OP_declare_assign:
+            nob_sb_appendf(output, "    var_%u = ", op_stmt->index);
+            compile_c_term(&lhs, output);
+            nob_sb_appendf(output, ";\n");
+            break;
+        case SPY_OP_assign_binop:
+        case SPY_OP_declare_assign_binop:
+            nob_sb_appendf(output, "    var_%u = ", op_stmt->index);
+            compile_c_binop(op_stmt, output);
+            nob_sb_appendf(output, ";\n");
+            break;
+        case SPY_OP_func_call:
+        case SPY_OP_tail_call:
+        {
+            char *name = ops->names.items[op_stmt->index];
+            spy_op_term *args = spy_op_args(op_function, op_stmt);
+            if (str_eq(name, "putchar") && op_stmt->rhs == 1)
+            {
+                nob_sb_appendf(output, "    putchar(");
+                compile_c_term(args, output);
+                nob_sb_appendf(output, ");\n");
+            }
+            else if (op_stmt->rhs == 0)
+            {
+                nob_sb_appendf(output, "    spy_%s();\n", name);
+            }
+            else
+            {
+                fprintf(stderr, "Compiling calls to `%s` with %d arguments on `c` is not supported yet!\n", name, op_stmt->rhs);
+                result = false;
+                break;
+            }
+            // The C compiler turns this into a sibling call
+            if (op_stmt->type == SPY_OP_tail_call)
+                nob_sb_appendf(output, "    return;\n");
+            break;
+        }
+        case SPY_OP_jump:
+            nob_sb_appendf(output, "    goto label_%u;\n", op_stmt->index);
+            break;
+        case SPY_OP_conditional_jump:
+            nob_sb_appendf(output, "    if (!");
+            compile_c_term(&lhs, output);
+            nob_sb_appendf(output, ")\n        goto label_%u;\n", op_stmt->index);
+            break;
+        case SPY_OP_block_mark_start:
+        case SPY_OP_block_mark_end:
+            if (is_target[op_stmt->index])
+                nob_sb_appendf(output, "label_%u:;\n", op_stmt->index);
+            break;
+        }
+    }
+    nob_sb_appendf(output, "}\n\n");
+    free(is_used);
+    free(is_target);
+    return result;
+}
+
+bool compile_c(spy_ops *ops, spy_writer *writer)
+{
+    Nob_String_Builder *output = &writer->buffer;
+    // Spy names are prefixed so they can not clash with C keywords or libc
+    nob_sb_append_cstr(output, C_PRELUDE);
+    bool has_main = false;
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        nob_sb_appendf(output, "static void spy_%s(void);\n", ops->items[i].name);
+        has_main = has_main || str_eq(ops->items[i].name, "main");
+    }
+    nob_sb_appendf(output, "\n");
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        spy_writer_drain(writer);
+        if (!compile_c_function(ops, ops->items + i, output))
+            return false;
+    }
+    if (has_main)
+        nob_sb_appendf(output, "int main(void)\n{\n    spy_main();\n    return 0;\n}\n");
+    return true;
+}
+
+typedef struct
+{
+    bool is_temp;
+    int32_t value; // An integer literal, or the number of a %t temporary
+} llvm_value;
+
+llvm_value compile_llvm_load(spy_op_term term, uint32_t *temps, Nob_String_Builder *output)
+{
+    if (term.type == SPY_OP_TERM_intlit)
+        return (llvm_value){.value = term.data.intlit};
+    uint32_t temp = (*temps)++;
+    nob_sb_appendf(output, "    %%t%u = load i32, ptr %%var_%u\n", temp, term.data.var_index);
+    return (llvm_value){.is_temp = true, .value = temp};
+}
+
+void print_llvm_value(llvm_value value, Nob_String_Builder *output)
+{
+    if (value.is_temp)
+        nob_sb_appendf(output, "%%t%d", value.value);
+    else
+        nob_sb_appendf(output, "%d", value.value);
+}
+
+char *llvm_binop(enum spy_op_expr_binop_type type)
+{
+    switch (type)
+    {
+    case SPY_OP_EXPR_BINOP_add:
+        return "add";
+    case SPY_OP_EXPR_BINOP_sub:
+        return "sub";
+    case SPY_OP_EXPR_BINOP_mul:
+        return "mul";
+    case SPY_OP_EXPR_BINOP_lt:
+        return "icmp slt";
+    case SPY_OP_EXPR_BINOP_gt:
+        return "icmp sgt";
+    case SPY_OP_EXPR_BINOP_lte:
+        return "icmp sle";
+    case SPY_OP_EXPR_BINOP_gte:
+        return "icmp sge";
+    case SPY_OP_EXPR_BINOP_eq:
+        return "icmp eq";
+    case SPY_OP_EXPR_BINOP_neq:
+        return "icmp ne";
+    case SPY_OP_EXPR_BINOP_floordiv:
+        return "call i32 @spy_floordiv";
+    case SPY_OP_EXPR_BINOP_mod:
+        return "call i32 @spy_mod";
+    }
+    return "?";
+}
+
+void compile_llvm_binop(spy_op_stmt *op_stmt, uint32_t *temps, Nob_String_Builder *output)
+{
+    llvm_value lhs = compile_llvm_load(spy_op_lhs(op_stmt), temps, output);
+    llvm_value rhs = compile_llvm_load(spy_op_rhs(op_stmt), temps, output);
+    uint32_t result = (*temps)++;
+    if (is_division_binop(op_stmt->binop))
+    {
+        nob_sb_appendf(output, "    %%t%u = %s(i32 ", result, llvm_binop(op_stmt->binop));
+        print_llvm_value(lhs, output);
+        nob_sb_appendf(output, ", i32 ");
+        print_llvm_value(rhs, output);
+        nob_sb_appendf(output, ")\n");
+    }
+    else
+    {
+        // Without nsw the arithmetic wraps around like Spy's
+        nob_sb_appendf(output, "    %%t%u = %s i32 ", result, llvm_binop(op_stmt->binop));
+        print_llvm_value(lhs, output);
+        nob_sb_appendf(output, ", ");
+        print_llvm_value(rhs, output);
+        nob_sb_appendf(output, "\n");
+    }
+    if (is_compare_binop(op_stmt->binop))
+    {
+        uint32_t extended = (*temps)++;
+        nob_sb_appendf(output, "    %%t%u = zext i1 %%t%u to i32\n", extended, result);
+        result = extended;
+    }
+    nob_sb_appendf(output, "    store i32 %%t%u, ptr %%var_%u\n", result, op_stmt->index);
+}
+
+// sdiv and srem are undefined for a zero divisor and for INT32_MIN / -1, both are handled before dividing
+const char *LLVM_PRELUDE =
+    "declare i32 @putchar(i32)\n"
+    "declare i64 @write(i32, ptr, i64)\n"
+    "declare void @exit(i32) noreturn\n"
+    "\n"
+    "@spy_division_by_zero_message = private unnamed_addr constant [25 x i8] c\"ERROR: Division by zero.\\0A\"\n"
+    "\n"
+    "define internal void @spy_division_by_zero() noreturn cold {\n"
+    "entry:\n"
+    "    call i64 @write(i32 2, ptr @spy_division_by_zero_message, i64 25)\n"
+    "    call void @exit(i32 1)\n"
+    "    unreachable\n"
+    "}\n"
+    "\n"
+    "define internal i32 @spy_floordiv(i32 %lhs, i32 %rhs) alwaysinline {\n"
+    "entry:\n"
+    "    %zero = icmp eq i32 %rhs, 0\n"
+    "    br i1 %zero, label %error, label %nonzero\n"
+    "error:\n"
+    "    call void @spy_division_by_zero()\n"
+    "    unreachable\n"
+    "nonzero:\n"
+    "    %minus_one = icmp eq i32 %rhs, -1\n"
+    "    br i1 %minus_one, label %negate, label %divide\n"
+    "negate:\n"
+    "    %negated = sub i32 0, %lhs\n"
+    "    ret i32 %negated\n"
+    "divide:\n"
+    "    %quotient = sdiv i32 %lhs, %rhs\n"
+    "    %remainder = srem i32 %lhs, %rhs\n"
+    "    %inexact = icmp ne i32 %remainder, 0\n"
+    "    %signs = xor i32 %remainder, %rhs\n"
+    "    %opposite = icmp slt i32 %signs, 0\n"
+    "    %round_down = and i1 %inexact, %opposite\n"
+    "    %adjust = zext i1 %round_down to i32\n"
+    "    %result = sub i32 %quotient, %adjust\n"
+    "    ret i32 %result\n"
+    "}\n"
+    "\n"
+    "define internal i32 @spy_mod(i32 %lhs, i32 %rhs) alwaysinline {\n"
+    "entry:\n"
+    "    %zero = icmp eq i32 %rhs, 0\n"
+    "    br i1 %zero, label %error, label %nonzero\n"
+    "error:\n"
+    "    call void @spy_division_by_zero()\n"
+    "    unreachable\n"
+    "nonzero:\n"
+    "    %minus_one = icmp eq i32 %rhs, -1\n"
+    "    br i1 %minus_one, label %exact, label %divide\n"
+    "exact:\n"
+    "    ret i32 0\n"
+    "divide:\n"
+    "    %remainder = srem i32 %lhs, %rhs\n"
+    "    %inexact = icmp ne i32 %remainder, 0\n"
+    "    %signs = xor i32 %remainder, %rhs\n"
+    "    %opposite = icmp slt i32 %signs, 0\n"
+    "    %round_down = and i1 %inexact, %opposite\n"
+    "    %adjusted = add i32 %remainder, %rhs\n"
+    "    %result = select i1 %round_down, i32 %adjusted, i32 %remainder\n"
+    "    ret i32 %result\n"
+    "}\n"
+    "\n";
+
+bool compile_llvm_function(spy_ops *ops, spy_op_function *op_function, Nob_String_Builder *output)
+{
+    spy_op_stmts op_stmts = op_function->stmts;
+    nob_sb_appendf(output, "define internal void @spy_%s() {\nentry:\n", op_function->name);
+    // Every var is a stack slot, mem2reg promotes them to SSA values
+    size_t vars_count = function_vars_count(op_function);
+    for (size_t j = 0; j < vars_count; j++)
+        nob_sb_appendf(output, "    %%var_%zu = alloca i32\n", j);
+    // Every basic block ends in a terminator. Block marks start blocks, and whatever
+    // follows a branch or return without a block mark first is in a block of its own.
+    uint32_t temps = 0;
+    bool terminated = false;
+    bool result = true;
+    for (size_t j = 0; j < op_stmts.count && result; j++)
+    {
+        spy_op_stmt *op_stmt = op_stmts.items + j;
+        bool is_mark = op_stmt->type == SPY_OP_block_mark_start || op_stmt->type == SPY_OP_block_mark_end;
+        if (terminated && !is_mark)
+        {
+            nob_sb_appendf(output, "block_%zu:\n", j);
+            terminated = false;
+        }
+        switch ((enum spy_op_stmt_type)op_stmt->type)
+        {
+        case SPY_OP_assign:
+        case SPY_OP_declare_assign:
+        {
+            llvm_value value = compile_llvm_load(spy_op_lhs(op_stmt), &temps, output);
+            nob_sb_appendf(output, "    store i32 ");
+            print_llvm_value(value, output);
+            nob_sb_appendf(output, ", ptr %%var_%u\n", op_stmt->index);
+            break;
+        }
+        case SPY_OP_assign_binop:
+        case SPY_OP_declare_assign_binop:
+            compile_llvm_binop(op_stmt, &temps, output);
+            break;
+        case SPY_OP_func_call:
+        case SPY_OP_tail_call:
+        {
+            char *name = ops->names.items[op_stmt->index];
+            char *tail = op_stmt->type == SPY_OP_tail_call ? "tail " : "";
+            if (str_eq(name, "putchar") && op_stmt->rhs == 1)
+            {
+                llvm_value arg = compile_llvm_load(spy_op_args(op_function, op_stmt)[0], &temps, output);
+                nob_sb_appendf(output, "    %scall i32 @putchar(i32 ", tail);
+                print_llvm_value(arg, output);
+                nob_sb_appendf(output, ")\n");
+            }
+            else if (op_stmt->rhs == 0)
+            {
+                nob_sb_appendf(output, "    %scall void @spy_%s()\n", tail, name);
+            }
+            else
+            {
+                fprintf(stderr, "Compiling calls to `%s` with %d arguments on `llvm` is not supported yet!\n", name, op_stmt->rhs);
+                result = false;
+                break;
+            }
+            if (op_stmt->type == SPY_OP_tail_call)
+            {
+                nob_sb_appendf(output, "    ret void\n");
+                terminated = true;
+            }
+            break;
+        }
+        case SPY_OP_jump:
+            nob_sb_appendf(output, "    br label %%label_%u\n", op_stmt->index);
+            terminated = true;
+            break;
+        case SPY_OP_conditional_jump:
+        {
+            llvm_value condition = compile_llvm_load(spy_op_lhs(op_stmt), &temps, output);
+            // A constant condition either always jumps or never does
+            if (!condition.is_temp)
+            {
+                if (condition.value == 0)
+                {
+                    nob_sb_appendf(output, "    br label %%label_%u\n", op_stmt->index);
+                    terminated = true;
+                }
+                break;
+            }
+            uint32_t is_zero = temps++;
+            nob_sb_appendf(output, "    %%t%u = icmp eq i32 %%t%d, 0\n", is_zero, condition.value);
+            nob_sb_appendf(output, "    br i1 %%t%u, label %%label_%u, label %%block_%zu\n", is_zero, op_stmt->index, j + 1);
+            nob_sb_appendf(output, "block_%zu:\n", j + 1);
+            break;
+        }
+        case SPY_OP_block_mark_start:
+        case SPY_OP_block_mark_end:
+            if (!terminated)
+                nob_sb_appendf(output, "    br label %%label_%u\n", op_stmt->index);
+            nob_sb_appendf(output, "label_%u:\n", op_stmt->index);
+            terminated = false;
+            break;
+        }
+    }
+    if (!terminated)
+        nob_sb_appendf(output, "    ret void\n");
+    nob_sb_appendf(output, "}\n\n");
+    return result;
+}
+
+bool compile_llvm(spy_ops *ops, spy_writer *writer)
+{
+    Nob_String_Builder *output = &writer->buffer;
+    // Spy names are prefixed so they can not clash with libc
+    nob_sb_append_cstr(output, LLVM_PRELUDE);
+    bool has_main = false;
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        spy_writer_drain(writer);
+        if (!compile_llvm_function(ops, ops->items + i, output))
+            return false;
+        has_main = has_main || str_eq(ops->items[i].name, "main");
+    }
+    if (has_main)
+        nob_sb_appendf(output, "define i32 @main() {\nentry:\n    call void @spy_main()\n    ret i32 0\n}\n");
+    return true;
+}
+
+bool can_fuse_compare_and_branch(spy_op_function *function, size_t index)
+{
+    // A comparison whose result is only read by the conditional jump right after it
+    // never needs to be materialised, the flags are enough.
+    spy_op_stmts *stmts = &function->stmts;
+    if (index + 1 >= stmts->count)
+        return false;
+    spy_op_stmt *op = stmts->items + index;
+    spy_op_stmt *jump = stmts->items + index + 1;
+    if (op->type != SPY_OP_assign_binop && op->type != SPY_OP_declare_assign_binop)
+        return false;
+    if (!is_compare_binop(op->binop))
+        return false;
+    size_t var_index = op->index;
+    if (jump->type != SPY_OP_conditional_jump || !term_is_var(spy_op_lhs(jump), var_index))
+        return false;
+    for (size_t i = 0; i < stmts->count; i++)
+    {
+        spy_op_stmt *other = stmts->items + i;
+        if (i == index + 1)
+            continue;
+        // Chained comparisons like `a < b < c` read the temporary right after writing it
+        if ((other->type == SPY_OP_assign_binop || other->type == SPY_OP_declare_assign_binop) && other->index == var_index)
+            continue;
+        if (is_var_read(function, other, var_index))
+            return false;
+    }
+    return true;
+}
+
+// Python has no goto, so the jumps and block marks are turned back into `if`, `while`
+// and `for` statements. A jump that leaves a block becomes `break`, `continue` or
+// `return`, and anything else is reported instead of being compiled wrong.
+typedef struct
+{
+    spy_ops *ops;
+    spy_op_function *function;
+    size_t loop_head; // Where `continue` goes, SIZE_MAX when it can not be used
+    size_t loop_exit; // Where `break` goes, SIZE_MAX outside of loops
+    Nob_String_Builder *output;
+} python311_context;
+
+bool compile_python311_block(python311_context *ctx, size_t lo, size_t hi, size_t depth);
+
+void python311_indent(Nob_String_Builder *output, size_t depth)
+{
+    for (size_t i = 0; i < depth; i++)
+        nob_sb_append_cstr(output, "    ");
+}
+
+bool python311_same_term(spy_op_term a, spy_op_term b)
+{
+    if (a.type != b.type)
+        return false;
+    if (a.type == SPY_OP_TERM_intlit)
+        return a.data.intlit == b.data.intlit;
+    return a.data.var_index == b.data.var_index;
+}
+
+bool python311_is_jump_to(spy_op_stmt *op, size_t target)
+{
+    return (op->type == SPY_OP_jump || op->type == SPY_OP_conditional_jump) && op->index == target;
+}
+
+size_t python311_skip_marks(spy_op_function *function, size_t index)
+{
+    // Jumping to a block mark is jumping to whatever follows it
+    while (index < function->stmts.count &&
+           (function->stmts.items[index].type == SPY_OP_block_mark_start || function->stmts.items[index].type == SPY_OP_block_mark_end))
+        index++;
+    return index;
+}
+
+size_t python311_last_jump_to(spy_op_function *function, size_t target)
+{
+    size_t last = SIZE_MAX;
+    for (size_t i = 0; i < function->stmts.count; i++)
+    {
+        if (python311_is_jump_to(function->stmts.items + i, target))
+            last = i;
+    }
+    return last;
+}
+
+size_t python311_jumps_to(spy_op_function *function, size_t target)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < function->stmts.count; i++)
+        count += python311_is_jump_to(function->stmts.items + i, target);
+    return count;
+}
+
+bool python311_is_putchar(python311_context *ctx, spy_op_stmt *op)
+{
+    return (op->type == SPY_OP_func_call || op->type == SPY_OP_tail_call) && op->rhs == 1 &&
+           str_eq(ctx->ops->names.items[op->index], "putchar");
+}
+
+bool python311_is_constant_putchar(python311_context *ctx, spy_op_stmt *op)
+{
+    return op->type == SPY_OP_func_call && python311_is_putchar(ctx, op) &&
+           spy_op_args(ctx->function, op)[0].type == SPY_OP_TERM_intlit;
+}
+
+void compile_python311_condition(python311_context *ctx, size_t jump_index, bool jumps)
+{
+    // Prints what makes the conditional jump at `jump_index` fall through, or jump
+    spy_op_stmt *jump = ctx->function->stmts.items + jump_index;
+    if (jump_index > 0 && can_fuse_compare_and_branch(ctx->function, jump_index - 1))
+    {
+        spy_op_stmt *compare = jump - 1;
+        spy_op_term lhs = spy_op_lhs(compare);
+        spy_op_term rhs = spy_op_rhs(compare);
+        compile_dump_python311_term(&lhs, ctx->output);
+        nob_sb_append_cstr(ctx->output, python311_binop(jumps ? invert_compare_binop(compare->binop) : compare->binop));
+        compile_dump_python311_term(&rhs, ctx->output);
+        return;
+    }
+    spy_op_term condition = spy_op_lhs(jump);
+    if (jumps)
+        nob_sb_append_cstr(ctx->output, "not ");
+    compile_dump_python311_term(&condition, ctx->output);
+}
+
+bool compile_python311_jump(python311_context *ctx, size_t target, size_t depth)
+{
+    spy_op_function *function = ctx->function;
+    size_t to = python311_skip_marks(function, target);
+    char *statement;
+    if (to == function->stmts.count)
+        statement = "return";
+    else if (ctx->loop_exit != SIZE_MAX && to == python311_skip_marks(function, ctx->loop_exit))
+        statement = "break";
+    else if (ctx->loop_head != SIZE_MAX && to == python311_skip_marks(function, ctx->loop_head))
+        statement = "continue";
+    else
+        return false;
+    python311_indent(ctx->output, depth);
+    nob_sb_appendf(ctx->output, "%s\n", statement);
+    return true;
+}
+
+bool python311_can_overflow(spy_op_stmt *op_stmt)
+{
+    spy_op_term rhs = spy_op_rhs(op_stmt);
+    switch ((enum spy_op_expr_binop_type)op_stmt->binop)
+    {
+    case SPY_OP_EXPR_BINOP_add:
+    case SPY_OP_EXPR_BINOP_sub:
+    case SPY_OP_EXPR_BINOP_mul:
+        return true;
+    case SPY_OP_EXPR_BINOP_floordiv:
+        // Only -2147483648 // -1 leaves the 32 bit range
+        return rhs.type == SPY_OP_TERM_var || rhs.data.intlit == -1;
+    default:
+        return false;
+    }
+}
+
+void compile_python311_binop(spy_op_stmt *op_stmt, Nob_String_Builder *output)
+{
+    // Python integers never overflow, Spy wraps around at 32 bits
+    spy_op_term lhs = spy_op_lhs(op_stmt);
+    spy_op_term rhs = spy_op_rhs(op_stmt);
+    bool wrap = python311_can_overflow(op_stmt);
+    if (wrap)
+        nob_sb_append_cstr(output, "(");
+    compile_dump_python311_term(&lhs, output);
+    nob_sb_append_cstr(output, python311_binop(op_stmt->binop));
+    compile_dump_python311_term(&rhs, output);
+    if (wrap)
+        nob_sb_append_cstr(output, " + 0x80000000 & 0xFFFFFFFF) - 0x80000000");
+}
+
+void compile_python311_stmt(python311_context *ctx, spy_op_stmt *op_stmt, size_t depth)
+{
+    Nob_String_Builder *output = ctx->output;
+    spy_op_term lhs = spy_op_lhs(op_stmt);
+    python311_indent(output, depth);
+    switch ((enum spy_op_stmt_type)op_stmt->type)
+    {
+    case SPY_OP_assign:
+        nob_sb_appendf(output, "var_%u = ", op_stmt->index);
+        compile_dump_python311_term(&lhs, output);
+        break;
+    case SPY_OP_declare_assign:
+        nob_sb_appendf(output, "var_%u: int = ", op_stmt->index);
+        compile_dump_python311_term(&lhs, output);
+        break;
+    case SPY_OP_assign_binop:
+    case SPY_OP_declare_assign_binop:
+        if (op_stmt->type == SPY_OP_declare_assign_binop)
+            nob_sb_appendf(output, "var_%u: int = ", op_stmt->index);
+        else
+            nob_sb_appendf(output, "var_%u = ", op_stmt->index);
+        compile_python311_binop(op_stmt, output);
+        break;
+    case SPY_OP_func_call:
+    case SPY_OP_tail_call:
+    {
+        spy_op_term *args = spy_op_args(ctx->function, op_stmt);
+        if (op_stmt->type == SPY_OP_tail_call)
+            nob_sb_append_cstr(output, "return ");
+        if (python311_is_putchar(ctx, op_stmt))
+        {
+            nob_sb_append_cstr(output, "spy_write(spy_bytes[");
+            compile_dump_python311_term(args, output);
+            nob_sb_append_cstr(output, " & 255])");
+            break;
+        }
+        nob_sb_appendf(output, "%s(", ctx->ops->names.items[op_stmt->index]);
+        for (int32_t i = 0; i < op_stmt->rhs; i++)
+        {
+            compile_dump_python311_term(args + i, output);
+            if (i < op_stmt->rhs - 1)
+                nob_sb_append_cstr(output, ", ");
+        }
+        nob_sb_append_cstr(output, ")");
+        break;
+    }
+    case SPY_OP_jump:
+    case SPY_OP_conditional_jump:
+    case SPY_OP_block_mark_start:
+    case SPY_OP_block_mark_end:
+        break;
+    }
+    nob_sb_append_cstr(output, "\n");
+}
+
+size_t compile_python311_putchar_run(python311_context *ctx, size_t index, size_t hi, size_t depth)
+{
+    // Consecutive constant putchars are written as one bytes literal
+    Nob_String_Builder *output = ctx->output;
+    python311_indent(output, depth);
+    nob_sb_append_cstr(output, "spy_write(b\"");
+    size_t end = index;
+    while (end < hi && python311_is_constant_putchar(ctx, ctx->function->stmts.items + end))
+    {
+        uint8_t c = (uint8_t)spy_op_args(ctx->function, ctx->function->stmts.items + end)[0].data.intlit;
+        if (c >= ' ' && c <= '~' && c != '"' && c != '\\')
+            nob_da_append(output, (char)c);
+        else if (c == '\n')
+            nob_sb_append_cstr(output, "\\n");
+        else
+            nob_sb_appendf(output, "\\x%02x", c);
+        end++;
+    }
+    nob_sb_append_cstr(output, "\")\n");
+    return end;
+}
+
+bool python311_is_rotated_loop(spy_op_function *function, size_t jump_index, size_t exit)
+{
+    // c = a < b; CJUMP [exit, c]; BLOCK_START head; ...; f = a >= b; CJUMP [head, f]; BLOCK_END exit
+    spy_op_stmt *stmts = function->stmts.items;
+    size_t head = jump_index + 1;
+    if (jump_index == 0 || exit < head + 3 || stmts[head].type != SPY_OP_block_mark_start)
+        return false;
+    if (!can_fuse_compare_and_branch(function, jump_index - 1) || !can_fuse_compare_and_branch(function, exit - 2))
+        return false;
+    spy_op_stmt *test = stmts + jump_index - 1;
+    spy_op_stmt *retest = stmts + exit - 2;
+    if (!python311_is_jump_to(stmts + exit - 1, head) || retest->binop != invert_compare_binop(test->binop))
+        return false;
+    if (!python311_same_term(spy_op_lhs(test), spy_op_lhs(retest)) || !python311_same_term(spy_op_rhs(test), spy_op_rhs(retest)))
+        return false;
+    // Anything else jumping back to the head would skip the test
+    return python311_jumps_to(function, head) == 1;
+}
+
+bool compile_python311_for_range(python311_context *ctx, size_t jump_index, size_t body_lo, size_t body_hi, size_t loop_lo, size_t loop_hi, size_t depth)
+{
+    // `while i < n: ...; i = i + 1` is `for i in range(i, n)` when nothing else in the
+    // body touches `i` or `n`, which runs the loop in C instead of bytecode.
+    spy_op_function *function = ctx->function;
+    spy_op_stmt *stmts = function->stmts.items;
+    if (jump_index == 0 || !can_fuse_compare_and_branch(function, jump_index - 1))
+        return false;
+    spy_op_stmt *compare = stmts + jump_index - 1;
+    spy_op_term counter = spy_op_lhs(compare);
+    spy_op_term bound = spy_op_rhs(compare);
+    if (compare->binop != SPY_OP_EXPR_BINOP_lt || counter.type != SPY_OP_TERM_var || python311_same_term(counter, bound))
+        return false;
+    uint32_t var_index = counter.data.var_index;
+    spy_op_term one = {.type = SPY_OP_TERM_intlit, .data.intlit = 1};
+    size_t increment;
+    spy_op_stmt *last = stmts + body_hi - 1;
+    if (body_hi > body_lo && is_binop_assign(last) && last->index == var_index && last->binop == SPY_OP_EXPR_BINOP_add &&
+        ((python311_same_term(spy_op_lhs(last), counter) && python311_same_term(spy_op_rhs(last), one)) ||
+         (python311_same_term(spy_op_lhs(last), one) && python311_same_term(spy_op_rhs(last), counter))))
+    {
+        increment = body_hi - 1;
+    }
+    else if (body_hi > body_lo + 1 && last->type == SPY_OP_assign && last->index == var_index && spy_op_lhs(last).type == SPY_OP_TERM_var)
+    {
+        // Without optimizations the sum goes through a temporary first
+        spy_op_stmt *sum = last - 1;
+        uint32_t temporary = spy_op_lhs(last).data.var_index;
+        if (!is_binop_assign(sum) || sum->index != temporary || sum->binop != SPY_OP_EXPR_BINOP_add ||
+            !((python311_same_term(spy_op_lhs(sum), counter) && python311_same_term(spy_op_rhs(sum), one)) ||
+              (python311_same_term(spy_op_lhs(sum), one) && python311_same_term(spy_op_rhs(sum), counter))))
+            return false;
+        for (size_t i = 0; i < function->stmts.count; i++)
+        {
+            if (i != body_hi - 1 && is_var_read(function, stmts + i, temporary))
+                return false;
+            if (i != body_hi - 2 && spy_op_defines_var(stmts + i, temporary))
+                return false;
+        }
+        increment = body_hi - 2;
+    }
+    else
+    {
+        return false;
+    }
+    for (size_t i = body_lo; i < increment; i++)
+    {
+        spy_op_stmt *op = stmts + i;
+        if (spy_op_defines_var(op, var_index) || (bound.type == SPY_OP_TERM_var && spy_op_defines_var(op, bound.data.var_index)))
+            return false;
+        // `break` and `continue` would skip or repeat the increment
+        bool jump = op->type == SPY_OP_jump || op->type == SPY_OP_conditional_jump;
+        if (jump && (op->index < body_lo || op->index > increment) && python311_skip_marks(function, op->index) != function->stmts.count)
+            return false;
+    }
+
+    Nob_String_Builder *output = ctx->output;
+    python311_indent(output, depth);
+    nob_sb_appendf(output, "for var_%u in range(var_%u, ", var_index, var_index);
+    compile_dump_python311_term(&bound, output);
+    nob_sb_append_cstr(output, "):\n");
+    python311_context body = *ctx;
+    body.loop_head = SIZE_MAX;
+    body.loop_exit = SIZE_MAX;
+    if (!compile_python311_block(&body, body_lo, increment, depth + 1))
+        return false;
+    // The loop leaves `i` one short of where the while loop would have
+    for (size_t i = 0; i < function->stmts.count; i++)
+    {
+        if ((i < loop_lo || i >= loop_hi) && is_var_read(function, stmts + i, var_index))
+        {
+            python311_indent(output, depth);
+            nob_sb_appendf(output, "var_%u = max(var_%u, ", var_index, var_index);
+            compile_dump_python311_term(&bound, output);
+            nob_sb_append_cstr(output, ")\n");
+            break;
+        }
+    }
+    return true;
+}
+
+bool compile_python311_while(python311_context *ctx, size_t jump_index, size_t loop_head, size_t body_lo, size_t body_hi, size_t loop_lo, size_t loop_exit, size_t depth)
+{
+    size_t start = ctx->output->count;
+    if (compile_python311_for_range(ctx, jump_index, body_lo, body_hi, loop_lo, loop_exit, depth))
+        return true;
+    ctx->output->count = start;
+    python311_indent(ctx->output, depth);
+    nob_sb_append_cstr(ctx->output, "while ");
+    compile_python311_condition(ctx, jump_index, false);
+    nob_sb_append_cstr(ctx->output, ":\n");
+    python311_context body = *ctx;
+    body.loop_head = loop_head;
+    body.loop_exit = loop_exit;
+    return compile_python311_block(&body, body_lo, body_hi, depth + 1);
+}
+
+bool compile_python311_loop(python311_context *ctx, size_t head, size_t back, size_t hi, size_t depth, size_t *next)
+{
+    // `head` is a block mark that `back` jumps back to
+    spy_op_function *function = ctx->function;
+    spy_op_stmt *stmts = function->stmts.items;
+    Nob_String_Builder *output = ctx->output;
+    size_t start = output->count;
+
+    // BLOCK_START head; c = a < b; CJUMP [exit, c]; ...; JUMP [head]; BLOCK_END exit
+    size_t test = head + 1;
+    if (test < back && can_fuse_compare_and_branch(function, test))
+        test++;
+    if (stmts[back].type == SPY_OP_jump && test < back && python311_is_jump_to(stmts + test, back + 1))
+    {
+        if (compile_python311_while(ctx, test, head, test + 1, back, head, back + 1, depth))
+        {
+            *next = back + 1;
+            return true;
+        }
+        output->count = start;
+    }
+
+    // A loop with the test at the bottom, or none at all
+    python311_context body = *ctx;
+    body.loop_head = head;
+    body.loop_exit = back + 1;
+    size_t body_hi = back;
+    if (stmts[back].type == SPY_OP_conditional_jump && back > 0 && can_fuse_compare_and_branch(function, back - 1))
+        body_hi--;
+    python311_indent(output, depth);
+    nob_sb_append_cstr(output, "while True:\n");
+    if (compile_python311_block(&body, head + 1, body_hi, depth + 1))
+    {
+        if (stmts[back].type == SPY_OP_conditional_jump)
+        {
+            python311_indent(output, depth + 1);
+            nob_sb_append_cstr(output, "if ");
+            compile_python311_condition(ctx, back, false);
+            nob_sb_append_cstr(output, ":\n");
+            python311_indent(output, depth + 2);
+            nob_sb_append_cstr(output, "break\n");
+        }
+        *next = back + 1;
+        return true;
+    }
+    output->count = start;
+
+    // Back edges from inside nested blocks, like a self tail call turned into a jump
+    body.loop_exit = hi;
+    python311_indent(output, depth);
+    nob_sb_append_cstr(output, "while True:\n");
+    if (!compile_python311_block(&body, head + 1, hi, depth + 1))
+        return false;
+    python311_indent(output, depth + 1);
+    nob_sb_append_cstr(output, "break\n");
+    *next = hi;
+    return true;
+}
+
+bool compile_python311_branch(python311_context *ctx, size_t jump_index, size_t hi, size_t depth, size_t *next)
+{
+    spy_op_function *function = ctx->function;
+    Nob_String_Builder *output = ctx->output;
+    size_t target = function->stmts.items[jump_index].index;
+    if (target > jump_index && target <= hi)
+    {
+        size_t start = output->count;
+        if (python311_is_rotated_loop(function, jump_index, target))
+        {
+            // `continue` would skip the test at the bottom
+            if (compile_python311_while(ctx, jump_index, SIZE_MAX, jump_index + 2, target - 2, jump_index - 1, target, depth))
+            {
+                *next = target;
+                return true;
+            }
+            output->count = start;
+        }
+        python311_indent(output, depth);
+        nob_sb_append_cstr(output, "if ");
+        compile_python311_condition(ctx, jump_index, false);
+        nob_sb_append_cstr(output, ":\n");
+        *next = target;
+        return compile_python311_block(ctx, jump_index + 1, target, depth + 1);
+    }
+    python311_indent(output, depth);
+    nob_sb_append_cstr(output, "if ");
+    compile_python311_condition(ctx, jump_index, true);
+    nob_sb_append_cstr(output, ":\n");
+    *next = jump_index + 1;
+    return compile_python311_jump(ctx, target, depth + 1);
+}
+
+bool compile_python311_block(python311_context *ctx, size_t lo, size_t hi, size_t depth)
+{
+    spy_op_function *function = ctx->function;
+    size_t start = ctx->output->count;
+    size_t i = lo;
+    while (i < hi)
+    {
+        spy_op_stmt *op = function->stmts.items + i;
+        switch ((enum spy_op_stmt_type)op->type)
+        {
+        case SPY_OP_block_mark_start:
+        case SPY_OP_block_mark_end:
+        {
+            size_t back = python311_last_jump_to(function, i);
+            if (back == SIZE_MAX || back < i)
+            {
+                i++;
+                break;
+            }
+            if (back >= hi || !compile_python311_loop(ctx, i, back, hi, depth, &i))
+                return false;
+            break;
+        }
+        case SPY_OP_conditional_jump:
+            if (!compile_python311_branch(ctx, i, hi, depth, &i))
+                return false;
+            break;
+        case SPY_OP_jump:
+            if (!compile_python311_jump(ctx, op->index, depth))
+                return false;
+            i++;
+            break;
+        default:
+            if (python311_is_constant_putchar(ctx, op))
+            {
+                i = compile_python311_putchar_run(ctx, i, hi, depth);
+                break;
+            }
+            // A fused comparison is printed by the conditional jump after it
+            if (!can_fuse_compare_and_branch(function, i))
+                compile_python311_stmt(ctx, op, depth);
+            i++;
+            break;
+        }
+    }
+    if (ctx->output->count == start)
+    {
+        python311_indent(ctx->output, depth);
+        nob_sb_append_cstr(ctx->output, "pass\n");
+    }
+    return true;
+}
+
+// putchar writes a single byte like on every other target, through the buffer
+const char *PYTHON311_PRELUDE =
+    "import sys\n"
+    "\n"
+    "SPY_BYTES = [bytes((i,)) for i in range(256)]\n"
+    "\n";
+
+const char *PYTHON311_MAIN =
+    "\n"
+    "if __name__ == \"__main__\":\n"
+    "    try:\n"
+    "        main()\n"
+    "    except ZeroDivisionError:\n"
+    "        sys.stdout.flush()\n"
+    "        sys.stderr.write(\"ERROR: Division by zero.\\n\")\n"
+    "        sys.exit(1)\n";
+
+bool compile_python311(spy_ops *ops, spy_writer *writer)
+{
+    Nob_String_Builder *output = &writer->buffer;
+    nob_sb_append_cstr(output, PYTHON311_PRELUDE);
+    bool has_main = false;
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        spy_writer_drain(writer);
+        spy_op_function *function = ops->items + i;
+        python311_context ctx = {.ops = ops, .function = function, .loop_head = SIZE_MAX, .loop_exit = SIZE_MAX, .output = output};
+        nob_sb_appendf(output, "\ndef %s() -> None:\n", function->name);
+        // Locals are much cheaper to look up than globals and attributes
+        bool writes = false;
+        bool writes_bytes = false;
+        for (size_t j = 0; j < function->stmts.count; j++)
+        {
+            spy_op_stmt *op = function->stmts.items + j;
+            writes = writes || python311_is_putchar(&ctx, op);
+            writes_bytes = writes_bytes || (python311_is_putchar(&ctx, op) && !python311_is_constant_putchar(&ctx, op));
+        }
+        if (writes)
+            nob_sb_append_cstr(output, "    spy_write = sys.stdout.buffer.write\n");
+        if (writes_bytes)
+            nob_sb_append_cstr(output, "    spy_bytes = SPY_BYTES\n");
+        if (!compile_python311_block(&ctx, 0, function->stmts.count, 1))
+        {
+            fprintf(stderr, "Can not compile the control flow of `%s` to Python 3.11!\n", function->name);
+            return false;
+        }
+        nob_sb_append_cstr(output, "\n");
+        has_main = has_main || str_eq(function->name, "main");
+    }
+    if (has_main)
+        nob_sb_append_cstr(output, PYTHON311_MAIN);
+    return true;
+}
+
+/*
+    X86-64 INSTRUCTIONS
+*/
+
+// Instruction selection produces these records, which are then either printed as
+// AT&T assembly or encoded straight to machine code.
+
+enum x86_reg
+{
+    X86_REG_rax,
+    X86_REG_rcx,
+    X86_REG_rdx,
+    X86_REG_rbx,
+    X86_REG_rsp,
+    X86_REG_rbp,
+    X86_REG_rsi,
+    X86_REG_rdi,
+    X86_REG_r8,
+    X86_REG_r9,
+    X86_REG_r10,
+    X86_REG_r11,
+    X86_REG_r12,
+    X86_REG_r13,
+    X86_REG_r14,
+    X86_REG_r15,
+};
+
+char *X86_REG_NAMES_64[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+char *X86_REG_NAMES_32[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+char *X86_REG_NAMES_8[] = {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"};
+
+// Values are the condition encodings used by jcc and setcc
+enum x86_cc
+{
+    X86_CC_e = 0x4,
+    X86_CC_ne = 0x5,
+    X86_CC_l = 0xc,
+    X86_CC_ge = 0xd,
+    X86_CC_le = 0xe,
+    X86_CC_g = 0xf,
+};
+
+enum x86_operand_kind
+{
+    X86_OPERAND_none,
+    X86_OPERAND_reg,
+    X86_OPERAND_imm,
+    X86_OPERAND_mem,    // value(reg), or value(reg,index,scale) when scale is not 0
+    X86_OPERAND_label,  // label_<function>_<value>
+    X86_OPERAND_symbol, // module->symbols.items[value]
+    X86_OPERAND_rip,    // module->symbols.items[value](%rip)
+};
+
+typedef struct
+{
+    uint8_t kind;
+    uint8_t reg;
+    uint8_t index;
+    uint8_t scale;
+    int32_t value;
+} x86_operand;
+
+enum x86_opcode
+{
+    X86_label, // Defines the label in `dst`
+    X86_mov,
+    X86_add,
+    X86_sub,
+    X86_imul,
+    X86_shl, // Shift counts are always immediates
+    X86_sar,
+    X86_and,
+    X86_movsx, // Sign extends a 32 bit `src` into a 64 bit register
+    X86_cqo,
+    X86_idiv, // Divides %rdx:%rax by `src`
+    X86_inc,
+    X86_dec,
+    X86_cmp,
+    X86_test,
+    X86_xor,
+    X86_setcc,
+    X86_jcc,
+    X86_jmp,
+    X86_call,
+    X86_push,
+    X86_pop,
+    X86_lea,
+    X86_leave,
+    X86_ret,
+    X86_syscall,
+};
+
+// Operands are in AT&T order, `size` is the operand size in bytes
+typedef struct
+{
+    uint8_t opcode;
+    uint8_t cc;
+    uint8_t size;
+    uint8_t args_count; // Argument registers read by a call or a tail call
+    x86_operand src;
+    x86_operand dst;
+} x86_instr;
+
+typedef struct
+{
+    x86_instr *items;
+    size_t count;
+    size_t capacity;
+} x86_instrs;
+
+x86_operand x86_reg(enum x86_reg reg)
+{
+    return (x86_operand){.kind = X86_OPERAND_reg, .reg = reg};
+}
+
+x86_operand x86_imm(int32_t value)
+{
+    return (x86_operand){.kind = X86_OPERAND_imm, .value = value};
+}
+
+x86_operand x86_mem(enum x86_reg base, int32_t offset)
+{
+    return (x86_operand){.kind = X86_OPERAND_mem, .reg = base, .value = offset};
+}
+
+x86_operand x86_mem_index(enum x86_reg base, enum x86_reg index, uint8_t scale, int32_t offset)
+{
+    return (x86_operand){.kind = X86_OPERAND_mem, .reg = base, .index = index, .scale = scale, .value = offset};
+}
+
+x86_operand x86_label(uint32_t index)
+{
+    return (x86_operand){.kind = X86_OPERAND_label, .value = index};
+}
+
+x86_operand x86_symbol(uint32_t name_index)
+{
+    return (x86_operand){.kind = X86_OPERAND_symbol, .value = name_index};
+}
+
+x86_operand x86_rip(uint32_t symbol)
+{
+    return (x86_operand){.kind = X86_OPERAND_rip, .value = symbol};
+}
+
+bool x86_fits_i8(int32_t value)
+{
+    return value >= -128 && value <= 127;
+}
+
+bool x86_operand_eq(x86_operand a, x86_operand b)
+{
+    return a.kind == b.kind && a.reg == b.reg && a.index == b.index && a.scale == b.scale && a.value == b.value;
+}
+
+void x86_emit(x86_instrs *instrs, enum x86_opcode opcode, uint8_t size, x86_operand src, x86_operand dst)
+{
+    x86_instr instr = {.opcode = opcode, .size = size, .src = src, .dst = dst};
+    nob_da_append(instrs, instr);
+}
+
+void x86_emit_cc(x86_instrs *instrs, enum x86_opcode opcode, enum x86_cc cc, x86_operand dst)
+{
+    x86_instr instr = {.opcode = opcode, .cc = cc, .size = 1, .dst = dst};
+    nob_da_append(instrs, instr);
+}
+
+// A call, or a jmp for tail calls, to `symbol` passing `args_count` arguments in registers
+void x86_emit_call(x86_instrs *instrs, enum x86_opcode opcode, uint32_t symbol, uint8_t args_count)
+{
+    x86_instr instr = {.opcode = opcode, .size = 8, .args_count = args_count, .dst = x86_symbol(symbol)};
+    nob_da_append(instrs, instr);
+}
+
+typedef struct
+{
+    char *name;
+    bool global;
+    x86_instrs instrs;
+} x86_function;
+
+typedef struct
+{
+    x86_function *items;
+    size_t count;
+    size_t capacity;
+} x86_functions;
+
+enum x86_data_section
+{
+    X86_DATA_bss,
+    X86_DATA_rodata,
+};
+
+typedef struct
+{
+    char *name;
+    enum x86_data_section section;
+    uint32_t size;
+    char *bytes; // Owned, NULL for .bss
+} x86_data;
+
+typedef struct
+{
+    x86_data *items;
+    size_t count;
+    size_t capacity;
+} x86_datas;
+
+// Everything that ends up in one assembly or object file. Symbol operands index `symbols`,
+// which starts out as a copy of the IR names so call statements can be used as is.
+typedef struct
+{
+    x86_functions functions;
+    x86_datas datas;
+    spy_op_names symbols;
+    bool static_runtime;
+} x86_module;
+
+void x86_module_free(x86_module *module)
+{
+    for (size_t i = 0; i < module->functions.count; i++)
+        nob_da_free(module->functions.items[i].instrs);
+    for (size_t i = 0; i < module->datas.count; i++)
+        free(module->datas.items[i].bytes);
+    nob_da_free(module->functions);
+    nob_da_free(module->datas);
+    nob_da_free(module->symbols);
+}
+
+int64_t x86_module_function(x86_module *module, uint32_t symbol)
+{
+    for (size_t i = 0; i < module->functions.count; i++)
+    {
+        if (str_eq(module->functions.items[i].name, module->symbols.items[symbol]))
+            return i;
+    }
+    return -1;
+}
+
+int64_t x86_module_data(x86_module *module, uint32_t symbol)
+{
+    for (size_t i = 0; i < module->datas.count; i++)
+    {
+        if (str_eq(module->datas.items[i].name, module->symbols.items[symbol]))
+            return i;
+    }
+    return -1;
+}
+
+bool x86_module_defines(x86_module *module, uint32_t symbol)
+{
+    return x86_module_function(module, symbol) >= 0 || x86_module_data(module, symbol) >= 0;
+}
+
+enum x86_cc x86_compare_cc(enum spy_op_expr_binop_type type)
+{
+    switch (type)
+    {
+    case SPY_OP_EXPR_BINOP_add:
+    case SPY_OP_EXPR_BINOP_sub:
+    case SPY_OP_EXPR_BINOP_mul:
+    case SPY_OP_EXPR_BINOP_floordiv:
+    case SPY_OP_EXPR_BINOP_mod:
+    case SPY_OP_EXPR_BINOP_lt:
+        return X86_CC_l;
+    case SPY_OP_EXPR_BINOP_lte:
+        return X86_CC_le;
+    case SPY_OP_EXPR_BINOP_gt:
+        return X86_CC_g;
+    case SPY_OP_EXPR_BINOP_gte:
+        return X86_CC_ge;
+    case SPY_OP_EXPR_BINOP_eq:
+        return X86_CC_e;
+    case SPY_OP_EXPR_BINOP_neq:
+        return X86_CC_ne;
+    }
+    return X86_CC_e;
+}
+
+enum x86_cc x86_invert_cc(enum x86_cc cc)
+{
+    return cc ^ 1;
+}
+
+char *x86_cc_name(enum x86_cc cc)
+{
+    switch (cc)
+    {
+    case X86_CC_e:
+        return "e";
+    case X86_CC_ne:
+        return "ne";
+    case X86_CC_l:
+        return "l";
+    case X86_CC_ge:
+        return "ge";
+    case X86_CC_le:
+        return "le";
+    case X86_CC_g:
+        return "g";
+    }
+    return "?";
+}
+
+/*
+    X86-64 STATIC RUNTIME
+*/
+
+// Replaces libc for -static-runtime on Linux: `_start` calls main and exits through
+// exit_group, putchar and spy_write append to a buffer that is written with write(2)
+// when full and on exit.
+
+#define SPY_RUNTIME_OUTPUT_BUFFER_SIZE (64 * 1024)
+#define SPY_LINUX_SYS_write 1
+#define SPY_LINUX_SYS_exit_group 231
+
+void compile_x86_64_runtime_start(x86_module *module)
+{
+    uint32_t buffer = spy_op_name_index(&module->symbols, "spy_output_buffer");
+    uint32_t end = spy_op_name_index(&module->symbols, "spy_output_end");
+    x86_function function = {.name = "_start", .global = true};
+    x86_instrs *instrs = &function.instrs;
+    // The kernel leaves %rsp 16 byte aligned, so the call below sees the usual alignment
+    x86_emit(instrs, X86_xor, 4, x86_reg(X86_REG_rbp), x86_reg(X86_REG_rbp));
+    x86_emit(instrs, X86_lea, 8, x86_rip(buffer), x86_reg(X86_REG_rax));
+    x86_emit(instrs, X86_mov, 8, x86_reg(X86_REG_rax), x86_rip(end));
+    x86_emit_call(instrs, X86_call, spy_op_name_index(&module->symbols, "main"), 0);
+    x86_emit(instrs, X86_mov, 4, x86_reg(X86_REG_rax), x86_reg(X86_REG_rdi));
+    x86_emit_call(instrs, X86_call, spy_op_name_index(&module->symbols, "spy_exit"), 1);
+    nob_da_append(&module->functions, function);
+}
+
+void compile_x86_64_runtime_putchar(x86_module *module)
+{
+    uint32_t buffer = spy_op_name_index(&module->symbols, "spy_output_buffer");
+    uint32_t end = spy_op_name_index(&module->symbols, "spy_output_end");
+    x86_function function = {.name = "spy_putchar"};
+    x86_instrs *instrs = &function.instrs;
+    x86_emit(instrs, X86_mov, 8, x86_rip(end), x86_reg(X86_REG_rax));
+    x86_emit(instrs, X86_mov, 1, x86_reg(X86_REG_rdi), x86_mem(X86_REG_rax, 0));
+    x86_emit(instrs, X86_add, 8, x86_imm(1), x86_reg(X86_REG_rax));
+    x86_emit(instrs, X86_mov, 8, x86_reg(X86_REG_rax), x86_rip(end));
+    x86_emit(instrs, X86_lea, 8, x86_rip(buffer), x86_reg(X86_REG_rcx));
+    x86_emit(instrs, X86_sub, 8, x86_reg(X86_REG_rcx), x86_reg(X86_REG_rax));
+    x86_emit(instrs, X86_cmp, 8, x86_imm(SPY_RUNTIME_OUTPUT_BUFFER_SIZE), x86_reg(X86_REG_rax));
+    x86_emit_cc(instrs, X86_jcc, X86_CC_ne, x86_label(0));
+    x86_emit_call(instrs, X86_jmp, spy_op_name_index(&module->symbols, "spy_flush"), 0);
+    x86_emit(instrs, X86_label, 8, (x86_operand){0}, x86_label(0));
+    x86_emit(instrs, X86_mov, 4, x86_reg(X86_REG_rdi), x86_reg(X86_REG_rax));
+    x86_emit(instrs, X86_ret, 8, (x86_operand){0}, (x86_operand){0});
+    nob_da_append(&module->functions, function);
+}
+
+void compile_x86_64_runtime_write(x86_module *module)
+{
+    // Copies %esi bytes from %rdi into the output buffer
+    uint32_t buffer = spy_op_name_index(&module->symbols, "spy_output_buffer");
+    uint32_t end = spy_op_name_index(&module->symbols, "spy_output_end");
+    x86_function function = {.name = "spy_write"};
+    x86_instrs *instrs = &function.instrs;
+    x86_emit(instrs, X86_label, 8, (x86_operand){0}, x86_label(0));
+    x86_emit(instrs, X86_cmp, 4, x86_imm(0), x86_reg(X86_REG_rsi));
+    x86_emit_cc(instrs, X86_jcc, X86_CC_le, x86_label(1));
+    x86_emit(instrs, X86_mov, 1, x86_mem(X86_REG_rdi, 0), x86_reg(X86_REG_rax));
+    x86_emit(instrs, X86_mov, 8, x86_rip(end), x86_reg(X86_REG_rcx));
+    x86_emit(instrs, X86_mov, 1, x86_reg(X86_REG_rax), x86_mem(X86_REG_rcx, 0));
+    x86_emit(instrs, X86_add, 8, x86_imm(1), x86_reg(X86_REG_rcx));
+    x86_emit(instrs, X86_mov, 8, x86_reg(X86_REG_rcx), x86_rip(end));
+    x86_emit(instrs, X86_add, 8, x86_imm(1), x86_reg(X86_REG_rdi));
+    x86_emit(instrs, X86_sub, 4, x86_imm(1), x86_reg(X86_REG_rsi));
+    x86_emit(instrs, X86_lea, 8, x86_rip(buffer), x86_reg(X86_REG_rax));
+    x86_emit(instrs, X86_sub, 8, x86_reg(X86_REG_rax), x86_reg(X86_REG_rcx));
+    x86_emit(instrs, X86_cmp, 8, x86_imm(SPY_RUNTIME_OUTPUT_BUFFER_SIZE), x86_reg(X86_REG_rcx));
+    x86_emit_cc(instrs, X86_jcc, X86_CC_ne, x86_label(0));
+    x86_emit(instrs, X86_push, 8, x86_reg(X86_REG_rdi), (x86_operand){0});
+    x86_emit(instrs, X86_push, 8, x86_reg(X86_REG_rsi), (x86_operand){0});
+    x86_emit_call(instrs, X86_call, spy_op_name_index(&module->symbols, "spy_flush"), 0);
+    x86_emit(instrs, X86_pop, 8, x86_reg(X86_REG_rsi), (x86_operand){0});
+    x86_emit(instrs, X86_pop, 8, x86_reg(X86_REG_rdi), (x86_operand){0});
+    x86_emit(instrs, X86_jmp, 8, (x86_operand){0}, x86_label(0));
+    x86_emit(instrs, X86_label, 8, (x86_operand){0}, x86_label(1));
+    x86_emit(instrs, X86_ret, 8, (x86_operand){0}, (x86_operand){0});
+    nob_da_append(&module->functions, function);
+}
+
+void compile_x86_64_runtime_flush(x86_module *module)
+{
+    uint32_t buffer = spy_op_name_index(&module->symbols, "spy_output_buffer");
+    uint32_t end = spy_op_name_index(&module->symbols, "spy_output_end");
+    x86_function function = {.name = "spy_flush"};
+    x86_instrs *instrs = &function.instrs;
+    x86_emit(instrs, X86_lea, 8, x86_rip(buffer), x86_reg(X86_REG_rsi));
+    x86_emit(instrs, X86_label, 8, (x86_operand){0}, x86_label(0));
+    x86_emit(instrs, X86_mov, 8, x86_rip(end), x86_reg(X86_REG_rdx));
+    x86_emit(instrs, X86_sub, 8, x86_reg(X86_REG_rsi), x86_reg(X86_REG_rdx));
+    x86_emit(instrs, X86_cmp, 8, x86_imm(0), x86_reg(X86_REG_rdx));
+    x86_emit_cc(instrs, X86_jcc, X86_CC_le, x86_label(1));
+    x86_emit(instrs, X86_mov, 4, x86_imm(1), x86_reg(X86_REG_rdi));
+    x86_emit(instrs, X86_mov, 4, x86_imm(SPY_LINUX_SYS_write), x86_reg(X86_REG_rax));
+    x86_emit(instrs, X86_syscall, 8, (x86_operand){0}, (x86_operand){0});
+    // Partial writes continue where they stopped, errors drop the rest of the output
+    x86_emit(instrs, X86_cmp, 8, x86_imm(0), x86_reg(X86_REG_rax));
+    x86_emit_cc(instrs, X86_jcc, X86_CC_le, x86_label(1));
+    x86_emit(instrs, X86_add, 8, x86_reg(X86_REG_rax), x86_reg(X86_REG_rsi));
+    x86_emit(instrs, X86_jmp, 8, (x86_operand){0}, x86_label(0));
+    x86_emit(instrs, X86_label, 8, (x86_operand){0}, x86_label(1));
+    x86_emit(instrs, X86_lea, 8, x86_rip(buffer), x86_reg(X86_REG_rax));
+    x86_emit(instrs, X86_mov, 8, x86_reg(X86_REG_rax), x86_rip(end));
+    x86_emit(instrs, X86_ret, 8, (x86_operand){0}, (x86_operand){0});
+    nob_da_append(&module->functions, function);
+}
+
+void compile_x86_64_runtime_exit(x86_module *module)
+{
+    x86_function function = {.name = "spy_exit"};
+    x86_instrs *instrs = &function.instrs;
+    x86_emit(instrs, X86_push, 8, x86_reg(X86_REG_rdi), (x86_operand){0});
+    x86_emit_call(instrs, X86_call, spy_op_name_index(&module->symbols, "spy_flush"), 0);
+    x86_emit(instrs, X86_pop, 8, x86_reg(X86_REG_rdi), (x86_operand){0});
+    x86_emit(instrs, X86_mov, 4, x86_imm(SPY_LINUX_SYS_exit_group), x86_reg(X86_REG_rax));
+    x86_emit(instrs, X86_syscall, 8, (x86_operand){0}, (x86_operand){0});
+    nob_da_append(&module->functions, function);
+}
+
+void compile_x86_64_runtime(x86_module *module)
+{
+    // Calls to putchar go to the runtime instead of libc
+    uint32_t libc_putchar = spy_op_name_index(&module->symbols, "putchar");
+    uint32_t spy_putchar = spy_op_name_index(&module->symbols, "spy_putchar");
+    for (size_t i = 0; i < module->functions.count; i++)
+    {
+        x86_instrs *instrs = &module->functions.items[i].instrs;
+        for (size_t j = 0; j < instrs->count; j++)
+        {
+            x86_operand *dst = &instrs->items[j].dst;
+            if (dst->kind == X86_OPERAND_symbol && (uint32_t)dst->value == libc_putchar)
+                dst->value = spy_putchar;
+        }
+    }
+    compile_x86_64_runtime_start(module);
+    compile_x86_64_runtime_putchar(module);
+    compile_x86_64_runtime_write(module);
+    compile_x86_64_runtime_flush(module);
+    compile_x86_64_runtime_exit(module);
+    x86_data buffer = {.name = "spy_output_buffer", .section = X86_DATA_bss, .size = SPY_RUNTIME_OUTPUT_BUFFER_SIZE};
+    nob_da_append(&module->datas, buffer);
+    x86_data end = {.name = "spy_output_end", .section = X86_DATA_bss, .size = 8};
+    nob_da_append(&module->datas, end);
+    // Runtime functions nothing calls, like spy_write, still need a symbol
+    for (size_t i = 0; i < module->functions.count; i++)
+        spy_op_name_index(&module->symbols, module->functions.items[i].name);
+}
+
+/*
+    REGISTER ALLOCATION
+*/
+
+// Linear scan in the style of Poletto and Sarkar, shared by the native backends. Every variable
+// gets a single live interval, from the first to the last statement where it is live, and the
+// intervals are handed registers in order of their start. Variables that are live across a call
+// only get callee-saved registers, which the prologue saves.
+
+#define SPY_NO_REG 0xff
+#define SPY_MAX_REGS 32
+
+typedef struct
+{
+    uint32_t var;
+    size_t start;
+    size_t end;
+    bool across_call;
+    uint8_t reg;     // SPY_NO_REG when spilled
+    uint32_t slot;   // Stack slot when spilled
+} spy_interval;
+
+typedef struct
+{
+    spy_interval *items;
+    size_t count;
+    size_t capacity;
+} spy_intervals;
+
+// The registers a target hands out, in order of preference
+typedef struct
+{
+    const uint8_t *caller_saved;
+    size_t caller_saved_count;
+    const uint8_t *callee_saved;
+    size_t callee_saved_count;
+    uint8_t argument; // Where the first call argument goes
+} spy_register_file;
+
+bool live_set_has(uint64_t *set, uint32_t var_index)
+{
+    return (set[var_index / 64] >> (var_index % 64)) & 1;
+}
+
+void live_set_add_term(uint64_t *set, spy_op_term term)
+{
+    if (term.type == SPY_OP_TERM_var)
+        set[term.data.var_index / 64] |= (uint64_t)1 << (term.data.var_index % 64);
+}
+
+// Fills `live` with the variables live before statement `index`, given the ones live after it
+void live_set_transfer(spy_op_function *function, size_t index, uint64_t *live)
+{
+    spy_op_stmt *op = function->stmts.items + index;
+    switch ((enum spy_op_stmt_type)op->type)
+    {
+    case SPY_OP_assign:
+    case SPY_OP_declare_assign:
+    case SPY_OP_assign_binop:
+    case SPY_OP_declare_assign_binop:
+        live[op->index / 64] &= ~((uint64_t)1 << (op->index % 64));
+        live_set_add_term(live, spy_op_lhs(op));
+        if (op->type == SPY_OP_assign_binop || op->type == SPY_OP_declare_assign_binop)
+            live_set_add_term(live, spy_op_rhs(op));
+        break;
+    case SPY_OP_func_call:
+    case SPY_OP_tail_call:
+        for (int32_t i = 0; i < op->rhs; i++)
+            live_set_add_term(live, spy_op_args(function, op)[i]);
+        break;
+    case SPY_OP_conditional_jump:
+        live_set_add_term(live, spy_op_lhs(op));
+        break;
+    case SPY_OP_jump:
+    case SPY_OP_block_mark_start:
+    case SPY_OP_block_mark_end:
+        break;
+    }
+}
+
+size_t spy_op_successors(spy_op_function *function, size_t index, size_t *label_positions, size_t successors[2])
+{
+    spy_op_stmt *op = function->stmts.items + index;
+    size_t count = 0;
+    switch ((enum spy_op_stmt_type)op->type)
+    {
+    case SPY_OP_jump:
+        successors[count++] = label_positions[op->index];
+        return count;
+    case SPY_OP_conditional_jump:
+        successors[count++] = label_positions[op->index];
+        break;
+    case SPY_OP_tail_call:
+        return count;
+    default:
+        break;
+    }
+    if (index + 1 < function->stmts.count)
+        successors[count++] = index + 1;
+    return count;
+}
+
+// Backwards dataflow to a fixed point, `live_in` gets the variables live before each statement
+void compute_liveness(spy_op_function *function, size_t words, uint64_t *live_in)
+{
+    size_t labels_count = 0;
+    for (size_t i = 0; i < function->stmts.count; i++)
+    {
+        spy_op_stmt *op = function->stmts.items + i;
+        if ((op->type == SPY_OP_block_mark_start || op->type == SPY_OP_block_mark_end) && op->index >= labels_count)
+            labels_count = op->index + 1;
+    }
+    size_t *label_positions = calloc(labels_count + 1, sizeof(size_t));
+    for (size_t i = 0; i < function->stmts.count; i++)
+    {
+        spy_op_stmt *op = function->stmts.items + i;
+        if (op->type == SPY_OP_block_mark_start || op->type == SPY_OP_block_mark_end)
+            label_positions[op->index] = i;
+    }
+    uint64_t *live = malloc((words + 1) * sizeof(uint64_t));
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t i = function->stmts.count; i-- > 0;)
+        {
+            memset(live, 0, words * sizeof(uint64_t));
+            size_t successors[2];
+            size_t successors_count = spy_op_successors(function, i, label_positions, successors);
+            for (size_t j = 0; j < successors_count; j++)
+            {
+                for (size_t w = 0; w < words; w++)
+                    live[w] |= live_in[successors[j] * words + w];
+            }
+            live_set_transfer(function, i, live);
+            if (memcmp(live, live_in + i * words, words * sizeof(uint64_t)) != 0)
+            {
+                memcpy(live_in + i * words, live, words * sizeof(uint64_t));
+                changed = true;
+            }
+        }
+    }
+    free(live);
+    free(label_positions);
+}
+
+int compare_intervals(const void *a, const void *b)
+{
+    const spy_interval *x = a;
+    const spy_interval *y = b;
+    if (x->start != y->start)
+        return x->start < y->start ? -1 : 1;
+    return x->var < y->var ? -1 : x->var > y->var;
+}
+
+// A register that makes a move free: the source of a copy that dies here, or the argument register for a call argument
+uint8_t interval_hint(spy_op_function *function, spy_register_file *file, spy_interval *interval, uint8_t *var_regs)
+{
+    spy_op_stmt *def = function->stmts.items + interval->start;
+    if (spy_op_defines_var(def, interval->var) && def->lhs_type == SPY_OP_TERM_var)
+        return var_regs[def->lhs];
+    spy_op_stmt *use = function->stmts.items + interval->end;
+    if (use->type == SPY_OP_func_call && use->rhs == 1 && term_is_var(spy_op_args(function, use)[0], interval->var))
+        return file->argument;
+    return SPY_NO_REG;
+}
+
+bool register_file_is_callee_saved(spy_register_file *file, uint8_t reg)
+{
+    for (size_t i = 0; i < file->callee_saved_count; i++)
+    {
+        if (file->callee_saved[i] == reg)
+            return true;
+    }
+    return false;
+}
+
+// Spilled intervals share a stack slot when their lifetimes do not overlap, returns the number of slots
+size_t assign_stack_slots(spy_op_function *function, spy_intervals *intervals)
+{
+    struct
+    {
+        spy_interval **items;
+        size_t count;
+        size_t capacity;
+    } owners = {0};
+    for (size_t i = 0; i < intervals->count; i++)
+    {
+        spy_interval *current = intervals->items + i;
+        if (current->reg != SPY_NO_REG)
+            continue;
+        bool defined_at_start = spy_op_defines_var(function->stmts.items + current->start, current->var);
+        current->slot = owners.count;
+        for (size_t slot = 0; slot < owners.count; slot++)
+        {
+            spy_interval *owner = owners.items[slot];
+            if (owner->end < current->start || (owner->end == current->start && defined_at_start))
+            {
+                current->slot = slot;
+                break;
+            }
+        }
+        if (current->slot == owners.count)
+            nob_da_append(&owners, current);
+        else
+            owners.items[current->slot] = current;
+    }
+    size_t slots_count = owners.count;
+    nob_da_free(owners);
+    return slots_count;
+}
+
+bool function_divides(spy_op_function *function)
+{
+    for (size_t i = 0; i < function->stmts.count; i++)
+    {
+        spy_op_stmt *op = function->stmts.items + i;
+        if ((op->type == SPY_OP_assign_binop || op->type == SPY_OP_declare_assign_binop) && is_division_binop(op->binop))
+            return true;
+    }
+    return false;
+}
+
+bool is_leaf_function(spy_op_function *function)
+{
+    // Tail calls leave the stack as it was on entry, so they do not need a frame either
+    for (size_t i = 0; i < function->stmts.count; i++)
+    {
+        if (function->stmts.items[i].type == SPY_OP_func_call)
+            return false;
+    }
+    return true;
+}
+
+// Fills `intervals` with a register or a stack slot for every variable, the registers in
+// `reserved` are left alone. Returns the number of stack slots.
+size_t allocate_registers(spy_op_function *function, spy_register_file *file, uint64_t reserved, spy_intervals *intervals)
+{
+    size_t vars_count = function_vars_count(function);
+    size_t stmts_count = function->stmts.count;
+    size_t words = (vars_count + 63) / 64;
+    uint64_t *live_in = calloc(stmts_count * words + 1, sizeof(uint64_t));
+    compute_liveness(function, words, live_in);
+
+    for (uint32_t var = 0; var < vars_count; var++)
+    {
+        spy_interval interval = {.var = var, .start = SIZE_MAX, .reg = SPY_NO_REG};
+        for (size_t i = 0; i < stmts_count; i++)
+        {
+            if (!live_set_has(live_in + i * words, var) && !spy_op_defines_var(function->stmts.items + i, var))
+                continue;
+            if (interval.start == SIZE_MAX)
+                interval.start = i;
+            interval.end = i;
+        }
+        if (interval.start == SIZE_MAX)
+            continue;
+        for (size_t i = interval.start; i < interval.end; i++)
+        {
+            // What is live before the next statement survives the call
+            if (function->stmts.items[i].type == SPY_OP_func_call && live_set_has(live_in + (i + 1) * words, var))
+                interval.across_call = true;
+        }
+        nob_da_append(intervals, interval);
+    }
+    if (intervals->count > 1)
+        qsort(intervals->items, intervals->count, sizeof(spy_interval), compare_intervals);
+
+    uint8_t *var_regs = malloc(vars_count + 1);
+    memset(var_regs, SPY_NO_REG, vars_count + 1);
+    uint8_t *candidates = malloc(file->caller_saved_count + file->callee_saved_count + 1);
+    spy_interval *owners[SPY_MAX_REGS] = {0};
+    for (size_t i = 0; i < intervals->count; i++)
+    {
+        spy_interval *current = intervals->items + i;
+        // A value read by the statement that defines `current` can hand over its register
+        bool defined_at_start = spy_op_defines_var(function->stmts.items + current->start, current->var);
+        for (size_t reg = 0; reg < SPY_MAX_REGS; reg++)
+        {
+            spy_interval *owner = owners[reg];
+            if (owner != NULL && (owner->end < current->start || (owner->end == current->start && defined_at_start)))
+                owners[reg] = NULL;
+        }
+
+        size_t candidates_count = 0;
+        uint8_t hint = interval_hint(function, file, current, var_regs);
+        if (hint != SPY_NO_REG && !((reserved >> hint) & 1) && (!current->across_call || register_file_is_callee_saved(file, hint)))
+            candidates[candidates_count++] = hint;
+        for (size_t j = 0; j < file->caller_saved_count && !current->across_call; j++)
+        {
+            if (!((reserved >> file->caller_saved[j]) & 1))
+                candidates[candidates_count++] = file->caller_saved[j];
+        }
+        for (size_t j = 0; j < file->callee_saved_count; j++)
+        {
+            if (!((reserved >> file->callee_saved[j]) & 1))
+                candidates[candidates_count++] = file->callee_saved[j];
+        }
+
+        for (size_t j = 0; j < candidates_count && current->reg == SPY_NO_REG; j++)
+        {
+            if (owners[candidates[j]] == NULL)
+                current->reg = candidates[j];
+        }
+        if (current->reg == SPY_NO_REG)
+        {
+            // Spill whichever interval ends last, it blocks a register for the longest
+            spy_interval *victim = current;
+            for (size_t j = 0; j < candidates_count; j++)
+            {
+                spy_interval *owner = owners[candidates[j]];
+                if (owner->end > victim->end)
+                    victim = owner;
+            }
+            if (victim != current)
+            {
+                current->reg = victim->reg;
+                var_regs[victim->var] = SPY_NO_REG;
+                victim->reg = SPY_NO_REG;
+            }
+        }
+        if (current->reg != SPY_NO_REG)
+        {
+            owners[current->reg] = current;
+            var_regs[current->var] = current->reg;
+        }
+    }
+    free(candidates);
+    free(var_regs);
+    free(live_in);
+    return assign_stack_slots(function, intervals);
+}
+
+/*
+    X86-64 REGISTER ALLOCATION
+*/
+
+// %rax and %rcx are never allocated, instruction selection uses them as scratch registers.
+// Functions that divide also keep %rdx free, idiv and the multiply by a magic number use it.
+
+const uint8_t X86_CALLER_SAVED[] = {X86_REG_rdi, X86_REG_rsi, X86_REG_rdx, X86_REG_r8, X86_REG_r9, X86_REG_r10, X86_REG_r11};
+const uint8_t X86_CALLEE_SAVED[] = {X86_REG_rbx, X86_REG_r12, X86_REG_r13, X86_REG_r14, X86_REG_r15};
+
+#define X86_CALLEE_SAVED_COUNT (sizeof X86_CALLEE_SAVED / sizeof(uint8_t))
+
+spy_register_file X86_REGISTER_FILE = {
+    .caller_saved = X86_CALLER_SAVED,
+    .caller_saved_count = sizeof X86_CALLER_SAVED / sizeof(uint8_t),
+    .callee_saved = X86_CALLEE_SAVED,
+    .callee_saved_count = X86_CALLEE_SAVED_COUNT,
+    .argument = X86_REG_rdi,
+};
+
+typedef struct
+{
+    x86_operand *locations; // Indexed by variable, a register or a stack slot
+    size_t vars_count;
+    enum x86_reg saved[X86_CALLEE_SAVED_COUNT];
+    size_t saved_count;
+    size_t slots_count;
+    // Frame layout: %rbp, the saved registers, then `frame_size` bytes of slots. Leaf functions
+    // omit %rbp and the reserved bytes, their slots are in the red zone below the saved registers.
+    bool frame_omitted;
+    int32_t frame_size;
+} x86_allocation;
+
+void x86_allocation_free(x86_allocation *allocation)
+{
+    free(allocation->locations);
+    *allocation = (x86_allocation){0};
+}
+
+#define X86_RED_ZONE_SIZE 128
+
+void layout_x86_64_frame(spy_op_function *function, x86_allocation *allocation)
+{
+    int32_t slots_size = 4 * allocation->slots_count;
+    if (is_leaf_function(function) && slots_size <= X86_RED_ZONE_SIZE)
+    {
+        allocation->frame_omitted = true;
+        allocation->frame_size = 0;
+        return;
+    }
+    // %rsp is 16 byte aligned after pushing %rbp, calls need it to stay that way
+    int32_t pushed = 8 * allocation->saved_count;
+    allocation->frame_size = ((pushed + slots_size + 15) & ~15) - pushed;
+}
+
+void allocate_x86_64_registers(spy_op_function *function, x86_allocation *allocation)
+{
+    spy_intervals intervals = {0};
+    uint64_t reserved = function_divides(function) ? (uint64_t)1 << X86_REG_rdx : 0;
+    size_t slots_count = allocate_registers(function, &X86_REGISTER_FILE, reserved, &intervals);
+
+    *allocation = (x86_allocation){.vars_count = function_vars_count(function), .slots_count = slots_count};
+    bool saved[SPY_MAX_REGS] = {0};
+    for (size_t i = 0; i < intervals.count; i++)
+    {
+        if (intervals.items[i].reg != SPY_NO_REG)
+            saved[intervals.items[i].reg] = true;
+    }
+    for (size_t i = 0; i < X86_CALLEE_SAVED_COUNT; i++)
+    {
+        if (saved[X86_CALLEE_SAVED[i]])
+            allocation->saved[allocation->saved_count++] = X86_CALLEE_SAVED[i];
+    }
+    layout_x86_64_frame(function, allocation);
+    allocation->locations = calloc(allocation->vars_count + 1, sizeof(x86_operand));
+    for (size_t i = 0; i < intervals.count; i++)
+    {
+        spy_interval *interval = intervals.items + i;
+        int32_t slot_offset = -4 * ((int32_t)interval->slot + 1);
+        if (interval->reg != SPY_NO_REG)
+            allocation->locations[interval->var] = x86_reg(interval->reg);
+        else if (allocation->frame_omitted)
+            allocation->locations[interval->var] = x86_mem(X86_REG_rsp, slot_offset);
+        else
+            allocation->locations[interval->var] = x86_mem(X86_REG_rbp, -8 * (int32_t)allocation->saved_count + slot_offset);
+    }
+    nob_da_free(intervals);
+}
+
+x86_operand x86_location(x86_allocation *allocation, spy_op_term term)
+{
+    switch (term.type)
+    {
+    case SPY_OP_TERM_intlit:
+        return x86_imm(term.data.intlit);
+    case SPY_OP_TERM_var:
+        return allocation->locations[term.data.var_index];
+    }
+    return (x86_operand){0};
+}
+
+/*
+    X86-64 PEEPHOLE
+*/
+
+// Rewrites the instruction list of a function before it is printed or encoded, so every
+// output format gets the same code. Rules see which registers are live after each
+// instruction, computed over the jumps and labels of the function.
+
+#define X86_REG_BIT(reg) ((uint32_t)1 << (reg))
+// Tracked like a register, jcc and setcc read it
+#define X86_FLAGS_BIT ((uint32_t)1 << 16)
+#define X86_CALLER_SAVED_MASK (X86_REG_BIT(X86_REG_rax) | X86_REG_BIT(X86_REG_rcx) | X86_REG_BIT(X86_REG_rdx) | X86_REG_BIT(X86_REG_rsi) | \
+                               X86_REG_BIT(X86_REG_rdi) | X86_REG_BIT(X86_REG_r8) | X86_REG_BIT(X86_REG_r9) | X86_REG_BIT(X86_REG_r10) | X86_REG_BIT(X86_REG_r11))
+#define X86_CALLEE_SAVED_MASK (X86_REG_BIT(X86_REG_rbx) | X86_REG_BIT(X86_REG_rsp) | X86_REG_BIT(X86_REG_rbp) | X86_REG_BIT(X86_REG_r12) | \
+                               X86_REG_BIT(X86_REG_r13) | X86_REG_BIT(X86_REG_r14) | X86_REG_BIT(X86_REG_r15))
+#define X86_SYSCALL_USES_MASK (X86_REG_BIT(X86_REG_rax) | X86_REG_BIT(X86_REG_rdi) | X86_REG_BIT(X86_REG_rsi) | X86_REG_BIT(X86_REG_rdx) | \
+                               X86_REG_BIT(X86_REG_r10) | X86_REG_BIT(X86_REG_r8) | X86_REG_BIT(X86_REG_r9))
+
+enum x86_reg X86_ARG_REGS[] = {X86_REG_rdi, X86_REG_rsi, X86_REG_rdx, X86_REG_rcx, X86_REG_r8, X86_REG_r9};
+
+uint32_t x86_args_regs(uint8_t args_count)
+{
+    uint32_t regs = 0;
+    for (size_t i = 0; i < args_count && i < sizeof X86_ARG_REGS / sizeof(enum x86_reg); i++)
+        regs |= X86_REG_BIT(X86_ARG_REGS[i]);
+    return regs;
+}
+
+uint32_t x86_operand_regs(x86_operand operand)
+{
+    if (operand.kind == X86_OPERAND_reg)
+        return X86_REG_BIT(operand.reg);
+    if (operand.kind == X86_OPERAND_mem)
+        return X86_REG_BIT(operand.reg) | (operand.scale != 0 ? X86_REG_BIT(operand.index) : 0);
+    return 0;
+}
+
+bool x86_is_zero_idiom(x86_instr *instr)
+{
+    return instr->opcode == X86_xor && instr->src.kind == X86_OPERAND_reg && x86_operand_eq(instr->src, instr->dst);
+}
+
+uint32_t x86_instr_uses(x86_instr *instr)
+{
+    uint32_t dst_address = instr->dst.kind == X86_OPERAND_mem ? x86_operand_regs(instr->dst) : 0;
+    switch ((enum x86_opcode)instr->opcode)
+    {
+    case X86_mov:
+    case X86_lea:
+    case X86_movsx:
+        return x86_operand_regs(instr->src) | dst_address;
+    case X86_cqo:
+        return X86_REG_BIT(X86_REG_rax);
+    case X86_idiv:
+        return x86_operand_regs(instr->src) | X86_REG_BIT(X86_REG_rax) | X86_REG_BIT(X86_REG_rdx);
+    case X86_xor:
+        if (x86_is_zero_idiom(instr))
+            return 0;
+        // fallthrough
+    case X86_add:
+    case X86_sub:
+    case X86_imul:
+    case X86_shl:
+    case X86_sar:
+    case X86_and:
+    case X86_inc:
+    case X86_dec:
+    case X86_cmp:
+    case X86_test:
+        return x86_operand_regs(instr->src) | x86_operand_regs(instr->dst);
+    case X86_setcc:
+        // Only the low byte is written
+        return x86_operand_regs(instr->dst) | X86_FLAGS_BIT;
+    case X86_jcc:
+        return X86_FLAGS_BIT;
+    case X86_call:
+        // %al holds the number of vector registers for variadic calls
+        return x86_args_regs(instr->args_count) | X86_REG_BIT(X86_REG_rax) | X86_REG_BIT(X86_REG_rsp);
+    case X86_push:
+        return x86_operand_regs(instr->src) | X86_REG_BIT(X86_REG_rsp);
+    case X86_pop:
+    case X86_ret:
+        return X86_REG_BIT(X86_REG_rsp);
+    case X86_leave:
+        return X86_REG_BIT(X86_REG_rbp);
+    case X86_syscall:
+        return X86_SYSCALL_USES_MASK;
+    case X86_label:
+    case X86_jmp:
+        return 0;
+    }
+    return 0;
+}
+
+uint32_t x86_instr_defs(x86_instr *instr)
+{
+    uint32_t dst = instr->dst.kind == X86_OPERAND_reg ? X86_REG_BIT(instr->dst.reg) : 0;
+    switch ((enum x86_opcode)instr->opcode)
+    {
+    case X86_mov:
+    case X86_lea:
+        // Byte moves leave the rest of the register alone
+        return instr->size >= 4 ? dst : 0;
+    case X86_movsx:
+        return dst;
+    case X86_cqo:
+        return X86_REG_BIT(X86_REG_rdx);
+    case X86_idiv:
+        return X86_REG_BIT(X86_REG_rax) | X86_REG_BIT(X86_REG_rdx) | X86_FLAGS_BIT;
+    case X86_add:
+    case X86_sub:
+    case X86_imul:
+    case X86_shl:
+    case X86_sar:
+    case X86_and:
+    case X86_inc:
+    case X86_dec:
+    case X86_xor:
+        return dst | X86_FLAGS_BIT;
+    case X86_cmp:
+    case X86_test:
+        return X86_FLAGS_BIT;
+    case X86_call:
+        return X86_CALLER_SAVED_MASK | X86_FLAGS_BIT;
+    case X86_pop:
+        return X86_REG_BIT(instr->src.reg) | X86_REG_BIT(X86_REG_rsp);
+    case X86_push:
+        return X86_REG_BIT(X86_REG_rsp);
+    case X86_leave:
+        return X86_REG_BIT(X86_REG_rsp) | X86_REG_BIT(X86_REG_rbp);
+    case X86_syscall:
+        return X86_REG_BIT(X86_REG_rax) | X86_REG_BIT(X86_REG_rcx) | X86_REG_BIT(X86_REG_r11) | X86_FLAGS_BIT;
+    case X86_setcc:
+    case X86_label:
+    case X86_jcc:
+    case X86_jmp:
+    case X86_ret:
+        return 0;
+    }
+    return 0;
+}
+
+// Fills `live_out` with the registers read after each instruction before being written again
+void x86_liveness(x86_instrs *instrs, uint32_t *live_out)
+{
+    size_t labels_count = 0;
+    for (size_t i = 0; i < instrs->count; i++)
+    {
+        if (instrs->items[i].opcode == X86_label && (size_t)instrs->items[i].dst.value >= labels_count)
+            labels_count = instrs->items[i].dst.value + 1;
+    }
+    size_t *labels = calloc(labels_count + 1, sizeof(size_t));
+    for (size_t i = 0; i < instrs->count; i++)
+    {
+        if (instrs->items[i].opcode == X86_label)
+            labels[instrs->items[i].dst.value] = i;
+    }
+    uint32_t *live_in = calloc(instrs->count + 1, sizeof(uint32_t));
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t i = instrs->count; i-- > 0;)
+        {
+            x86_instr *instr = instrs->items + i;
+            uint32_t out = 0;
+            bool falls_through = true;
+            if ((instr->opcode == X86_jmp || instr->opcode == X86_jcc) && instr->dst.kind == X86_OPERAND_label)
+                out |= live_in[labels[instr->dst.value]];
+            if (instr->opcode == X86_jmp && instr->dst.kind == X86_OPERAND_symbol)
+                // A tail call passes its argument and must leave the callee-saved registers intact
+                out |= X86_CALLEE_SAVED_MASK | x86_args_regs(instr->args_count);
+            if (instr->opcode == X86_ret)
+                out |= X86_CALLEE_SAVED_MASK | X86_REG_BIT(X86_REG_rax);
+            if (instr->opcode == X86_jmp || instr->opcode == X86_ret)
+                falls_through = false;
+            if (falls_through && i + 1 < instrs->count)
+                out |= live_in[i + 1];
+            live_out[i] = out;
+            uint32_t in = x86_instr_uses(instr) | (out & ~x86_instr_defs(instr));
+            if (in != live_in[i])
+            {
+                live_in[i] = in;
+                changed = true;
+            }
+        }
+    }
+    free(live_in);
+    free(labels);
+}
+
+bool x86_is_label_jump(x86_instr *instr)
+{
+    return (instr->opcode == X86_jmp || instr->opcode == X86_jcc) && instr->dst.kind == X86_OPERAND_label;
+}
+
+// Whether only labels separate instruction `index` from the definition of `label`
+bool x86_label_follows(x86_instrs *instrs, size_t index, int32_t label)
+{
+    for (size_t i = index + 1; i < instrs->count && instrs->items[i].opcode == X86_label; i++)
+    {
+        if (instrs->items[i].dst.value == label)
+            return true;
+    }
+    return false;
+}
+
+bool peephole_x86_64_pass(x86_instrs *instrs)
+{
+    uint32_t *live_out = calloc(instrs->count + 1, sizeof(uint32_t));
+    bool *removed = calloc(instrs->count + 1, sizeof(bool));
+    bool *referenced = NULL;
+    x86_liveness(instrs, live_out);
+    size_t labels_count = 0;
+    for (size_t i = 0; i < instrs->count; i++)
+    {
+        if (x86_is_label_jump(instrs->items + i) && (size_t)instrs->items[i].dst.value >= labels_count)
+            labels_count = instrs->items[i].dst.value + 1;
+    }
+    referenced = calloc(labels_count + 1, sizeof(bool));
+    for (size_t i = 0; i < instrs->count; i++)
+    {
+        if (x86_is_label_jump(instrs->items + i))
+            referenced[instrs->items[i].dst.value] = true;
+    }
+
+    bool changed = false;
+    for (size_t i = 0; i < instrs->count; i++)
+    {
+        x86_instr *instr = instrs->items + i;
+        x86_instr *next = i + 1 < instrs->count ? instr + 1 : NULL;
+        x86_instr *after = i + 2 < instrs->count ? instr + 2 : NULL;
+        // Labels nothing jumps to
+        if (instr->opcode == X86_label && ((size_t)instr->dst.value >= labels_count || !referenced[instr->dst.value]))
+        {
+            removed[i] = true;
+        }
+        // Moves of a register to itself, and moves, lea and zeroing of registers that are never read
+        else if ((instr->opcode == X86_mov || instr->opcode == X86_lea) && instr->size >= 4 && instr->dst.kind == X86_OPERAND_reg &&
+                 (x86_operand_eq(instr->src, instr->dst) || !(live_out[i] & X86_REG_BIT(instr->dst.reg))))
+        {
+            removed[i] = true;
+        }
+        else if (x86_is_zero_idiom(instr) && !(live_out[i] & (X86_REG_BIT(instr->dst.reg) | X86_FLAGS_BIT)))
+        {
+            removed[i] = true;
+        }
+        // `mov x, t; mov t, b` and `lea x, t; mov t, b` with a dead `t` write b directly
+        else if ((instr->opcode == X86_mov || instr->opcode == X86_lea) && instr->size == 4 && instr->dst.kind == X86_OPERAND_reg && next != NULL &&
+                 next->opcode == X86_mov && next->size == 4 && x86_operand_eq(next->src, instr->dst) && !x86_operand_eq(next->dst, instr->dst) &&
+                 !(live_out[i + 1] & X86_REG_BIT(instr->dst.reg)) &&
+                 (next->dst.kind == X86_OPERAND_reg || (instr->opcode == X86_mov && instr->src.kind != X86_OPERAND_mem)))
+        {
+            instr->dst = next->dst;
+            removed[i + 1] = true;
+            i++;
+        }
+        // `lea d(r), r` is an add when nothing reads the flags it then sets
+        else if (instr->opcode == X86_lea && instr->src.kind == X86_OPERAND_mem && instr->src.scale == 0 && instr->dst.kind == X86_OPERAND_reg &&
+                 instr->src.reg == instr->dst.reg && !(live_out[i] & X86_FLAGS_BIT))
+        {
+            int32_t displacement = instr->src.value;
+            instr->src = (x86_operand){0};
+            if (displacement == 1)
+                instr->opcode = X86_inc;
+            else if (displacement == -1)
+                instr->opcode = X86_dec;
+            else
+            {
+                instr->opcode = X86_add;
+                instr->src = x86_imm(displacement);
+            }
+        }
+        // Jumps to the next instruction
+        else if (x86_is_label_jump(instr) && x86_label_follows(instrs, i, instr->dst.value))
+        {
+            removed[i] = true;
+        }
+        // Code after an unconditional jump or return up to the next label is unreachable
+        else if ((instr->opcode == X86_jmp || instr->opcode == X86_ret) && next != NULL && next->opcode != X86_label)
+        {
+            for (size_t j = i + 1; j < instrs->count && instrs->items[j].opcode != X86_label; j++)
+                removed[j] = true;
+            changed = true;
+            break;
+        }
+        // `jcc a; jmp b; a:` branches to b on the opposite condition
+        else if (instr->opcode == X86_jcc && next != NULL && next->opcode == X86_jmp && next->dst.kind == X86_OPERAND_label &&
+                 x86_label_follows(instrs, i + 1, instr->dst.value))
+        {
+            instr->cc = x86_invert_cc(instr->cc);
+            instr->dst = next->dst;
+            removed[i + 1] = true;
+            i++;
+        }
+        else if (instr->opcode == X86_mov && next != NULL && next->opcode == X86_mov && next->size == instr->size && instr->dst.kind == X86_OPERAND_mem &&
+                 x86_operand_eq(instr->dst, next->src) && instr->src.kind == X86_OPERAND_reg)
+        {
+            // Loading what was just stored reuses the register
+            if (x86_operand_eq(instr->src, next->dst))
+                removed[i + 1] = true;
+            else
+                next->src = instr->src;
+            i++;
+        }
+        else if (instr->opcode == X86_mov && next != NULL && next->opcode == X86_mov && next->size == instr->size && instr->dst.kind == X86_OPERAND_reg &&
+                 x86_operand_eq(instr->dst, next->src) && x86_operand_eq(instr->src, next->dst))
+        {
+            // Storing back what was just loaded
+            removed[i + 1] = true;
+            i++;
+        }
+        // `mov a, t; op x, t; mov t, a` with a dead `t` becomes `op x, a`
+        else if (instr->opcode == X86_mov && instr->size == 4 && instr->dst.kind == X86_OPERAND_reg && next != NULL && after != NULL &&
+                 (next->opcode == X86_add || next->opcode == X86_sub || next->opcode == X86_inc || next->opcode == X86_dec ||
+                  next->opcode == X86_shl || next->opcode == X86_sar || next->opcode == X86_and ||
+                  (next->opcode == X86_imul && instr->src.kind == X86_OPERAND_reg)) &&
+                 next->size == 4 && x86_operand_eq(next->dst, instr->dst) && !(x86_operand_regs(next->src) & X86_REG_BIT(instr->dst.reg)) &&
+                 after->opcode == X86_mov && after->size == 4 && x86_operand_eq(after->src, instr->dst) && x86_operand_eq(after->dst, instr->src) &&
+                 !(next->src.kind == X86_OPERAND_mem && instr->src.kind == X86_OPERAND_mem) && !(live_out[i + 2] & X86_REG_BIT(instr->dst.reg)))
+        {
+            next->dst = instr->src;
+            removed[i] = true;
+            removed[i + 2] = true;
+            i += 2;
+        }
+        else
+            continue;
+        changed = true;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < instrs->count; i++)
+    {
+        if (!removed[i])
+            instrs->items[count++] = instrs->items[i];
+    }
+    instrs->count = count;
+    free(referenced);
+    free(removed);
+    free(live_out);
+    return changed;
+}
+
+void peephole_x86_64(x86_instrs *instrs)
+{
+    while (peephole_x86_64_pass(instrs))
+        ;
+}
+
+/*
+    X86-64 INSTRUCTION SELECTION
+*/
+
+// Statements are matched against small patterns. Every pattern that applies emits its
+// instructions into a scratch list, and the cheapest one by the cost table below wins.
+// The IR is already three-address code, so the trees patterns cover are single statements
+// plus a comparison feeding the conditional jump right after it.
+
+// Rough latency of each opcode, memory accesses and immediates are added on top
+int X86_OPCODE_COSTS[] = {
+    [X86_mov] = 2,
+    [X86_add] = 2,
+    [X86_sub] = 2,
+    [X86_imul] = 6,
+    [X86_shl] = 2,
+    [X86_sar] = 2,
+    [X86_and] = 2,
+    [X86_movsx] = 2,
+    [X86_cqo] = 2,
+    [X86_idiv] = 40,
+    [X86_inc] = 2,
+    [X86_dec] = 2,
+    [X86_cmp] = 2,
+    [X86_test] = 2,
+    [X86_xor] = 2,
+    [X86_setcc] = 2,
+    [X86_lea] = 2,
+};
+#define X86_MEMORY_ACCESS_COST 8
+#define X86_IMM8_COST 1
+#define X86_IMM32_COST 4
+
+int x86_instr_cost(x86_instr *instr)
+{
+    int cost = X86_OPCODE_COSTS[instr->opcode];
+    x86_operand operands[2] = {instr->src, instr->dst};
+    for (size_t i = 0; i < 2; i++)
+    {
+        x86_operand operand = operands[i];
+        // lea only computes the address
+        if (operand.kind == X86_OPERAND_mem && instr->opcode != X86_lea)
+            cost += X86_MEMORY_ACCESS_COST;
+        else if (operand.kind == X86_OPERAND_imm || (operand.kind == X86_OPERAND_mem && operand.value != 0))
+            cost += x86_fits_i8(operand.value) ? X86_IMM8_COST : X86_IMM32_COST;
+    }
+    return cost;
+}
+
+typedef struct
+{
+    x86_operand dst;
+    x86_operand lhs;
+    x86_operand rhs;
+    enum spy_op_expr_binop_type binop;
+    enum x86_cc cc; // For comparisons, patterns that swap the operands swap it as well
+} x86_match;
+
+typedef bool (*x86_pattern)(x86_match *match, x86_instrs *instrs);
+
+// Emits the cheapest pattern that applies, `match` is updated the way the winner left it
+bool x86_select(x86_pattern *patterns, size_t patterns_count, x86_match *match, x86_instrs *instrs)
+{
+    x86_instrs scratch = {0};
+    x86_instrs best = {0};
+    x86_match best_match = *match;
+    int best_cost = -1;
+    for (size_t i = 0; i < patterns_count; i++)
+    {
+        x86_match candidate = *match;
+        scratch.count = 0;
+        if (!patterns[i](&candidate, &scratch))
+            continue;
+        int cost = 0;
+        for (size_t j = 0; j < scratch.count; j++)
+            cost += x86_instr_cost(scratch.items + j);
+        if (best_cost >= 0 && cost >= best_cost)
+            continue;
+        best_cost = cost;
+        best_match = candidate;
+        best.count = 0;
+        // A pattern may need no instructions at all, memcpy must not see the NULL items then
+        if (scratch.count > 0)
+            nob_da_append_many(&best, scratch.items, scratch.count);
+    }
+    if (best_cost >= 0)
+    {
+        if (best.count > 0)
+            nob_da_append_many(instrs, best.items, best.count);
+        *match = best_match;
+    }
+    nob_da_free(scratch);
+    nob_da_free(best);
+    return best_cost >= 0;
+}
+
+bool x86_is_imm(x86_operand operand, int32_t value)
+{
+    return operand.kind == X86_OPERAND_imm && operand.value == value;
+}
+
+// Moves between two stack slots go through %eax
+void compile_x86_64_move(x86_operand src, x86_operand dst, x86_instrs *instrs)
+{
+    if (x86_operand_eq(src, dst))
+        return;
+    if (src.kind == X86_OPERAND_mem && dst.kind == X86_OPERAND_mem)
+    {
+        x86_emit(instrs, X86_mov, 4, src, x86_reg(X86_REG_rax));
+        src = x86_reg(X86_REG_rax);
+    }
+    x86_emit(instrs, X86_mov, 4, src, dst);
+}
+
+enum x86_cc x86_swap_cc(enum x86_cc cc)
+{
+    // a < b is b > a
+    switch (cc)
+    {
+    case X86_CC_l:
+        return X86_CC_g;
+    case X86_CC_g:
+        return X86_CC_l;
+    case X86_CC_le:
+        return X86_CC_ge;
+    case X86_CC_ge:
+        return X86_CC_le;
+    case X86_CC_e:
+    case X86_CC_ne:
+        return cc;
+    }
+    return cc;
+}
+
+// Comparisons set the flags so that `cc` holds when `lhs <binop> rhs` does
+
+bool pattern_compare_cmp(x86_match *match, x86_instrs *instrs)
+{
+    if (match->lhs.kind == X86_OPERAND_imm || (match->lhs.kind == X86_OPERAND_mem && match->rhs.kind == X86_OPERAND_mem))
+        return false;
+    x86_emit(instrs, X86_cmp, 4, match->rhs, match->lhs);
+    return true;
+}
+
+bool pattern_compare_swapped(x86_match *match, x86_instrs *instrs)
+{
+    if (match->rhs.kind == X86_OPERAND_imm || (match->lhs.kind == X86_OPERAND_mem && match->rhs.kind == X86_OPERAND_mem))
+        return false;
+    x86_emit(instrs, X86_cmp, 4, match->lhs, match->rhs);
+    match->cc = x86_swap_cc(match->cc);
+    return true;
+}
+
+bool pattern_compare_test(x86_match *match, x86_instrs *instrs)
+{
+    // test clears OF, so the signed conditions against zero still hold
+    if (match->lhs.kind == X86_OPERAND_reg && x86_is_imm(match->rhs, 0))
+    {
+        x86_emit(instrs, X86_test, 4, match->lhs, match->lhs);
+        return true;
+    }
+    if (match->rhs.kind == X86_OPERAND_reg && x86_is_imm(match->lhs, 0))
+    {
+        x86_emit(instrs, X86_test, 4, match->rhs, match->rhs);
+        match->cc = x86_swap_cc(match->cc);
+        return true;
+    }
+    return false;
+}
+
+bool pattern_compare_scratch(x86_match *match, x86_instrs *instrs)
+{
+    x86_emit(instrs, X86_mov, 4, match->lhs, x86_reg(X86_REG_rax));
+    x86_emit(instrs, X86_cmp, 4, match->rhs, x86_reg(X86_REG_rax));
+    return true;
+}
+
+x86_pattern X86_COMPARE_PATTERNS[] = {
+    pattern_compare_cmp,
+    pattern_compare_swapped,
+    pattern_compare_test,
+    pattern_compare_scratch,
+};
+
+bool compile_x86_64_compare(x86_match *match, x86_instrs *instrs)
+{
+    return x86_select(X86_COMPARE_PATTERNS, sizeof X86_COMPARE_PATTERNS / sizeof(x86_pattern), match, instrs);
+}
+
+// Comparisons whose result is stored
+
+bool pattern_setcc_direct(x86_match *match, x86_instrs *instrs)
+{
+    // The register is cleared before the comparison, so it must not hold an operand
+    x86_operand dst = match->dst;
+    if (dst.kind != X86_OPERAND_reg || ((x86_operand_regs(match->lhs) | x86_operand_regs(match->rhs)) & X86_REG_BIT(dst.reg)))
+        return false;
+    x86_emit(instrs, X86_xor, 4, dst, dst);
+    if (!compile_x86_64_compare(match, instrs))
+        return false;
+    x86_emit_cc(instrs, X86_setcc, match->cc, dst);
+    return true;
+}
+
+bool pattern_setcc_scratch(x86_match *match, x86_instrs *instrs)
+{
+    // Use ecx as temporary register, it is never allocated
+    x86_emit(instrs, X86_xor, 4, x86_reg(X86_REG_rcx), x86_reg(X86_REG_rcx));
+    if (!compile_x86_64_compare(match, instrs))
+        return false;
+    x86_emit_cc(instrs, X86_setcc, match->cc, x86_reg(X86_REG_rcx));
+    compile_x86_64_move(x86_reg(X86_REG_rcx), match->dst, instrs);
+    return true;
+}
+
+// Arithmetic
+
+enum x86_opcode x86_arith_opcode(enum spy_op_expr_binop_type binop)
+{
+    return binop == SPY_OP_EXPR_BINOP_add ? X86_add : binop == SPY_OP_EXPR_BINOP_sub ? X86_sub : X86_imul;
+}
+
+bool x86_arith_commutes(enum spy_op_expr_binop_type binop)
+{
+    return binop == SPY_OP_EXPR_BINOP_add || binop == SPY_OP_EXPR_BINOP_mul;
+}
+
+bool x86_can_apply(enum x86_opcode opcode, x86_operand src, x86_operand dst)
+{
+    // imul only writes registers, and at most one operand can be in memory
+    if (opcode == X86_imul && dst.kind != X86_OPERAND_reg)
+        return false;
+    return !(src.kind == X86_OPERAND_mem && dst.kind == X86_OPERAND_mem) && dst.kind != X86_OPERAND_imm;
+}
+
+bool pattern_arith_in_place(x86_match *match, x86_instrs *instrs)
+{
+    enum x86_opcode opcode = x86_arith_opcode(match->binop);
+    if (!x86_operand_eq(match->dst, match->lhs) || !x86_can_apply(opcode, match->rhs, match->dst))
+        return false;
+    x86_emit(instrs, opcode, 4, match->rhs, match->dst);
+    return true;
+}
+
+bool pattern_arith_inc_dec(x86_match *match, x86_instrs *instrs)
+{
+    if (match->binop == SPY_OP_EXPR_BINOP_mul || !x86_operand_eq(match->dst, match->lhs) || match->dst.kind == X86_OPERAND_imm)
+        return false;
+    if (!x86_is_imm(match->rhs, 1) && !x86_is_imm(match->rhs, -1))
+        return false;
+    bool up = (match->binop == SPY_OP_EXPR_BINOP_add) == (match->rhs.value == 1);
+    x86_emit(instrs, up ? X86_inc : X86_dec, 4, (x86_operand){0}, match->dst);
+    return true;
+}
+
+bool pattern_arith_swapped(x86_match *match, x86_instrs *instrs)
+{
+    enum x86_opcode opcode = x86_arith_opcode(match->binop);
+    if (!x86_arith_commutes(match->binop) || !x86_operand_eq(match->dst, match->rhs) || !x86_can_apply(opcode, match->lhs, match->dst))
+        return false;
+    x86_emit(instrs, opcode, 4, match->lhs, match->dst);
+    return true;
+}
+
+bool pattern_arith_lea(x86_match *match, x86_instrs *instrs)
+{
+    // Three operand add of a constant
+    if (match->dst.kind != X86_OPERAND_reg || match->binop == SPY_OP_EXPR_BINOP_mul)
+        return false;
+    x86_operand base = match->lhs;
+    x86_operand offset = match->rhs;
+    if (match->binop == SPY_OP_EXPR_BINOP_add && base.kind == X86_OPERAND_imm)
+    {
+        base = match->rhs;
+        offset = match->lhs;
+    }
+    if (base.kind != X86_OPERAND_reg || offset.kind != X86_OPERAND_imm)
+        return false;
+    // -INT32_MIN does not fit
+    if (match->binop == SPY_OP_EXPR_BINOP_sub && offset.value == INT32_MIN)
+        return false;
+    int32_t displacement = match->binop == SPY_OP_EXPR_BINOP_sub ? -offset.value : offset.value;
+    x86_emit(instrs, X86_lea, 4, x86_mem(base.reg, displacement), match->dst);
+    return true;
+}
+
+bool pattern_arith_general(x86_match *match, x86_instrs *instrs)
+{
+    enum x86_opcode opcode = x86_arith_opcode(match->binop);
+    // Spilled results are computed in %eax, so is anything that would overwrite rhs too early
+    x86_operand work = match->dst.kind == X86_OPERAND_reg ? match->dst : x86_reg(X86_REG_rax);
+    if (x86_operand_eq(work, match->rhs) && !x86_operand_eq(match->lhs, match->rhs))
+        work = x86_reg(X86_REG_rax);
+    compile_x86_64_move(match->lhs, work, instrs);
+    x86_emit(instrs, opcode, 4, match->rhs, work);
+    compile_x86_64_move(work, match->dst, instrs);
+    return true;
+}
+
+// Returns k when `value` is 2^k, otherwise -1
+int x86_log2(int32_t value)
+{
+    if (value <= 0 || (value & (value - 1)) != 0)
+        return -1;
+    int k = 0;
+    while ((1 << k) != value)
+        k++;
+    return k;
+}
+
+// `dst = lhs op $imm` for the shifts and and, in place when lhs is dst
+void compile_x86_64_op_imm(enum x86_opcode opcode, int32_t imm, x86_operand lhs, x86_operand dst, x86_instrs *instrs)
+{
+    x86_operand work = dst.kind == X86_OPERAND_reg || x86_operand_eq(lhs, dst) ? dst : x86_reg(X86_REG_rax);
+    compile_x86_64_move(lhs, work, instrs);
+    x86_emit(instrs, opcode, 4, x86_imm(imm), work);
+    compile_x86_64_move(work, dst, instrs);
+}
+
+// Splits a multiply by a constant into the constant and the other operand
+bool x86_mul_by_constant(x86_match *match, x86_operand *other, int32_t *constant)
+{
+    if (match->binop != SPY_OP_EXPR_BINOP_mul)
+        return false;
+    if (match->rhs.kind == X86_OPERAND_imm)
+    {
+        *other = match->lhs;
+        *constant = match->rhs.value;
+        return true;
+    }
+    if (match->lhs.kind == X86_OPERAND_imm)
+    {
+        *other = match->rhs;
+        *constant = match->lhs.value;
+        return true;
+    }
+    return false;
+}
+
+bool pattern_mul_shift(x86_match *match, x86_instrs *instrs)
+{
+    x86_operand other = {0};
+    int32_t constant = 0;
+    if (!x86_mul_by_constant(match, &other, &constant) || x86_log2(constant) < 0)
+        return false;
+    if (constant == 1)
+        compile_x86_64_move(other, match->dst, instrs);
+    else
+        compile_x86_64_op_imm(X86_shl, x86_log2(constant), other, match->dst, instrs);
+    return true;
+}
+
+bool pattern_mul_lea(x86_match *match, x86_instrs *instrs)
+{
+    // 3, 5 and 9 are a single lea, times a power of two a shift follows
+    x86_operand other = {0};
+    int32_t constant = 0;
+    if (!x86_mul_by_constant(match, &other, &constant))
+        return false;
+    int32_t factor = 0;
+    int shift = -1;
+    for (int32_t candidate = 3; candidate <= 9 && shift < 0; candidate = candidate * 2 - 1)
+    {
+        if (constant % candidate == 0)
+        {
+            factor = candidate;
+            shift = x86_log2(constant / candidate);
+        }
+    }
+    if (shift < 0)
+        return false;
+    x86_operand work = match->dst.kind == X86_OPERAND_reg ? match->dst : x86_reg(X86_REG_rax);
+    if (other.kind != X86_OPERAND_reg)
+    {
+        compile_x86_64_move(other, work, instrs);
+        other = work;
+    }
+    x86_emit(instrs, X86_lea, 4, x86_mem_index(other.reg, other.reg, factor - 1, 0), work);
+    if (shift > 0)
+        x86_emit(instrs, X86_shl, 4, x86_imm(shift), work);
+    compile_x86_64_move(work, match->dst, instrs);
+    return true;
+}
+
+x86_pattern X86_ARITH_PATTERNS[] = {
+    pattern_arith_in_place,
+    pattern_arith_inc_dec,
+    pattern_arith_swapped,
+    pattern_arith_lea,
+    pattern_arith_general,
+    pattern_mul_shift,
+    pattern_mul_lea,
+};
+
+// Division. `//` and `%` round towards negative infinity, where idiv truncates towards zero.
+
+bool pattern_divide_power_of_two(x86_match *match, x86_instrs *instrs)
+{
+    // Arithmetic shifts round down already, and masking gives the non-negative remainder
+    if (match->rhs.kind != X86_OPERAND_imm || x86_log2(match->rhs.value) < 0)
+        return false;
+    if (match->binop == SPY_OP_EXPR_BINOP_mod)
+        compile_x86_64_op_imm(X86_and, match->rhs.value - 1, match->lhs, match->dst, instrs);
+    else if (match->rhs.value == 1)
+        compile_x86_64_move(match->lhs, match->dst, instrs);
+    else
+        compile_x86_64_op_imm(X86_sar, x86_log2(match->rhs.value), match->lhs, match->dst, instrs);
+    return true;
+}
+
+bool pattern_divide_magic(x86_match *match, x86_instrs *instrs)
+{
+    // For n < 0, floor(n / d) is ~(~n / d) and ~n is not negative. Granlund and Montgomery:
+    // with l = ceil(log2 d) and m = ceil(2^(31 + l) / d), x / d = (x * m) >> (31 + l) for
+    // every 0 <= x < 2^31. m fits in 32 bits and the product in 63.
+    if (match->rhs.kind != X86_OPERAND_imm || match->rhs.value < 3 || x86_log2(match->rhs.value) >= 0)
+        return false;
+    int64_t divisor = match->rhs.value;
+    int l = 0;
+    while (((int64_t)1 << l) < divisor)
+        l++;
+    uint64_t magic = (((uint64_t)1 << (31 + l)) + divisor - 1) / divisor;
+    x86_operand eax = x86_reg(X86_REG_rax);
+    x86_operand ecx = x86_reg(X86_REG_rcx);
+    x86_operand edx = x86_reg(X86_REG_rdx);
+    compile_x86_64_move(match->lhs, eax, instrs);
+    x86_emit(instrs, X86_mov, 4, eax, ecx);
+    x86_emit(instrs, X86_sar, 4, x86_imm(31), ecx);
+    x86_emit(instrs, X86_xor, 4, ecx, eax);
+    // 32 bit moves zero the upper half, so the 64 bit multiply sees both as unsigned
+    x86_emit(instrs, X86_mov, 4, x86_imm((int32_t)(uint32_t)magic), edx);
+    x86_emit(instrs, X86_imul, 8, edx, eax);
+    x86_emit(instrs, X86_sar, 8, x86_imm(31 + l), eax);
+    x86_emit(instrs, X86_xor, 4, ecx, eax);
+    if (match->binop == SPY_OP_EXPR_BINOP_mod)
+    {
+        // n - n // d * d, the product never overflows
+        x86_emit(instrs, X86_imul, 4, match->rhs, eax);
+        compile_x86_64_move(match->lhs, ecx, instrs);
+        x86_emit(instrs, X86_sub, 4, eax, ecx);
+        compile_x86_64_move(ecx, match->dst, instrs);
+        return true;
+    }
+    compile_x86_64_move(eax, match->dst, instrs);
+    return true;
+}
+
+void compile_x86_64_sign_extend(x86_operand src, enum x86_reg dst, x86_instrs *instrs)
+{
+    if (src.kind == X86_OPERAND_imm)
+        x86_emit(instrs, X86_mov, 8, src, x86_reg(dst));
+    else
+        x86_emit(instrs, X86_movsx, 8, src, x86_reg(dst));
+}
+
+bool pattern_divide_general(x86_match *match, x86_instrs *instrs)
+{
+    // Dividing in 64 bits makes INT32_MIN // -1 wrap around instead of trapping. The truncated
+    // quotient is one too big when the remainder is not zero and has the other sign from the
+    // divisor, which is exactly when remainder * divisor is negative.
+    x86_operand rax = x86_reg(X86_REG_rax);
+    x86_operand rcx = x86_reg(X86_REG_rcx);
+    x86_operand rdx = x86_reg(X86_REG_rdx);
+    compile_x86_64_sign_extend(match->lhs, X86_REG_rax, instrs);
+    compile_x86_64_sign_extend(match->rhs, X86_REG_rcx, instrs);
+    x86_emit(instrs, X86_cqo, 8, (x86_operand){0}, (x86_operand){0});
+    x86_emit(instrs, X86_idiv, 8, rcx, (x86_operand){0});
+    if (match->binop == SPY_OP_EXPR_BINOP_mod)
+    {
+        // Adds the divisor to the remainder
+        x86_emit(instrs, X86_mov, 8, rdx, rax);
+        x86_emit(instrs, X86_imul, 8, rcx, rax);
+        x86_emit(instrs, X86_sar, 8, x86_imm(63), rax);
+        x86_emit(instrs, X86_and, 4, rcx, rax);
+        x86_emit(instrs, X86_add, 4, rdx, rax);
+    }
+    else
+    {
+        // Subtracts one from the quotient
+        x86_emit(instrs, X86_imul, 8, rcx, rdx);
+        x86_emit(instrs, X86_sar, 8, x86_imm(63), rdx);
+        x86_emit(instrs, X86_add, 4, rdx, rax);
+    }
+    compile_x86_64_move(rax, match->dst, instrs);
+    return true;
+}
+
+x86_pattern X86_DIVISION_PATTERNS[] = {
+    pattern_divide_power_of_two,
+    pattern_divide_magic,
+    pattern_divide_general,
+};
+
+x86_pattern X86_SETCC_PATTERNS[] = {
+    pattern_setcc_direct,
+    pattern_setcc_scratch,
+};
+
+// Assignments
+
+bool pattern_assign_move(x86_match *match, x86_instrs *instrs)
+{
+    compile_x86_64_move(match->lhs, match->dst, instrs);
+    return true;
+}
+
+bool pattern_assign_zero(x86_match *match, x86_instrs *instrs)
+{
+    if (match->dst.kind != X86_OPERAND_reg || !x86_is_imm(match->lhs, 0))
+        return false;
+    x86_emit(instrs, X86_xor, 4, match->dst, match->dst);
+    return true;
+}
+
+x86_pattern X86_ASSIGN_PATTERNS[] = {
+    pattern_assign_move,
+    pattern_assign_zero,
+};
+
+void compile_x86_64_prologue(x86_allocation *allocation, x86_instrs *instrs)
+{
+    if (!allocation->frame_omitted)
+    {
+        x86_emit(instrs, X86_push, 8, x86_reg(X86_REG_rbp), (x86_operand){0});
+        x86_emit(instrs, X86_mov, 8, x86_reg(X86_REG_rsp), x86_reg(X86_REG_rbp));
+    }
+    for (size_t i = 0; i < allocation->saved_count; i++)
+        x86_emit(instrs, X86_push, 8, x86_reg(allocation->saved[i]), (x86_operand){0});
+    if (allocation->frame_size > 0)
+        x86_emit(instrs, X86_sub, 8, x86_imm(allocation->frame_size), x86_reg(X86_REG_rsp));
+}
+
+void compile_x86_64_epilogue(x86_allocation *allocation, x86_instrs *instrs)
+{
+    if (allocation->frame_omitted)
+    {
+        for (size_t i = allocation->saved_count; i-- > 0;)
+            x86_emit(instrs, X86_pop, 8, x86_reg(allocation->saved[i]), (x86_operand){0});
+        return;
+    }
+    if (allocation->saved_count == 0)
+    {
+        x86_emit(instrs, X86_leave, 8, (x86_operand){0}, (x86_operand){0});
+        return;
+    }
+    x86_emit(instrs, X86_lea, 8, x86_mem(X86_REG_rbp, -8 * (int32_t)allocation->saved_count), x86_reg(X86_REG_rsp));
+    for (size_t i = allocation->saved_count; i-- > 0;)
+        x86_emit(instrs, X86_pop, 8, x86_reg(allocation->saved[i]), (x86_operand){0});
+    x86_emit(instrs, X86_pop, 8, x86_reg(X86_REG_rbp), (x86_operand){0});
+}
+
+bool compile_x86_64_compare_and_branch(x86_allocation *allocation, spy_op_stmt *op, spy_op_stmt *jump, x86_instrs *instrs)
+{
+    if (!is_compare_binop(op->binop))
+    {
+        fprintf(stderr, "Unreachable! Only comparisons can be fused with a conditional jump!\n");
+        return false;
+    }
+    x86_match match = {
+        .lhs = x86_location(allocation, spy_op_lhs(op)),
+        .rhs = x86_location(allocation, spy_op_rhs(op)),
+        .binop = op->binop,
+        .cc = x86_compare_cc(op->binop),
+    };
+    if (!compile_x86_64_compare(&match, instrs))
+        return false;
+    // The conditional jump leaves the block when the condition is false, so the sense is inverted
+    x86_emit_cc(instrs, X86_jcc, x86_invert_cc(match.cc), x86_label(jump->index));
+    return true;
+}
+
+bool compile_x86_64_statement(spy_op_function *function, x86_allocation *allocation, spy_op_stmt *op, x86_instrs *instrs)
+{
+    switch ((enum spy_op_stmt_type)op->type)
+    {
+    case SPY_OP_assign:
+    case SPY_OP_declare_assign:
+    {
+        x86_match match = {.dst = allocation->locations[op->index], .lhs = x86_location(allocation, spy_op_lhs(op))};
+        return x86_select(X86_ASSIGN_PATTERNS, sizeof X86_ASSIGN_PATTERNS / sizeof(x86_pattern), &match, instrs);
+    }
+    case SPY_OP_assign_binop:
+    case SPY_OP_declare_assign_binop:
+    {
+        x86_match match = {
+            .dst = allocation->locations[op->index],
+            .lhs = x86_location(allocation, spy_op_lhs(op)),
+            .rhs = x86_location(allocation, spy_op_rhs(op)),
+            .binop = op->binop,
+            .cc = x86_compare_cc(op->binop),
+        };
+        if (is_compare_binop(op->binop))
+            return x86_select(X86_SETCC_PATTERNS, sizeof X86_SETCC_PATTERNS / sizeof(x86_pattern), &match, instrs);
+        if (is_division_binop(op->binop))
+            return x86_select(X86_DIVISION_PATTERNS, sizeof X86_DIVISION_PATTERNS / sizeof(x86_pattern), &match, instrs);
+        return x86_select(X86_ARITH_PATTERNS, sizeof X86_ARITH_PATTERNS / sizeof(x86_pattern), &match, instrs);
+    }
+    case SPY_OP_func_call:
+    case SPY_OP_tail_call:
+    {
+        if (op->rhs == 1)
+        {
+            compile_x86_64_move(x86_location(allocation, spy_op_args(function, op)[0]), x86_reg(X86_REG_rdi), instrs);
+        }
+        else if (op->rhs > 1)
+        {
+            fprintf(stderr, "Comiling function calls with more than 1 argument on `x86-64` is not supported yet!\n");
+            return false;
+        }
+        if (op->type == SPY_OP_tail_call)
+        {
+            // The callee returns straight to our caller
+            compile_x86_64_epilogue(allocation, instrs);
+            x86_emit_call(instrs, X86_jmp, op->index, op->rhs);
+        }
+        else
+        {
+            x86_emit_call(instrs, X86_call, op->index, op->rhs);
+        }
+        break;
+    }
+    case SPY_OP_jump:
+        x86_emit(instrs, X86_jmp, 8, (x86_operand){0}, x86_label(op->index));
+        break;
+    case SPY_OP_conditional_jump:
+    {
+        x86_match match = {.lhs = x86_location(allocation, spy_op_lhs(op)), .rhs = x86_imm(0), .cc = X86_CC_e};
+        // A constant condition either always jumps or never does
+        if (match.lhs.kind == X86_OPERAND_imm)
+        {
+            if (match.lhs.value == 0)
+                x86_emit(instrs, X86_jmp, 8, (x86_operand){0}, x86_label(op->index));
+            break;
+        }
+        if (!compile_x86_64_compare(&match, instrs))
+            return false;
+        x86_emit_cc(instrs, X86_jcc, match.cc, x86_label(op->index));
+        break;
+    }
+    case SPY_OP_block_mark_start:
+    case SPY_OP_block_mark_end:
+        x86_emit(instrs, X86_label, 8, (x86_operand){0}, x86_label(op->index));
+        break;
+    }
+    return true;
+}
+
+#define SPY_X86_64_MIN_PUTCHAR_RUN 4
+
+bool is_constant_putchar(x86_module *module, spy_op_function *function, spy_op_stmt *op)
+{
+    if (op->type != SPY_OP_func_call || op->rhs != 1 || !str_eq(module->symbols.items[op->index], "putchar"))
+        return false;
+    spy_op_term arg = spy_op_args(function, op)[0];
+    // printf("%.*s") stops at a zero byte
+    return arg.type == SPY_OP_TERM_intlit && arg.data.intlit > 0 && arg.data.intlit < 256;
+}
+
+size_t constant_putchar_run(x86_module *module, spy_op_function *function, size_t index)
+{
+    size_t end = index;
+    while (end < function->stmts.count && is_constant_putchar(module, function, function->stmts.items + end))
+        end++;
+    return end - index;
+}
+
+void compile_x86_64_putchar_run(x86_module *module, spy_op_function *function, size_t index, size_t count, x86_instrs *instrs)
+{
+    // The characters go to .rodata and are written with a single call
+    x86_data string = {
+        .name = nob_temp_sprintf("spy_string_%zu", module->datas.count),
+        .section = X86_DATA_rodata,
+        .size = count,
+        .bytes = malloc(count),
+    };
+    for (size_t i = 0; i < count; i++)
+        string.bytes[i] = (char)spy_op_args(function, function->stmts.items + index + i)[0].data.intlit;
+    uint32_t symbol = spy_op_name_index(&module->symbols, string.name);
+    nob_da_append(&module->datas, string);
+    if (module->static_runtime)
+    {
+        x86_emit(instrs, X86_lea, 8, x86_rip(symbol), x86_reg(X86_REG_rdi));
+        x86_emit(instrs, X86_mov, 4, x86_imm(count), x86_reg(X86_REG_rsi));
+        x86_emit_call(instrs, X86_call, spy_op_name_index(&module->symbols, "spy_write"), 2);
+        return;
+    }
+    uint32_t format = spy_op_name_index(&module->symbols, "spy_string_format");
+    if (x86_module_data(module, format) < 0)
+    {
+        x86_data data = {.name = "spy_string_format", .section = X86_DATA_rodata, .size = 5, .bytes = strdup("%.*s")};
+        nob_da_append(&module->datas, data);
+    }
+    x86_emit(instrs, X86_lea, 8, x86_rip(format), x86_reg(X86_REG_rdi));
+    x86_emit(instrs, X86_mov, 4, x86_imm(count), x86_reg(X86_REG_rsi));
+    x86_emit(instrs, X86_lea, 8, x86_rip(symbol), x86_reg(X86_REG_rdx));
+    // Variadic calls pass the number of vector registers in %al
+    x86_emit(instrs, X86_xor, 4, x86_reg(X86_REG_rax), x86_reg(X86_REG_rax));
+    x86_emit_call(instrs, X86_call, spy_op_name_index(&module->symbols, "printf"), 3);
+}
+
+bool compile_x86_64_function(x86_module *module, spy_op_function *function, x86_instrs *instrs)
+{
+    x86_allocation allocation = {0};
+    allocate_x86_64_registers(function, &allocation);
+    compile_x86_64_prologue(&allocation, instrs);
+    bool result = true;
+    for (size_t i = 0; i < function->stmts.count && result; i++)
+    {
+        spy_op_stmt *op = function->stmts.items + i;
+        if (can_fuse_compare_and_branch(function, i))
+        {
+            result = compile_x86_64_compare_and_branch(&allocation, op, op + 1, instrs);
+            i++;
+            continue;
+        }
+        size_t run = constant_putchar_run(module, function, i);
+        if (run >= SPY_X86_64_MIN_PUTCHAR_RUN)
+        {
+            compile_x86_64_putchar_run(module, function, i, run, instrs);
+            i += run - 1;
+            continue;
+        }
+        result = compile_x86_64_statement(function, &allocation, op, instrs);
+    }
+    // TODO proper return
+    x86_emit(instrs, X86_mov, 4, x86_imm(0), x86_reg(X86_REG_rax));
+    compile_x86_64_epilogue(&allocation, instrs);
+    x86_emit(instrs, X86_ret, 8, (x86_operand){0}, (x86_operand){0});
+    x86_allocation_free(&allocation);
+    if (result)
+        peephole_x86_64(instrs);
+    return result;
+}
+
+bool compile_x86_64_module(spy_ops *ops, bool static_runtime, x86_module *module)
+{
+    for (size_t i = 0; i < ops->names.count; i++)
+        nob_da_append(&module->symbols, ops->names.items[i]);
+    module->static_runtime = static_runtime;
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        x86_function function = {
+            .name = ops->items[i].name,
+            .global = str_eq(ops->items[i].name, "main"),
+        };
+        bool ok = compile_x86_64_function(module, ops->items + i, &function.instrs);
+        nob_da_append(&module->functions, function);
+        if (!ok)
+            return false;
+    }
+    if (static_runtime)
+        compile_x86_64_runtime(module);
+    return true;
+}
+
+/*
+    X86-64 ASSEMBLY TEXT
+*/
+
+char *x86_64_symbol(enum spy_output_target target, char *name)
+{
+    // Mach-O prefixes C symbols with an underscore, ELF does not
+    if (target != SPY_OUTPUT_TARGET_x86_64_macos)
+        return name;
+    if (str_eq(name, "main"))
+        return "_main";
+    if (str_eq(name, "putchar"))
+        return "_putchar";
+    if (str_eq(name, "printf"))
+        return "_printf";
+    return name;
+}
+
+// Big programs spent most of their .s time in nob_sb_appendf, which parses its format and
+// runs vsnprintf twice per call. Lines are instead copied together from precomputed strings
+// into room reserved once per line.
+
+typedef struct
+{
+    const char *text;
+    size_t length;
+} x86_asm_string;
+
+#define X86_ASM_STRING(s) {s, sizeof(s) - 1}
+
+const x86_asm_string X86_ASM_REGS_64[] = {
+    X86_ASM_STRING("%rax"), X86_ASM_STRING("%rcx"), X86_ASM_STRING("%rdx"), X86_ASM_STRING("%rbx"),
+    X86_ASM_STRING("%rsp"), X86_ASM_STRING("%rbp"), X86_ASM_STRING("%rsi"), X86_ASM_STRING("%rdi"),
+    X86_ASM_STRING("%r8"), X86_ASM_STRING("%r9"), X86_ASM_STRING("%r10"), X86_ASM_STRING("%r11"),
+    X86_ASM_STRING("%r12"), X86_ASM_STRING("%r13"), X86_ASM_STRING("%r14"), X86_ASM_STRING("%r15"),
+};
+const x86_asm_string X86_ASM_REGS_32[] = {
+    X86_ASM_STRING("%eax"), X86_ASM_STRING("%ecx"), X86_ASM_STRING("%edx"), X86_ASM_STRING("%ebx"),
+    X86_ASM_STRING("%esp"), X86_ASM_STRING("%ebp"), X86_ASM_STRING("%esi"), X86_ASM_STRING("%edi"),
+    X86_ASM_STRING("%r8d"), X86_ASM_STRING("%r9d"), X86_ASM_STRING("%r10d"), X86_ASM_STRING("%r11d"),
+    X86_ASM_STRING("%r12d"), X86_ASM_STRING("%r13d"), X86_ASM_STRING("%r14d"), X86_ASM_STRING("%r15d"),
+};
+const x86_asm_string X86_ASM_REGS_8[] = {
+    X86_ASM_STRING("%al"), X86_ASM_STRING("%cl"), X86_ASM_STRING("%dl"), X86_ASM_STRING("%bl"),
+    X86_ASM_STRING("%spl"), X86_ASM_STRING("%bpl"), X86_ASM_STRING("%sil"), X86_ASM_STRING("%dil"),
+    X86_ASM_STRING("%r8b"), X86_ASM_STRING("%r9b"), X86_ASM_STRING("%r10b"), X86_ASM_STRING("%r11b"),
+    X86_ASM_STRING("%r12b"), X86_ASM_STRING("%r13b"), X86_ASM_STRING("%r14b"), X86_ASM_STRING("%r15b"),
+};
+
+// Sized mnemonics get their suffix and a space appended, `setcc` and `jcc` their condition
+const x86_asm_string X86_ASM_MNEMONICS[] = {
+    [X86_label] = X86_ASM_STRING(""),
+    [X86_mov] = X86_ASM_STRING("    mov"),
+    [X86_add] = X86_ASM_STRING("    add"),
+    [X86_sub] = X86_ASM_STRING("    sub"),
+    [X86_imul] = X86_ASM_STRING("    imul"),
+    [X86_shl] = X86_ASM_STRING("    shl"),
+    [X86_sar] = X86_ASM_STRING("    sar"),
+    [X86_and] = X86_ASM_STRING("    and"),
+    [X86_movsx] = X86_ASM_STRING("    movslq "),
+    [X86_cqo] = X86_ASM_STRING("    cqto\n"),
+    [X86_idiv] = X86_ASM_STRING("    idiv"),
+    [X86_inc] = X86_ASM_STRING("    inc"),
+    [X86_dec] = X86_ASM_STRING("    dec"),
+    [X86_cmp] = X86_ASM_STRING("    cmp"),
+    [X86_test] = X86_ASM_STRING("    test"),
+    [X86_xor] = X86_ASM_STRING("    xor"),
+    [X86_setcc] = X86_ASM_STRING("    set"),
+    [X86_jcc] = X86_ASM_STRING("    j"),
+    [X86_jmp] = X86_ASM_STRING("    jmp "),
+    [X86_call] = X86_ASM_STRING("    call "),
+    [X86_push] = X86_ASM_STRING("    push "),
+    [X86_pop] = X86_ASM_STRING("    pop "),
+    [X86_lea] = X86_ASM_STRING("    lea"),
+    [X86_leave] = X86_ASM_STRING("    leave\n"),
+    [X86_ret] = X86_ASM_STRING("    ret\n"),
+    [X86_syscall] = X86_ASM_STRING("    syscall\n"),
+};
+
+const x86_asm_string X86_ASM_CCS[] = {
+    [X86_CC_e] = X86_ASM_STRING("e "),
+    [X86_CC_ne] = X86_ASM_STRING("ne "),
+    [X86_CC_l] = X86_ASM_STRING("l "),
+    [X86_CC_ge] = X86_ASM_STRING("ge "),
+    [X86_CC_le] = X86_ASM_STRING("le "),
+    [X86_CC_g] = X86_ASM_STRING("g "),
+};
+
+const char X86_ASM_DIGIT_PAIRS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Room for a line without names, `    movslq -2147483648(%r15,%r15,8), %r15` is about half of it
+#define X86_ASM_LINE_MAX 96
+
+typedef struct
+{
+    enum spy_output_target target;
+    x86_module *module;
+    x86_asm_string *symbols; // Symbol names as the assembler wants them
+    bool *plt;               // Calls to the symbol go through the PLT
+    Nob_String_Builder label; // label_<function>_ of the function being written
+    size_t line_max;
+} x86_asm_writer;
+
+char *x86_asm_reserve(Nob_String_Builder *output, size_t size)
+{
+    nob_da_reserve(output, output->count + size);
+    return output->items + output->count;
+}
+
+void x86_asm_commit(Nob_String_Builder *output, char *at)
+{
+    output->count = at - output->items;
+}
+
+char *x86_asm_put(char *at, x86_asm_string string)
+{
+    memcpy(at, string.text, string.length);
+    return at + string.length;
+}
+
+char *x86_asm_put_int(char *at, int64_t value)
+{
+    // Two digits at a time from the back of a scratch buffer
+    char digits[24];
+    char *start = digits + sizeof digits;
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    while (magnitude >= 100)
+    {
+        const char *pair = X86_ASM_DIGIT_PAIRS + (magnitude % 100) * 2;
+        magnitude /= 100;
+        *--start = pair[1];
+        *--start = pair[0];
+    }
+    if (magnitude >= 10)
+    {
+        const char *pair = X86_ASM_DIGIT_PAIRS + magnitude * 2;
+        *--start = pair[1];
+        *--start = pair[0];
+    }
+    else
+    {
+        *--start = (char)('0' + magnitude);
+    }
+    if (value < 0)
+        *--start = '-';
+    size_t length = digits + sizeof digits - start;
+    memcpy(at, start, length);
+    return at + length;
+}
+
+int x86_asm_compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+void x86_asm_writer_init(x86_asm_writer *writer, enum spy_output_target target, x86_module *module)
+{
+    // Looking up whether the module defines a symbol is a scan over every function, do it
+    // once per symbol instead of once per call
+    size_t defined_count = module->functions.count + module->datas.count;
+    char **defined = malloc((defined_count + 1) * sizeof(char *));
+    for (size_t i = 0; i < module->functions.count; i++)
+        defined[i] = module->functions.items[i].name;
+    for (size_t i = 0; i < module->datas.count; i++)
+        defined[module->functions.count + i] = module->datas.items[i].name;
+    qsort(defined, defined_count, sizeof(char *), x86_asm_compare_names);
+
+    *writer = (x86_asm_writer){.target = target, .module = module};
+    writer->symbols = malloc((module->symbols.count + 1) * sizeof(x86_asm_string));
+    writer->plt = malloc(module->symbols.count + 1);
+    size_t longest = 0;
+    for (size_t i = 0; i < module->symbols.count; i++)
+    {
+        char *name = x86_64_symbol(target, module->symbols.items[i]);
+        writer->symbols[i] = (x86_asm_string){name, strlen(name)};
+        // Position independent executables reach libc through the PLT
+        writer->plt[i] = target == SPY_OUTPUT_TARGET_x86_64_linux &&
+                         bsearch(module->symbols.items + i, defined, defined_count, sizeof(char *), x86_asm_compare_names) == NULL;
+        longest = writer->symbols[i].length > longest ? writer->symbols[i].length : longest;
+    }
+    for (size_t i = 0; i < module->functions.count; i++)
+    {
+        size_t length = strlen(module->functions.items[i].name) + sizeof("label__") - 1;
+        longest = length > longest ? length : longest;
+    }
+    for (size_t i = 0; i < module->datas.count; i++)
+    {
+        size_t length = strlen(module->datas.items[i].name);
+        longest = length > longest ? length : longest;
+    }
+    // An instruction has at most two operands
+    writer->line_max = X86_ASM_LINE_MAX + 2 * longest;
+    free(defined);
+}
+
+void x86_asm_writer_free(x86_asm_writer *writer)
+{
+    free(writer->symbols);
+    free(writer->plt);
+    nob_sb_free(writer->label);
+}
+
+char *print_x86_64_operand(x86_asm_writer *writer, x86_operand operand, uint8_t size, char *at)
+{
+    switch ((enum x86_operand_kind)operand.kind)
+    {
+    case X86_OPERAND_none:
+        break;
+    case X86_OPERAND_reg:
+        at = x86_asm_put(at, size == 8 ? X86_ASM_REGS_64[operand.reg] : size == 4 ? X86_ASM_REGS_32[operand.reg] : X86_ASM_REGS_8[operand.reg]);
+        break;
+    case X86_OPERAND_imm:
+        *at++ = '$';
+        at = x86_asm_put_int(at, operand.value);
+        break;
+    case X86_OPERAND_mem:
+        at = x86_asm_put_int(at, operand.value);
+        *at++ = '(';
+        at = x86_asm_put(at, X86_ASM_REGS_64[operand.reg]);
+        if (operand.scale != 0)
+        {
+            *at++ = ',';
+            at = x86_asm_put(at, X86_ASM_REGS_64[operand.index]);
+            *at++ = ',';
+            at = x86_asm_put_int(at, operand.scale);
+        }
+        *at++ = ')';
+        break;
+    case X86_OPERAND_label:
+        at = x86_asm_put(at, (x86_asm_string){writer->label.items, writer->label.count});
+        at = x86_asm_put_int(at, operand.value);
+        break;
+    case X86_OPERAND_symbol:
+        at = x86_asm_put(at, writer->symbols[operand.value]);
+        if (writer->plt[operand.value])
+            at = x86_asm_put(at, (x86_asm_string)X86_ASM_STRING("@PLT"));
+        break;
+    case X86_OPERAND_rip:
+        at = x86_asm_put(at, writer->symbols[operand.value]);
+        at = x86_asm_put(at, (x86_asm_string)X86_ASM_STRING("(%rip)"));
+        break;
+    }
+    return at;
+}
+
+char *print_x86_64_instr(x86_asm_writer *writer, x86_instr *instr, char *at)
+{
+    enum x86_opcode opcode = instr->opcode;
+    at = x86_asm_put(at, X86_ASM_MNEMONICS[opcode]);
+    switch (opcode)
+    {
+    case X86_label:
+        at = print_x86_64_operand(writer, instr->dst, instr->size, at);
+        *at++ = ':';
+        *at++ = '\n';
+        return at;
+    case X86_movsx:
+        at = print_x86_64_operand(writer, instr->src, 4, at);
+        *at++ = ',';
+        *at++ = ' ';
+        at = print_x86_64_operand(writer, instr->dst, 8, at);
+        *at++ = '\n';
+        return at;
+    case X86_cqo:
+    case X86_leave:
+    case X86_ret:
+    case X86_syscall:
+        return at;
+    case X86_setcc:
+    case X86_jcc:
+        at = x86_asm_put(at, X86_ASM_CCS[instr->cc]);
+        break;
+    case X86_jmp:
+    case X86_call:
+    case X86_push:
+    case X86_pop:
+        break;
+    case X86_mov:
+    case X86_add:
+    case X86_sub:
+    case X86_imul:
+    case X86_shl:
+    case X86_sar:
+    case X86_and:
+    case X86_idiv:
+    case X86_inc:
+    case X86_dec:
+    case X86_cmp:
+    case X86_test:
+    case X86_xor:
+    case X86_lea:
+        *at++ = instr->size == 8 ? 'q' : instr->size == 4 ? 'l' : 'b';
+        *at++ = ' ';
+        break;
+    }
+    if (instr->src.kind != X86_OPERAND_none)
+    {
+        at = print_x86_64_operand(writer, instr->src, instr->size, at);
+        if (instr->dst.kind != X86_OPERAND_none)
+        {
+            *at++ = ',';
+            *at++ = ' ';
+        }
+    }
+    at = print_x86_64_operand(writer, instr->dst, instr->size, at);
+    *at++ = '\n';
+    return at;
+}
+
+void print_x86_64_function(x86_asm_writer *writer, x86_function *function, Nob_String_Builder *output)
+{
+    writer->label.count = 0;
+    nob_sb_append_cstr(&writer->label, "label_");
+    nob_sb_append_cstr(&writer->label, function->name);
+    nob_sb_append_cstr(&writer->label, "_");
+    nob_sb_append_cstr(output, x86_64_symbol(writer->target, function->name));
+    nob_sb_append_cstr(output, ":\n");
+    for (size_t i = 0; i < function->instrs.count; i++)
+    {
+        char *at = x86_asm_reserve(output, writer->line_max);
+        x86_asm_commit(output, print_x86_64_instr(writer, function->instrs.items + i, at));
+    }
+}
+
+void print_x86_64_globals(enum spy_output_target target, x86_module *module, Nob_String_Builder *output)
+{
+    for (size_t i = 0; i < module->functions.count; i++)
+    {
+        if (!module->functions.items[i].global)
+            continue;
+        nob_sb_append_cstr(output, "    .globl ");
+        nob_sb_append_cstr(output, x86_64_symbol(target, module->functions.items[i].name));
+        nob_sb_append_cstr(output, "\n");
+    }
+}
+
+void print_x86_64_datas(enum spy_output_target target, x86_module *module, Nob_String_Builder *output)
+{
+    for (size_t i = 0; i < module->datas.count; i++)
+    {
+        x86_data *data = module->datas.items + i;
+        switch (data->section)
+        {
+        case X86_DATA_bss:
+            if (target == SPY_OUTPUT_TARGET_x86_64_macos)
+            {
+                nob_sb_appendf(output, "    .zerofill __DATA,__bss,%s,%u,3\n", data->name, data->size);
+                break;
+            }
+            nob_sb_appendf(output, "    .bss\n");
+            nob_sb_appendf(output, "    .p2align 3\n");
+            nob_sb_appendf(output, "%s:\n", data->name);
+            nob_sb_appendf(output, "    .zero %u\n", data->size);
+            break;
+        case X86_DATA_rodata:
+            nob_sb_appendf(output, target == SPY_OUTPUT_TARGET_x86_64_macos ? "    .section __TEXT,__const\n" : "    .section .rodata\n");
+            nob_sb_appendf(output, "%s:\n", data->name);
+            for (size_t j = 0; j < data->size; j += 16)
+            {
+                // Lines of up to 16 `, 255`
+                char *at = x86_asm_reserve(output, X86_ASM_LINE_MAX);
+                at = x86_asm_put(at, (x86_asm_string)X86_ASM_STRING("    .byte "));
+                for (size_t k = j; k < j + 16 && k < data->size; k++)
+                {
+                    if (k != j)
+                    {
+                        *at++ = ',';
+                        *at++ = ' ';
+                    }
+                    at = x86_asm_put_int(at, (uint8_t)data->bytes[k]);
+                }
+                *at++ = '\n';
+                x86_asm_commit(output, at);
+            }
+            break;
+        }
+    }
+}
+
+bool compile_x86_64_macos_file_header(x86_module *module, Nob_String_Builder *output)
+{
+    print_x86_64_globals(SPY_OUTPUT_TARGET_x86_64_macos, module, output);
+    return true;
+}
+
+bool compile_x86_64_macos_file_footer()
+{
+    return true;
+}
+
+bool compile_x86_64_linux_file_header(x86_module *module, Nob_String_Builder *output)
+{
+    nob_sb_appendf(output, "    .text\n");
+    print_x86_64_globals(SPY_OUTPUT_TARGET_x86_64_linux, module, output);
+    return true;
+}
+
+bool compile_x86_64_linux_file_footer(Nob_String_Builder *output)
+{
+    // Without it the linker assumes the program needs an executable stack
+    nob_sb_appendf(output, "    .section .note.GNU-stack,\"\",@progbits\n");
+    return true;
+}
+
+bool compile_x86_64_macos(spy_ops *ops, spy_writer *writer)
+{
+    Nob_String_Builder *output = &writer->buffer;
+    x86_module module = {0};
+    bool result = compile_x86_64_module(ops, false, &module) && compile_x86_64_macos_file_header(&module, output);
+    x86_asm_writer asm_writer = {0};
+    if (result)
+        x86_asm_writer_init(&asm_writer, SPY_OUTPUT_TARGET_x86_64_macos, &module);
+    for (size_t i = 0; i < module.functions.count && result; i++)
+    {
+        spy_writer_drain(writer);
+        print_x86_64_function(&asm_writer, module.functions.items + i, output);
+    }
+    x86_asm_writer_free(&asm_writer);
+    if (result)
+    {
+        print_x86_64_datas(SPY_OUTPUT_TARGET_x86_64_macos, &module, output);
+        result = compile_x86_64_macos_file_footer();
+    }
+    x86_module_free(&module);
+    return result;
+}
+
+bool compile_x86_64_linux(spy_ops *ops, bool static_runtime, spy_writer *writer)
+{
+    Nob_String_Builder *output = &writer->buffer;
+    x86_module module = {0};
+    bool result = compile_x86_64_module(ops, static_runtime, &module) && compile_x86_64_linux_file_header(&module, output);
+    x86_asm_writer asm_writer = {0};
+    if (result)
+        x86_asm_writer_init(&asm_writer, SPY_OUTPUT_TARGET_x86_64_linux, &module);
+    for (size_t i = 0; i < module.functions.count && result; i++)
+    {
+        spy_writer_drain(writer);
+        print_x86_64_function(&asm_writer, module.functions.items + i, output);
+    }
+    x86_asm_writer_free(&asm_writer);
+    if (result)
+    {
+        print_x86_64_datas(SPY_OUTPUT_TARGET_x86_64_linux, &module, output);
+        result = compile_x86_64_linux_file_footer(output);
+    }
+    x86_module_free(&module);
+    return result;
+}
+
+/*
+    AARCH64 REGISTER ALLOCATION
+*/
+
+// Values are 32 bit and live in the w view of the registers. x0 to x13 and x19 to x28 are
+// allocated, x14 to x17 are scratch registers for instruction selection, x18 is reserved by
+// the platform and x29 and x30 hold the frame record.
+
+#define AARCH64_REG_fp 29
+#define AARCH64_REG_lr 30
+
+const uint8_t AARCH64_CALLER_SAVED[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13};
+const uint8_t AARCH64_CALLEE_SAVED[] = {19, 20, 21, 22, 23, 24, 25, 26, 27, 28};
+
+#define AARCH64_CALLEE_SAVED_COUNT (sizeof AARCH64_CALLEE_SAVED / sizeof(uint8_t))
+
+spy_register_file AARCH64_REGISTER_FILE = {
+    .caller_saved = AARCH64_CALLER_SAVED,
+    .caller_saved_count = sizeof AARCH64_CALLER_SAVED / sizeof(uint8_t),
+    .callee_saved = AARCH64_CALLEE_SAVED,
+    .callee_saved_count = AARCH64_CALLEE_SAVED_COUNT,
+    .argument = 0,
+};
+
+// Scratch registers, the operands of a statement are loaded into these when they are not in a register
+#define AARCH64_SCRATCH_QUOTIENT 14
+#define AARCH64_SCRATCH_REMAINDER 15
+#define AARCH64_SCRATCH_LHS 16
+#define AARCH64_SCRATCH_RHS 17
+
+// ldr and str reach 4095 words above the stack pointer
+#define AARCH64_MAX_SLOTS 4096
+
+typedef struct
+{
+    uint8_t *regs;   // Indexed by variable, SPY_NO_REG when the variable is in a stack slot
+    uint32_t *slots; // Indexed by variable
+    size_t vars_count;
+    uint8_t saved[AARCH64_CALLEE_SAVED_COUNT];
+    size_t saved_count;
+    size_t slots_count;
+    // Frame layout: the frame record of x29 and x30, the saved registers in pairs, then
+    // `frame_size` bytes of slots addressed from sp. Leaf functions never touch x30 and omit the record.
+    bool frame_omitted;
+    int32_t frame_size;
+} aarch64_allocation;
+
+void aarch64_allocation_free(aarch64_allocation *allocation)
+{
+    free(allocation->regs);
+    free(allocation->slots);
+    *allocation = (aarch64_allocation){0};
+}
+
+bool allocate_aarch64_registers(spy_op_function *function, aarch64_allocation *allocation)
+{
+    spy_intervals intervals = {0};
+    size_t slots_count = allocate_registers(function, &AARCH64_REGISTER_FILE, 0, &intervals);
+    if (slots_count > AARCH64_MAX_SLOTS)
+    {
+        fprintf(stderr, "Compiling functions with more than %d spilled variables on `aarch64` is not supported yet!\n", AARCH64_MAX_SLOTS);
+        nob_da_free(intervals);
+        return false;
+    }
+
+    *allocation = (aarch64_allocation){.vars_count = function_vars_count(function), .slots_count = slots_count};
+    allocation->regs = malloc(allocation->vars_count + 1);
+    memset(allocation->regs, SPY_NO_REG, allocation->vars_count + 1);
+    allocation->slots = calloc(allocation->vars_count + 1, sizeof(uint32_t));
+    bool saved[SPY_MAX_REGS] = {0};
+    for (size_t i = 0; i < intervals.count; i++)
+    {
+        spy_interval *interval = intervals.items + i;
+        allocation->regs[interval->var] = interval->reg;
+        allocation->slots[interval->var] = interval->slot;
+        if (interval->reg != SPY_NO_REG)
+            saved[interval->reg] = true;
+    }
+    for (size_t i = 0; i < AARCH64_CALLEE_SAVED_COUNT; i++)
+    {
+        if (saved[AARCH64_CALLEE_SAVED[i]])
+            allocation->saved[allocation->saved_count++] = AARCH64_CALLEE_SAVED[i];
+    }
+    allocation->frame_omitted = is_leaf_function(function);
+    // sp has to stay 16 byte aligned
+    allocation->frame_size = (4 * slots_count + 15) & ~15;
+    nob_da_free(intervals);
+    return true;
+}
+
+/*
+    AARCH64 ASSEMBLY TEXT
+*/
+
+enum aarch64_cc
+{
+    AARCH64_CC_eq,
+    AARCH64_CC_ne,
+    AARCH64_CC_lt,
+    AARCH64_CC_le,
+    AARCH64_CC_gt,
+    AARCH64_CC_ge,
+};
+
+char *AARCH64_CC_NAMES[] = {"eq", "ne", "lt", "le", "gt", "ge"};
+
+enum aarch64_cc aarch64_compare_cc(enum spy_op_expr_binop_type binop)
+{
+    switch (binop)
+    {
+    case SPY_OP_EXPR_BINOP_lt:
+        return AARCH64_CC_lt;
+    case SPY_OP_EXPR_BINOP_lte:
+        return AARCH64_CC_le;
+    case SPY_OP_EXPR_BINOP_gt:
+        return AARCH64_CC_gt;
+    case SPY_OP_EXPR_BINOP_gte:
+        return AARCH64_CC_ge;
+    case SPY_OP_EXPR_BINOP_eq:
+        return AARCH64_CC_eq;
+    default:
+        return AARCH64_CC_ne;
+    }
+}
+
+enum aarch64_cc aarch64_invert_cc(enum aarch64_cc cc)
+{
+    switch (cc)
+    {
+    case AARCH64_CC_eq:
+        return AARCH64_CC_ne;
+    case AARCH64_CC_ne:
+        return AARCH64_CC_eq;
+    case AARCH64_CC_lt:
+        return AARCH64_CC_ge;
+    case AARCH64_CC_le:
+        return AARCH64_CC_gt;
+    case AARCH64_CC_gt:
+        return AARCH64_CC_le;
+    case AARCH64_CC_ge:
+        return AARCH64_CC_lt;
+    }
+    return cc;
+}
+
+// The condition that holds after the operands of a comparison are swapped
+enum aarch64_cc aarch64_swap_cc(enum aarch64_cc cc)
+{
+    switch (cc)
+    {
+    case AARCH64_CC_lt:
+        return AARCH64_CC_gt;
+    case AARCH64_CC_le:
+        return AARCH64_CC_ge;
+    case AARCH64_CC_gt:
+        return AARCH64_CC_lt;
+    case AARCH64_CC_ge:
+        return AARCH64_CC_le;
+    default:
+        return cc;
+    }
+}
+
+char *aarch64_symbol(enum spy_output_target target, char *name)
+{
+    // Mach-O prefixes C symbols with an underscore, ELF does not
+    if (target != SPY_OUTPUT_TARGET_aarch64_mac_m1)
+        return name;
+    if (str_eq(name, "main"))
+        return "_main";
+    if (str_eq(name, "putchar"))
+        return "_putchar";
+    return name;
+}
+
+bool aarch64_is_imm(spy_op_term term)
+{
+    return term.type == SPY_OP_TERM_intlit;
+}
+
+bool aarch64_is_zero(spy_op_term term)
+{
+    return term.type == SPY_OP_TERM_intlit && term.data.intlit == 0;
+}
+
+// Immediates of add, sub, cmp and cmn are 12 bit unsigned
+bool aarch64_fits_imm12(int32_t value)
+{
+    return value >= 0 && value <= 4095;
+}
+
+void compile_aarch64_move_imm(uint8_t reg, int32_t value, Nob_String_Builder *output)
+{
+    // movz and movn cover 16 bits, the upper half of anything wider comes from movk
+    if (value >= -65536 && value <= 65535)
+    {
+        nob_sb_appendf(output, "    mov w%u, #%d\n", reg, value);
+        return;
+    }
+    nob_sb_appendf(output, "    mov w%u, #%u\n", reg, (uint32_t)value & 0xffff);
+    nob_sb_appendf(output, "    movk w%u, #%u, lsl #16\n", reg, (uint32_t)value >> 16);
+}
+
+// Returns the register holding `term`, loading it into `scratch` when it is not in one
+uint8_t compile_aarch64_read(aarch64_allocation *allocation, spy_op_term term, uint8_t scratch, Nob_String_Builder *output)
+{
+    if (term.type == SPY_OP_TERM_intlit)
+    {
+        compile_aarch64_move_imm(scratch, term.data.intlit, output);
+        return scratch;
+    }
+    uint8_t reg = allocation->regs[term.data.var_index];
+    if (reg != SPY_NO_REG)
+        return reg;
+    nob_sb_appendf(output, "    ldr w%u, [sp, #%u]\n", scratch, 4 * allocation->slots[term.data.var_index]);
+    return scratch;
+}
+
+// Returns the register a statement writes `var` to, `compile_aarch64_write_back` stores it when `var` is spilled
+uint8_t aarch64_destination(aarch64_allocation *allocation, uint32_t var, uint8_t scratch)
+{
+    uint8_t reg = allocation->regs[var];
+    return reg != SPY_NO_REG ? reg : scratch;
+}
+
+void compile_aarch64_write_back(aarch64_allocation *allocation, uint32_t var, uint8_t reg, Nob_String_Builder *output)
+{
+    if (allocation->regs[var] == SPY_NO_REG)
+        nob_sb_appendf(output, "    str w%u, [sp, #%u]\n", reg, 4 * allocation->slots[var]);
+}
+
+void compile_aarch64_move(aarch64_allocation *allocation, spy_op_term src, uint8_t dst, Nob_String_Builder *output)
+{
+    if (src.type == SPY_OP_TERM_intlit)
+    {
+        compile_aarch64_move_imm(dst, src.data.intlit, output);
+        return;
+    }
+    uint8_t reg = compile_aarch64_read(allocation, src, dst, output);
+    if (reg != dst)
+        nob_sb_appendf(output, "    mov w%u, w%u\n", dst, reg);
+}
+
+// Sets the flags for a comparison and returns the condition that holds when it is true
+enum aarch64_cc compile_aarch64_compare(aarch64_allocation *allocation, spy_op_stmt *op, Nob_String_Builder *output)
+{
+    spy_op_term lhs = spy_op_lhs(op);
+    spy_op_term rhs = spy_op_rhs(op);
+    enum aarch64_cc cc = aarch64_compare_cc(op->binop);
+    if (aarch64_is_imm(lhs) && !aarch64_is_imm(rhs))
+    {
+        spy_op_term tmp = lhs;
+        lhs = rhs;
+        rhs = tmp;
+        cc = aarch64_swap_cc(cc);
+    }
+    uint8_t lhs_reg = compile_aarch64_read(allocation, lhs, AARCH64_SCRATCH_LHS, output);
+    if (aarch64_is_imm(rhs) && aarch64_fits_imm12(rhs.data.intlit))
+        nob_sb_appendf(output, "    cmp w%u, #%d\n", lhs_reg, rhs.data.intlit);
+    else if (aarch64_is_imm(rhs) && rhs.data.intlit < 0 && aarch64_fits_imm12(-rhs.data.intlit))
+        nob_sb_appendf(output, "    cmn w%u, #%d\n", lhs_reg, -rhs.data.intlit);
+    else
+        nob_sb_appendf(output, "    cmp w%u, w%u\n", lhs_reg, compile_aarch64_read(allocation, rhs, AARCH64_SCRATCH_RHS, output));
+    return cc;
+}
+
+void compile_aarch64_arith(aarch64_allocation *allocation, spy_op_stmt *op, uint8_t dst, Nob_String_Builder *output)
+{
+    spy_op_term lhs = spy_op_lhs(op);
+    spy_op_term rhs = spy_op_rhs(op);
+    if (op->binop != SPY_OP_EXPR_BINOP_sub && aarch64_is_imm(lhs) && !aarch64_is_imm(rhs))
+    {
+        spy_op_term tmp = lhs;
+        lhs = rhs;
+        rhs = tmp;
+    }
+    uint8_t lhs_reg = compile_aarch64_read(allocation, lhs, AARCH64_SCRATCH_LHS, output);
+    if (op->binop != SPY_OP_EXPR_BINOP_mul && aarch64_is_imm(rhs))
+    {
+        // Adding a negative number is subtracting a positive one
+        int32_t value = rhs.data.intlit;
+        bool add = op->binop == SPY_OP_EXPR_BINOP_add;
+        if (value < 0 && value != INT32_MIN)
+        {
+            value = -value;
+            add = !add;
+        }
+        if (aarch64_fits_imm12(value))
+        {
+            nob_sb_appendf(output, "    %s w%u, w%u, #%d\n", add ? "add" : "sub", dst, lhs_reg, value);
+            return;
+        }
+    }
+    uint8_t rhs_reg = compile_aarch64_read(allocation, rhs, AARCH64_SCRATCH_RHS, output);
+    char *name = op->binop == SPY_OP_EXPR_BINOP_add ? "add" : op->binop == SPY_OP_EXPR_BINOP_sub ? "sub" : "mul";
+    nob_sb_appendf(output, "    %s w%u, w%u, w%u\n", name, dst, lhs_reg, rhs_reg);
+}
+
+void compile_aarch64_division(aarch64_allocation *allocation, spy_op_stmt *op, uint8_t dst, Nob_String_Builder *output)
+{
+    // sdiv truncates towards zero and does not trap, a quotient is one too big when the
+    // remainder is not zero and has the other sign than the divisor. The ccmp makes the lt
+    // condition false for a zero remainder.
+    uint8_t lhs_reg = compile_aarch64_read(allocation, spy_op_lhs(op), AARCH64_SCRATCH_LHS, output);
+    uint8_t rhs_reg = compile_aarch64_read(allocation, spy_op_rhs(op), AARCH64_SCRATCH_RHS, output);
+    nob_sb_appendf(output, "    sdiv w%u, w%u, w%u\n", AARCH64_SCRATCH_QUOTIENT, lhs_reg, rhs_reg);
+    nob_sb_appendf(output, "    msub w%u, w%u, w%u, w%u\n", AARCH64_SCRATCH_REMAINDER, AARCH64_SCRATCH_QUOTIENT, rhs_reg, lhs_reg);
+    // The lhs is dead from here, its scratch register is free
+    nob_sb_appendf(output, "    eor w%u, w%u, w%u\n", AARCH64_SCRATCH_LHS, AARCH64_SCRATCH_REMAINDER, rhs_reg);
+    nob_sb_appendf(output, "    cmp w%u, #0\n", AARCH64_SCRATCH_REMAINDER);
+    nob_sb_appendf(output, "    ccmp w%u, #0, #0, ne\n", AARCH64_SCRATCH_LHS);
+    if (op->binop == SPY_OP_EXPR_BINOP_floordiv)
+    {
+        nob_sb_appendf(output, "    cset w%u, lt\n", AARCH64_SCRATCH_LHS);
+        nob_sb_appendf(output, "    sub w%u, w%u, w%u\n", dst, AARCH64_SCRATCH_QUOTIENT, AARCH64_SCRATCH_LHS);
+        return;
+    }
+    nob_sb_appendf(output, "    add w%u, w%u, w%u\n", AARCH64_SCRATCH_LHS, AARCH64_SCRATCH_REMAINDER, rhs_reg);
+    nob_sb_appendf(output, "    csel w%u, w%u, w%u, lt\n", dst, AARCH64_SCRATCH_LHS, AARCH64_SCRATCH_REMAINDER);
+}
+
+void compile_aarch64_adjust_sp(char *opcode, int32_t size, Nob_String_Builder *output)
+{
+    // The immediate is 12 bits, optionally shifted left by 12
+    if (size >= 4096)
+        nob_sb_appendf(output, "    %s sp, sp, #%d, lsl #12\n", opcode, size >> 12);
+    if ((size & 4095) != 0)
+        nob_sb_appendf(output, "    %s sp, sp, #%d\n", opcode, size & 4095);
+}
+
+void compile_aarch64_prologue(aarch64_allocation *allocation, Nob_String_Builder *output)
+{
+    if (!allocation->frame_omitted)
+    {
+        nob_sb_appendf(output, "    stp x%u, x%u, [sp, #-16]!\n", AARCH64_REG_fp, AARCH64_REG_lr);
+        nob_sb_appendf(output, "    mov x%u, sp\n", AARCH64_REG_fp);
+    }
+    for (size_t i = 0; i < allocation->saved_count; i += 2)
+    {
+        if (i + 1 < allocation->saved_count)
+            nob_sb_appendf(output, "    stp x%u, x%u, [sp, #-16]!\n", allocation->saved[i], allocation->saved[i + 1]);
+        else
+            nob_sb_appendf(output, "    str x%u, [sp, #-16]!\n", allocation->saved[i]);
+    }
+    compile_aarch64_adjust_sp("sub", allocation->frame_size, output);
+}
+
+void compile_aarch64_epilogue(aarch64_allocation *allocation, Nob_String_Builder *output)
+{
+    compile_aarch64_adjust_sp("add", allocation->frame_size, output);
+    // Pairs come off in the reverse order, an odd register out was pushed last
+    size_t i = allocation->saved_count;
+    if (i % 2 == 1)
+    {
+        i--;
+        nob_sb_appendf(output, "    ldr x%u, [sp], #16\n", allocation->saved[i]);
+    }
+    for (; i > 0; i -= 2)
+        nob_sb_appendf(output, "    ldp x%u, x%u, [sp], #16\n", allocation->saved[i - 2], allocation->saved[i - 1]);
+    if (!allocation->frame_omitted)
+        nob_sb_appendf(output, "    ldp x%u, x%u, [sp], #16\n", AARCH64_REG_fp, AARCH64_REG_lr);
+}
+
+void compile_aarch64_compare_and_branch(spy_op_function *function, aarch64_allocation *allocation, spy_op_stmt *op, spy_op_stmt *jump, Nob_String_Builder *output)
+{
+    spy_op_term lhs = spy_op_lhs(op);
+    spy_op_term rhs = spy_op_rhs(op);
+    bool equality = op->binop == SPY_OP_EXPR_BINOP_eq || op->binop == SPY_OP_EXPR_BINOP_neq;
+    if (equality && (aarch64_is_zero(lhs) || aarch64_is_zero(rhs)))
+    {
+        // The conditional jump leaves the block when the condition is false
+        uint8_t reg = compile_aarch64_read(allocation, aarch64_is_zero(lhs) ? rhs : lhs, AARCH64_SCRATCH_LHS, output);
+        nob_sb_appendf(output, "    %s w%u, label_%s_%u\n", op->binop == SPY_OP_EXPR_BINOP_eq ? "cbnz" : "cbz", reg, function->name, jump->index);
+        return;
+    }
+    enum aarch64_cc cc = compile_aarch64_compare(allocation, op, output);
+    nob_sb_appendf(output, "    b.%s label_%s_%u\n", AARCH64_CC_NAMES[aarch64_invert_cc(cc)], function->name, jump->index);
+}
+
+bool compile_aarch64_statement(enum spy_output_target target, spy_ops *ops, spy_op_function *function, aarch64_allocation *allocation, spy_op_stmt *op, Nob_String_Builder *output)
+{
+    switch ((enum spy_op_stmt_type)op->type)
+    {
+    case SPY_OP_assign:
+    case SPY_OP_declare_assign:
+    {
+        uint8_t dst = aarch64_destination(allocation, op->index, AARCH64_SCRATCH_LHS);
+        compile_aarch64_move(allocation, spy_op_lhs(op), dst, output);
+        compile_aarch64_write_back(allocation, op->index, dst, output);
+        break;
+    }
+    case SPY_OP_assign_binop:
+    case SPY_OP_declare_assign_binop:
+    {
+        uint8_t dst = aarch64_destination(allocation, op->index, AARCH64_SCRATCH_LHS);
+        if (is_compare_binop(op->binop))
+        {
+            enum aarch64_cc cc = compile_aarch64_compare(allocation, op, output);
+            nob_sb_appendf(output, "    cset w%u, %s\n", dst, AARCH64_CC_NAMES[cc]);
+        }
+        else if (is_division_binop(op->binop))
+        {
+            compile_aarch64_division(allocation, op, dst, output);
+        }
+        else
+        {
+            compile_aarch64_arith(allocation, op, dst, output);
+        }
+        compile_aarch64_write_back(allocation, op->index, dst, output);
+        break;
+    }
+    case SPY_OP_func_call:
+    case SPY_OP_tail_call:
+    {
+        if (op->rhs == 1)
+        {
+            compile_aarch64_move(allocation, spy_op_args(function, op)[0], 0, output);
+        }
+        else if (op->rhs > 1)
+        {
+            fprintf(stderr, "Comiling function calls with more than 1 argument on `aarch64` is not supported yet!\n");
+            return false;
+        }
+        char *symbol = aarch64_symbol(target, ops->names.items[op->index]);
+        if (op->type == SPY_OP_tail_call)
+        {
+            // The callee returns straight to our caller
+            compile_aarch64_epilogue(allocation, output);
+            nob_sb_appendf(output, "    b %s\n", symbol);
+        }
+        else
+        {
+            nob_sb_appendf(output, "    bl %s\n", symbol);
+        }
+        break;
+    }
+    case SPY_OP_jump:
+        nob_sb_appendf(output, "    b label_%s_%u\n", function->name, op->index);
+        break;
+    case SPY_OP_conditional_jump:
+    {
+        spy_op_term condition = spy_op_lhs(op);
+        // A constant condition either always jumps or never does
+        if (aarch64_is_imm(condition))
+        {
+            if (condition.data.intlit == 0)
+                nob_sb_appendf(output, "    b label_%s_%u\n", function->name, op->index);
+            break;
+        }
+        uint8_t reg = compile_aarch64_read(allocation, condition, AARCH64_SCRATCH_LHS, output);
+        nob_sb_appendf(output, "    cbz w%u, label_%s_%u\n", reg, function->name, op->index);
+        break;
+    }
+    case SPY_OP_block_mark_start:
+    case SPY_OP_block_mark_end:
+        nob_sb_appendf(output, "label_%s_%u:\n", function->name, op->index);
+        break;
+    }
+    return true;
+}
+
+bool compile_aarch64_function(enum spy_output_target target, spy_ops *ops, spy_op_function *function, Nob_String_Builder *output)
+{
+    aarch64_allocation allocation = {0};
+    if (!allocate_aarch64_registers(function, &allocation))
+        return false;
+    nob_sb_appendf(output, "%s:\n", aarch64_symbol(target, function->name));
+    compile_aarch64_prologue(&allocation, output);
+    bool result = true;
+    for (size_t i = 0; i < function->stmts.count && result; i++)
+    {
+        spy_op_stmt *op = function->stmts.items + i;
+        if (can_fuse_compare_and_branch(function, i))
+        {
+            compile_aarch64_compare_and_branch(function, &allocation, op, op + 1, output);
+            i++;
+            continue;
+        }
+        result = compile_aarch64_statement(target, ops, function, &allocation, op, output);
+    }
+    // Spy functions return nothing, w0 is 0 so that tail calls and `main` return the same
+    nob_sb_appendf(output, "    mov w0, #0\n");
+    compile_aarch64_epilogue(&allocation, output);
+    nob_sb_appendf(output, "    ret\n");
+    aarch64_allocation_free(&allocation);
+    return result;
+}
+
+bool compile_aarch64(enum spy_output_target target, spy_ops *ops, spy_writer *writer)
+{
+    Nob_String_Builder *output = &writer->buffer;
+    if (target == SPY_OUTPUT_TARGET_aarch64_linux)
+        nob_sb_appendf(output, "    .text\n");
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        if (str_eq(ops->items[i].name, "main"))
+            nob_sb_appendf(output, "    .globl %s\n", aarch64_symbol(target, ops->items[i].name));
+    }
+    nob_sb_appendf(output, "    .p2align 2\n");
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        spy_writer_drain(writer);
+        if (!compile_aarch64_function(target, ops, ops->items + i, output))
+            return false;
+    }
+    // Without it the linker assumes the program needs an executable stack
+    if (target == SPY_OUTPUT_TARGET_aarch64_linux)
+        nob_sb_appendf(output, "    .section .note.GNU-stack,\"\",%%progbits\n");
+    return true;
+}
+
+/*
+    INTERPRETER
+*/
+
+typedef struct
+{
+    spy_op_function *function;
+    spy_op_stmt *return_ip;
+    size_t vars_base;
+} spy_run_frame;
+
+typedef struct
+{
+    spy_run_frame *items;
+    size_t count;
+    size_t capacity;
+} spy_run_frames;
+
+typedef struct
+{
+    int32_t *items;
+    size_t count;
+    size_t capacity;
+} spy_run_values;
+
+#define SPY_RUN_MAX_FRAMES (1 << 20)
+#define SPY_RUN_PUTCHAR -1
+
+bool resolve_callees(spy_ops *ops, int64_t *callees)
+{
+    for (size_t i = 0; i < ops->names.count; i++)
+    {
+        callees[i] = SPY_RUN_PUTCHAR;
+        bool found = str_eq(ops->names.items[i], "putchar");
+        for (size_t j = 0; j < ops->count && !found; j++)
+        {
+            if (str_eq(ops->names.items[i], ops->items[j].name))
+            {
+                callees[i] = j;
+                found = true;
+            }
+        }
+        if (!found)
+        {
+            fprintf(stderr, "ERROR: Undefined function `%s`.\n", ops->names.items[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool run_program(spy_ops *ops, int *exit_code)
+{
+    int64_t *callees = malloc(ops->names.count * sizeof(int64_t) + 1);
+    size_t *vars_counts = malloc(ops->count * sizeof(size_t) + 1);
+    spy_run_frames frames = {0};
+    spy_run_values values = {0};
+    bool result = false;
+    spy_op_function *function = NULL;
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        vars_counts[i] = function_vars_count(ops->items + i);
+        if (str_eq(ops->items[i].name, "main"))
+            function = ops->items + i;
+    }
+    if (function == NULL)
+    {
+        fprintf(stderr, "ERROR: Program does not contain a main function (no entry point).\n");
+        goto defer;
+    }
+    if (!resolve_callees(ops, callees))
+        goto defer;
+
+    // Get compiler error to add new types here
+    enum spy_op_stmt_type temp_op_type = SPY_OP_assign;
+    switch (temp_op_type)
+    {
+    case SPY_OP_assign:
+    case SPY_OP_declare_assign:
+    case SPY_OP_assign_binop:
+    case SPY_OP_declare_assign_binop:
+    case SPY_OP_func_call:
+    case SPY_OP_tail_call:
+    case SPY_OP_jump:
+    case SPY_OP_conditional_jump:
+    case SPY_OP_block_mark_start:
+    case SPY_OP_block_mark_end:
+        break;
+    }
+    static void *dispatch[] = {
+        [SPY_OP_assign] = &&op_assign,
+        [SPY_OP_declare_assign] = &&op_assign,
+        [SPY_OP_assign_binop] = &&op_assign_binop,
+        [SPY_OP_declare_assign_binop] = &&op_assign_binop,
+        [SPY_OP_func_call] = &&op_func_call,
+        [SPY_OP_tail_call] = &&op_tail_call,
+        [SPY_OP_jump] = &&op_jump,
+        [SPY_OP_conditional_jump] = &&op_conditional_jump,
+        [SPY_OP_block_mark_start] = &&op_next,
+        [SPY_OP_block_mark_end] = &&op_next,
+    };
+    static void *binop_dispatch[] = {
+        [SPY_OP_EXPR_BINOP_add] = &&binop_add,
+        [SPY_OP_EXPR_BINOP_sub] = &&binop_sub,
+        [SPY_OP_EXPR_BINOP_mul] = &&binop_mul,
+        [SPY_OP_EXPR_BINOP_lt] = &&binop_lt,
+        [SPY_OP_EXPR_BINOP_lte] = &&binop_lte,
+        [SPY_OP_EXPR_BINOP_gt] = &&binop_gt,
+        [SPY_OP_EXPR_BINOP_gte] = &&binop_gte,
+        [SPY_OP_EXPR_BINOP_eq] = &&binop_eq,
+        [SPY_OP_EXPR_BINOP_neq] = &&binop_neq,
+        [SPY_OP_EXPR_BINOP_floordiv] = &&binop_floordiv,
+        [SPY_OP_EXPR_BINOP_mod] = &&binop_mod,
+    };
+
+    size_t vars_base = 0;
+    int32_t *vars = NULL;
+    spy_op_stmt *ip = NULL;
+    spy_op_stmt *end = NULL;
+    int32_t lhs = 0;
+    int32_t rhs = 0;
+
+#define RUN_TERM(type, value) ((type) == SPY_OP_TERM_var ? vars[(value)] : (value))
+#define RUN_DISPATCH()               \
+    do                               \
+    {                                \
+        if (ip == end)               \
+            goto op_return;          \
+        goto *dispatch[ip->type];    \
+    } while (0)
+#define RUN_ENTER(callee)                                                         \
+    do                                                                            \
+    {                                                                             \
+        function = (callee);                                                      \
+        size_t vars_count = vars_counts[function - ops->items];                   \
+        values.count = vars_base;                                                 \
+        for (size_t i = 0; i < vars_count; i++)                                   \
+            nob_da_append(&values, 0);                                            \
+        vars = values.items + vars_base;                                          \
+        ip = function->stmts.items;                                               \
+        end = function->stmts.items + function->stmts.count;                      \
+    } while (0)
+
+    RUN_ENTER(function);
+    RUN_DISPATCH();
+
+op_next:
+    ip++;
+    RUN_DISPATCH();
+op_assign:
+    vars[ip->index] = RUN_TERM(ip->lhs_type, ip->lhs);
+    ip++;
+    RUN_DISPATCH();
+op_assign_binop:
+    lhs = RUN_TERM(ip->lhs_type, ip->lhs);
+    rhs = RUN_TERM(ip->rhs_type, ip->rhs);
+    goto *binop_dispatch[ip->binop];
+binop_add:
+    // Wrap around like the 32 bit registers on the native targets do
+    vars[ip->index] = (int32_t)((uint32_t)lhs + (uint32_t)rhs);
+    ip++;
+    RUN_DISPATCH();
+binop_sub:
+    vars[ip->index] = (int32_t)((uint32_t)lhs - (uint32_t)rhs);
+    ip++;
+    RUN_DISPATCH();
+binop_mul:
+    vars[ip->index] = (int32_t)((uint32_t)lhs * (uint32_t)rhs);
+    ip++;
+    RUN_DISPATCH();
+binop_lt:
+    vars[ip->index] = lhs < rhs;
+    ip++;
+    RUN_DISPATCH();
+binop_lte:
+    vars[ip->index] = lhs <= rhs;
+    ip++;
+    RUN_DISPATCH();
+binop_gt:
+    vars[ip->index] = lhs > rhs;
+    ip++;
+    RUN_DISPATCH();
+binop_gte:
+    vars[ip->index] = lhs >= rhs;
+    ip++;
+    RUN_DISPATCH();
+binop_eq:
+    vars[ip->index] = lhs == rhs;
+    ip++;
+    RUN_DISPATCH();
+binop_neq:
+    vars[ip->index] = lhs != rhs;
+    ip++;
+    RUN_DISPATCH();
+binop_floordiv:
+    if (rhs == 0)
+        goto division_by_zero;
+    vars[ip->index] = spy_floordiv(lhs, rhs);
+    ip++;
+    RUN_DISPATCH();
+binop_mod:
+    if (rhs == 0)
+        goto division_by_zero;
+    vars[ip->index] = spy_mod(lhs, rhs);
+    ip++;
+    RUN_DISPATCH();
+division_by_zero:
+    fprintf(stderr, "ERROR: Division by zero.\n");
+    goto defer;
+op_jump:
+    ip = function->stmts.items + ip->index;
+    goto *dispatch[ip->type];
+op_conditional_jump:
+    if (RUN_TERM(ip->lhs_type, ip->lhs) == 0)
+    {
+        ip = function->stmts.items + ip->index;
+        goto *dispatch[ip->type];
+    }
+    ip++;
+    RUN_DISPATCH();
+op_func_call:
+{
+    int64_t callee = callees[ip->index];
+    if (callee == SPY_RUN_PUTCHAR)
+    {
+        // Only the single argument form exists, like in the native backends
+        spy_op_term *args = spy_op_args(function, ip);
+        putchar(ip->rhs > 0 ? RUN_TERM(args[0].type, args[0].data.intlit) : 0);
+        ip++;
+        RUN_DISPATCH();
+    }
+    if (frames.count >= SPY_RUN_MAX_FRAMES)
+    {
+        fprintf(stderr, "ERROR: Stack overflow, more than %d nested calls.\n", SPY_RUN_MAX_FRAMES);
+        goto defer;
+    }
+    spy_run_frame frame = {
+        .function = function,
+        .return_ip = ip + 1,
+        .vars_base = vars_base,
+    };
+    nob_da_append(&frames, frame);
+    vars_base = values.count;
+    RUN_ENTER(ops->items + callee);
+    RUN_DISPATCH();
+}
+op_tail_call:
+{
+    int64_t callee = callees[ip->index];
+    if (callee == SPY_RUN_PUTCHAR)
+        goto op_func_call;
+    // The callee takes over our frame
+    RUN_ENTER(ops->items + callee);
+    RUN_DISPATCH();
+}
+op_return:
+    if (frames.count == 0)
+    {
+        result = true;
+        *exit_code = 0;
+        goto defer;
+    }
+    {
+        spy_run_frame frame = frames.items[--frames.count];
+        values.count = vars_base;
+        vars_base = frame.vars_base;
+        function = frame.function;
+        vars = values.items + vars_base;
+        ip = frame.return_ip;
+        end = function->stmts.items + function->stmts.count;
+    }
+    RUN_DISPATCH();
+
+#undef RUN_TERM
+#undef RUN_DISPATCH
+#undef RUN_ENTER
+
+defer:
+    fflush(stdout);
+    free(callees);
+    free(vars_counts);
+    nob_da_free(frames);
+    nob_da_free(values);
+    return result;
+}
+
+/*
+    BYTECODE (.spyc)
+*/
+
+// Register bytecode: every instruction is a 1 byte opcode followed by its operands, all little endian:
+//     s = uint16_t slot, i = int32_t immediate, t = uint32_t code offset, f = uint16_t function
+// Binops come in a slot/slot, slot/immediate and immediate/slot form. A comparison feeding a
+// conditional jump is fused into a single branch that jumps when the comparison is false.
+//
+// A .spyc file is
+//     "SPYC", uint16_t version, uint16_t functions_count, uint16_t main, uint16_t 0, uint32_t code_size
+//     per function: uint32_t code offset, uint32_t slots_count
+//     code
+
+enum spy_bc_op
+{
+    SPY_BC_mov_ss,
+    SPY_BC_mov_si,
+    SPY_BC_add_sss,
+    SPY_BC_add_ssi,
+    SPY_BC_add_sis,
+    SPY_BC_sub_sss,
+    SPY_BC_sub_ssi,
+    SPY_BC_sub_sis,
+    SPY_BC_mul_sss,
+    SPY_BC_mul_ssi,
+    SPY_BC_mul_sis,
+    SPY_BC_lt_sss,
+    SPY_BC_lt_ssi,
+    SPY_BC_lt_sis,
+    SPY_BC_lte_sss,
+    SPY_BC_lte_ssi,
+    SPY_BC_lte_sis,
+    SPY_BC_gt_sss,
+    SPY_BC_gt_ssi,
+    SPY_BC_gt_sis,
+    SPY_BC_gte_sss,
+    SPY_BC_gte_ssi,
+    SPY_BC_gte_sis,
+    SPY_BC_eq_sss,
+    SPY_BC_eq_ssi,
+    SPY_BC_eq_sis,
+    SPY_BC_neq_sss,
+    SPY_BC_neq_ssi,
+    SPY_BC_neq_sis,
+    SPY_BC_floordiv_sss,
+    SPY_BC_floordiv_ssi,
+    SPY_BC_floordiv_sis,
+    SPY_BC_mod_sss,
+    SPY_BC_mod_ssi,
+    SPY_BC_mod_sis,
+    SPY_BC_jmp_t,
+    SPY_BC_jz_st,
+    SPY_BC_jlt_sst,
+    SPY_BC_jlt_sit,
+    SPY_BC_jlte_sst,
+    SPY_BC_jlte_sit,
+    SPY_BC_jgt_sst,
+    SPY_BC_jgt_sit,
+    SPY_BC_jgte_sst,
+    SPY_BC_jgte_sit,
+    SPY_BC_jeq_sst,
+    SPY_BC_jeq_sit,
+    SPY_BC_jneq_sst,
+    SPY_BC_jneq_sit,
+    SPY_BC_call_f,
+    SPY_BC_tail_call_f,
+    SPY_BC_putchar_s,
+    SPY_BC_putchar_i,
+    SPY_BC_ret,
+    SPY_BC_COUNT,
+};
+
+// Operands of every opcode, also used to validate loaded code
+char *SPY_BC_OPERANDS[] = {
+    [SPY_BC_mov_ss] = "ss",
+    [SPY_BC_mov_si] = "si",
+    [SPY_BC_add_sss] = "sss",
+    [SPY_BC_add_ssi] = "ssi",
+    [SPY_BC_add_sis] = "sis",
+    [SPY_BC_sub_sss] = "sss",
+    [SPY_BC_sub_ssi] = "ssi",
+    [SPY_BC_sub_sis] = "sis",
+    [SPY_BC_mul_sss] = "sss",
+    [SPY_BC_mul_ssi] = "ssi",
+    [SPY_BC_mul_sis] = "sis",
+    [SPY_BC_lt_sss] = "sss",
+    [SPY_BC_lt_ssi] = "ssi",
+    [SPY_BC_lt_sis] = "sis",
+    [SPY_BC_lte_sss] = "sss",
+    [SPY_BC_lte_ssi] = "ssi",
+    [SPY_BC_lte_sis] = "sis",
+    [SPY_BC_gt_sss] = "sss",
+    [SPY_BC_gt_ssi] = "ssi",
+    [SPY_BC_gt_sis] = "sis",
+    [SPY_BC_gte_sss] = "sss",
+    [SPY_BC_gte_ssi] = "ssi",
+    [SPY_BC_gte_sis] = "sis",
+    [SPY_BC_eq_sss] = "sss",
+    [SPY_BC_eq_ssi] = "ssi",
+    [SPY_BC_eq_sis] = "sis",
+    [SPY_BC_neq_sss] = "sss",
+    [SPY_BC_neq_ssi] = "ssi",
+    [SPY_BC_neq_sis] = "sis",
+    [SPY_BC_floordiv_sss] = "sss",
+    [SPY_BC_floordiv_ssi] = "ssi",
+    [SPY_BC_floordiv_sis] = "sis",
+    [SPY_BC_mod_sss] = "sss",
+    [SPY_BC_mod_ssi] = "ssi",
+    [SPY_BC_mod_sis] = "sis",
+    [SPY_BC_jmp_t] = "t",
+    [SPY_BC_jz_st] = "st",
+    [SPY_BC_jlt_sst] = "sst",
+    [SPY_BC_jlt_sit] = "sit",
+    [SPY_BC_jlte_sst] = "sst",
+    [SPY_BC_jlte_sit] = "sit",
+    [SPY_BC_jgt_sst] = "sst",
+    [SPY_BC_jgt_sit] = "sit",
+    [SPY_BC_jgte_sst] = "sst",
+    [SPY_BC_jgte_sit] = "sit",
+    [SPY_BC_jeq_sst] = "sst",
+    [SPY_BC_jeq_sit] = "sit",
+    [SPY_BC_jneq_sst] = "sst",
+    [SPY_BC_jneq_sit] = "sit",
+    [SPY_BC_call_f] = "f",
+    [SPY_BC_tail_call_f] = "f",
+    [SPY_BC_putchar_s] = "s",
+    [SPY_BC_putchar_i] = "i",
+    [SPY_BC_ret] = "",
+};
+
+static_assert(sizeof SPY_BC_OPERANDS / sizeof(char *) == SPY_BC_COUNT, "Every bytecode op needs its operands");
+
+#define SPY_BC_MAGIC "SPYC"
+#define SPY_BC_VERSION 2
+#define SPY_BC_HEADER_SIZE 16
+#define SPY_BC_FUNCTION_SIZE 8
+
+typedef struct
+{
+    uint32_t code_offset;
+    uint32_t slots_count;
+} spy_bc_function;
+
+typedef struct
+{
+    spy_bc_function *items;
+    size_t count;
+    size_t capacity;
+} spy_bc_functions;
+
+typedef struct
+{
+    spy_bc_functions functions;
+    Nob_String_Builder code;
+    uint16_t main;
+} spy_bc_module;
+
+uint16_t bc_read_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+uint32_t bc_read_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void bc_emit_u8(Nob_String_Builder *code, uint8_t value)
+{
+    nob_da_append(code, (char)value);
+}
+
+void bc_emit_u16(Nob_String_Builder *code, uint16_t value)
+{
+    bc_emit_u8(code, value & 0xff);
+    bc_emit_u8(code, value >> 8);
+}
+
+void bc_emit_u32(Nob_String_Builder *code, uint32_t value)
+{
+    bc_emit_u16(code, value & 0xffff);
+    bc_emit_u16(code, value >> 16);
+}
+
+void bc_patch_u32(Nob_String_Builder *code, size_t at, uint32_t value)
+{
+    for (size_t i = 0; i < 4; i++)
+        code->items[at + i] = (char)((value >> (i * 8)) & 0xff);
+}
+
+size_t bc_operands_size(enum spy_bc_op op)
+{
+    size_t size = 0;
+    for (char *operand = SPY_BC_OPERANDS[op]; *operand != '\0'; operand++)
+        size += *operand == 's' || *operand == 'f' ? 2 : 4;
+    return size;
+}
+
+size_t bc_binop_offset(enum spy_op_expr_binop_type type)
+{
+    // Offset of the `sss` form from SPY_BC_add_sss, the `ssi` and `sis` forms follow it
+    switch (type)
+    {
+    case SPY_OP_EXPR_BINOP_add:
+        return SPY_BC_add_sss - SPY_BC_add_sss;
+    case SPY_OP_EXPR_BINOP_sub:
+        return SPY_BC_sub_sss - SPY_BC_add_sss;
+    case SPY_OP_EXPR_BINOP_mul:
+        return SPY_BC_mul_sss - SPY_BC_add_sss;
+    case SPY_OP_EXPR_BINOP_lt:
+        return SPY_BC_lt_sss - SPY_BC_add_sss;
+    case SPY_OP_EXPR_BINOP_lte:
+        return SPY_BC_lte_sss - SPY_BC_add_sss;
+    case SPY_OP_EXPR_BINOP_gt:
+        return SPY_BC_gt_sss - SPY_BC_add_sss;
+    case SPY_OP_EXPR_BINOP_gte:
+        return SPY_BC_gte_sss - SPY_BC_add_sss;
+    case SPY_OP_EXPR_BINOP_eq:
+        return SPY_BC_eq_sss - SPY_BC_add_sss;
+    case SPY_OP_EXPR_BINOP_neq:
+        return SPY_BC_neq_sss - SPY_BC_add_sss;
+    case SPY_OP_EXPR_BINOP_floordiv:
+        return SPY_BC_floordiv_sss - SPY_BC_add_sss;
+    case SPY_OP_EXPR_BINOP_mod:
+        return SPY_BC_mod_sss - SPY_BC_add_sss;
+    }
+    return 0;
+}
+
+bool bc_fused_branch(enum spy_op_expr_binop_type type, bool swapped, enum spy_bc_op *op)
+{
+    // The branch leaves the block when the comparison is false, so the sense is inverted.
+    // When the operands are swapped the comparison is mirrored as well.
+    switch (type)
+    {
+    case SPY_OP_EXPR_BINOP_add:
+    case SPY_OP_EXPR_BINOP_sub:
+    case SPY_OP_EXPR_BINOP_mul:
+    case SPY_OP_EXPR_BINOP_floordiv:
+    case SPY_OP_EXPR_BINOP_mod:
+        return false;
+    case SPY_OP_EXPR_BINOP_lt:
+        *op = swapped ? SPY_BC_jlte_sst : SPY_BC_jgte_sst;
+        return true;
+    case SPY_OP_EXPR_BINOP_lte:
+        *op = swapped ? SPY_BC_jlt_sst : SPY_BC_jgt_sst;
+        return true;
+    case SPY_OP_EXPR_BINOP_gt:
+        *op = swapped ? SPY_BC_jgte_sst : SPY_BC_jlte_sst;
+        return true;
+    case SPY_OP_EXPR_BINOP_gte:
+        *op = swapped ? SPY_BC_jgt_sst : SPY_BC_jlt_sst;
+        return true;
+    case SPY_OP_EXPR_BINOP_eq:
+        *op = SPY_BC_jneq_sst;
+        return true;
+    case SPY_OP_EXPR_BINOP_neq:
+        *op = SPY_BC_jeq_sst;
+        return true;
+    }
+    return false;
+}
+
+typedef struct
+{
+    size_t at;
+    uint32_t stmt_index;
+} spy_bc_fixup;
+
+typedef struct
+{
+    spy_bc_fixup *items;
+    size_t count;
+    size_t capacity;
+} spy_bc_fixups;
+
+bool bc_check_slot(spy_op_term term)
+{
+    if (term.type == SPY_OP_TERM_var && term.data.var_index > UINT16_MAX)
+    {
+        fprintf(stderr, "ERROR: Functions with more than %d variables are not supported by the bytecode.\n", UINT16_MAX);
+        return false;
+    }
+    return true;
+}
+
+void bc_emit_jump_target(Nob_String_Builder *code, spy_bc_fixups *fixups, uint32_t stmt_index)
+{
+    spy_bc_fixup fixup = {.at = code->count, .stmt_index = stmt_index};
+    nob_da_append(fixups, fixup);
+    bc_emit_u32(code, 0);
+}
+
+bool compile_bytecode_function(spy_op_function *function, int64_t *callees, spy_bc_module *module)
+{
+    Nob_String_Builder *code = &module->code;
+    spy_bc_function bc_function = {
+        .code_offset = code->count,
+        .slots_count = function_vars_count(function),
+    };
+    if (bc_function.slots_count > UINT16_MAX)
+    {
+        fprintf(stderr, "ERROR: Function `%s` has more than %d variables, not supported by the bytecode.\n", function->name, UINT16_MAX);
+        return false;
+    }
+    nob_da_append(&module->functions, bc_function);
+
+    uint32_t *stmt_offsets = malloc((function->stmts.count + 1) * sizeof(uint32_t));
+    spy_bc_fixups fixups = {0};
+    bool result = false;
+    for (size_t i = 0; i < function->stmts.count; i++)
+    {
+        spy_op_stmt *op = function->stmts.items + i;
+        spy_op_term lhs = spy_op_lhs(op);
+        spy_op_term rhs = spy_op_rhs(op);
+        stmt_offsets[i] = code->count;
+        switch ((enum spy_op_stmt_type)op->type)
+        {
+        case SPY_OP_assign:
+        case SPY_OP_declare_assign:
+            if (lhs.type == SPY_OP_TERM_var)
             {
-                spy_op_assign *assign = &op_stmt.data.assign;
-                spy_op_term *term = &assign->term;
-                nob_sb_appendf(output, "    var_%ld = ", assign->var_index);
-                if (!compile_dump_python311_term(term, output))
-                    return false;
-                nob_sb_appendf(output, "\n");
+                bc_emit_u8(code, SPY_BC_mov_ss);
+                bc_emit_u16(code, op->index);
+                bc_emit_u16(code, lhs.data.var_index);
+            }
+            else
+            {
+                bc_emit_u8(code, SPY_BC_mov_si);
+                bc_emit_u16(code, op->index);
+                bc_emit_u32(code, lhs.data.intlit);
+            }
+            break;
+        case SPY_OP_assign_binop:
+        case SPY_OP_declare_assign_binop:
+        {
+            enum spy_bc_op fused = SPY_BC_ret;
+            if (can_fuse_compare_and_branch(function, i) && (lhs.type == SPY_OP_TERM_var || rhs.type == SPY_OP_TERM_var))
+            {
+                spy_op_stmt *jump = op + 1;
+                bool swapped = lhs.type != SPY_OP_TERM_var;
+                bc_fused_branch(op->binop, swapped, &fused);
+                spy_op_term a = swapped ? rhs : lhs;
+                spy_op_term b = swapped ? lhs : rhs;
+                if (b.type == SPY_OP_TERM_intlit)
+                    fused++;
+                bc_emit_u8(code, fused);
+                bc_emit_u16(code, a.data.var_index);
+                if (b.type == SPY_OP_TERM_var)
+                    bc_emit_u16(code, b.data.var_index);
+                else
+                    bc_emit_u32(code, b.data.intlit);
+                bc_emit_jump_target(code, &fixups, jump->index);
+                i++;
+                stmt_offsets[i] = code->count;
                 break;
             }
-            case SPY_OP_declare_assign:
+            if (lhs.type == SPY_OP_TERM_intlit && rhs.type == SPY_OP_TERM_intlit && is_division_binop(op->binop) && rhs.data.intlit == 0)
+            {
+                // Left for the VM to report, with the dividend in the result slot
+                bc_emit_u8(code, SPY_BC_mov_si);
+                bc_emit_u16(code, op->index);
+                bc_emit_u32(code, lhs.data.intlit);
+                lhs = (spy_op_term){.type = SPY_OP_TERM_var, .data.var_index = op->index};
+            }
+            if (lhs.type == SPY_OP_TERM_intlit && rhs.type == SPY_OP_TERM_intlit)
+            {
+                bc_emit_u8(code, SPY_BC_mov_si);
+                bc_emit_u16(code, op->index);
+                bc_emit_u32(code, fold_binop(op->binop, lhs.data.intlit, rhs.data.intlit));
+                break;
+            }
+            enum spy_bc_op bc_op = SPY_BC_add_sss + bc_binop_offset(op->binop);
+            if (rhs.type == SPY_OP_TERM_intlit)
+                bc_op += 1;
+            else if (lhs.type == SPY_OP_TERM_intlit)
+                bc_op += 2;
+            bc_emit_u8(code, bc_op);
+            bc_emit_u16(code, op->index);
+            if (lhs.type == SPY_OP_TERM_var)
+                bc_emit_u16(code, lhs.data.var_index);
+            else
+                bc_emit_u32(code, lhs.data.intlit);
+            if (rhs.type == SPY_OP_TERM_var)
+                bc_emit_u16(code, rhs.data.var_index);
+            else
+                bc_emit_u32(code, rhs.data.intlit);
+            break;
+        }
+        case SPY_OP_func_call:
+        case SPY_OP_tail_call:
+        {
+            int64_t callee = callees[op->index];
+            spy_op_term *args = spy_op_args(function, op);
+            if (callee == SPY_RUN_PUTCHAR)
+            {
+                if (op->rhs != 1)
+                {
+                    fprintf(stderr, "ERROR: `putchar` takes exactly one argument.\n");
+                    goto defer;
+                }
+                if (args[0].type == SPY_OP_TERM_var)
+                {
+                    bc_emit_u8(code, SPY_BC_putchar_s);
+                    bc_emit_u16(code, args[0].data.var_index);
+                }
+                else
+                {
+                    bc_emit_u8(code, SPY_BC_putchar_i);
+                    bc_emit_u32(code, args[0].data.intlit);
+                }
+                break;
+            }
+            if (op->rhs != 0)
+            {
+                fprintf(stderr, "Compiling function calls with arguments to bytecode is not supported yet!\n");
+                goto defer;
+            }
+            bc_emit_u8(code, op->type == SPY_OP_tail_call ? SPY_BC_tail_call_f : SPY_BC_call_f);
+            bc_emit_u16(code, callee);
+            break;
+        }
+        case SPY_OP_jump:
+            bc_emit_u8(code, SPY_BC_jmp_t);
+            bc_emit_jump_target(code, &fixups, op->index);
+            break;
+        case SPY_OP_conditional_jump:
+            if (lhs.type == SPY_OP_TERM_intlit)
+            {
+                // Known at compile time, either always or never jumps
+                if (lhs.data.intlit == 0)
+                {
+                    bc_emit_u8(code, SPY_BC_jmp_t);
+                    bc_emit_jump_target(code, &fixups, op->index);
+                }
+                break;
+            }
+            bc_emit_u8(code, SPY_BC_jz_st);
+            bc_emit_u16(code, lhs.data.var_index);
+            bc_emit_jump_target(code, &fixups, op->index);
+            break;
+        case SPY_OP_block_mark_start:
+        case SPY_OP_block_mark_end:
+            break;
+        }
+        if (!bc_check_slot(lhs) || !bc_check_slot(rhs))
+            goto defer;
+    }
+    bc_emit_u8(code, SPY_BC_ret);
+    for (size_t i = 0; i < fixups.count; i++)
+    {
+        bc_patch_u32(code, fixups.items[i].at, stmt_offsets[fixups.items[i].stmt_index]);
+    }
+    result = true;
+defer:
+    free(stmt_offsets);
+    nob_da_free(fixups);
+    return result;
+}
+
+bool compile_bytecode(spy_ops *ops, spy_bc_module *module)
+{
+    if (ops->count > UINT16_MAX)
+    {
+        fprintf(stderr, "ERROR: Programs with more than %d functions are not supported by the bytecode.\n", UINT16_MAX);
+        return false;
+    }
+    int64_t *callees = malloc(ops->names.count * sizeof(int64_t) + 1);
+    bool result = resolve_callees(ops, callees);
+    for (size_t i = 0; i < ops->count && result; i++)
+    {
+        if (str_eq(ops->items[i].name, "main"))
+            module->main = i;
+        result = compile_bytecode_function(ops->items + i, callees, module);
+    }
+    free(callees);
+    return result;
+}
+
+bool compile_spyc(spy_ops *ops, Nob_String_Builder *output)
+{
+    spy_bc_module module = {0};
+    if (!compile_bytecode(ops, &module))
+    {
+        nob_da_free(module.functions);
+        nob_sb_free(module.code);
+        return false;
+    }
+    nob_sb_append_buf(output, SPY_BC_MAGIC, 4);
+    bc_emit_u16(output, SPY_BC_VERSION);
+    bc_emit_u16(output, module.functions.count);
+    bc_emit_u16(output, module.main);
+    bc_emit_u16(output, 0);
+    bc_emit_u32(output, module.code.count);
+    for (size_t i = 0; i < module.functions.count; i++)
+    {
+        bc_emit_u32(output, module.functions.items[i].code_offset);
+        bc_emit_u32(output, module.functions.items[i].slots_count);
+    }
+    nob_sb_append_buf(output, module.code.items, module.code.count);
+    nob_da_free(module.functions);
+    nob_sb_free(module.code);
+    return true;
+}
+
+bool validate_bytecode_function(spy_bc_module *module, size_t index, uint8_t *starts)
+{
+    uint8_t *code = (uint8_t *)module->code.items;
+    spy_bc_function *function = module->functions.items + index;
+    size_t end = index + 1 < module->functions.count ? module->functions.items[index + 1].code_offset : module->code.count;
+    if (function->code_offset >= end || function->slots_count > UINT16_MAX + 1)
+        return false;
+    // Every function has to end in `ret`, so falling off the end is impossible
+    if (code[end - 1] != SPY_BC_ret)
+        return false;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (size_t pc = function->code_offset; pc < end;)
+        {
+            if (code[pc] >= SPY_BC_COUNT)
+                return false;
+            if (pass == 0)
+                starts[pc] = 1;
+            size_t at = pc + 1;
+            for (char *operand = SPY_BC_OPERANDS[code[pc]]; *operand != '\0'; operand++)
+            {
+                size_t size = *operand == 's' || *operand == 'f' ? 2 : 4;
+                if (at + size > end)
+                    return false;
+                if (*operand == 's' && bc_read_u16(code + at) >= function->slots_count)
+                    return false;
+                if (*operand == 'f' && bc_read_u16(code + at) >= module->functions.count)
+                    return false;
+                if (pass == 1 && *operand == 't')
+                {
+                    uint32_t target = bc_read_u32(code + at);
+                    if (target < function->code_offset || target >= end || !starts[target])
+                        return false;
+                }
+                at += size;
+            }
+            pc = at;
+        }
+    }
+    return true;
+}
+
+bool load_spyc(char *file_path, spy_bc_module *module)
+{
+    Nob_String_Builder file = {0};
+    bool result = false;
+    uint8_t *starts = NULL;
+    if (!nob_read_entire_file(file_path, &file))
+    {
+        fprintf(stderr, "Unable to read file `%s`.\n", file_path);
+        return false;
+    }
+    uint8_t *data = (uint8_t *)file.items;
+    if (file.count < SPY_BC_HEADER_SIZE || memcmp(data, SPY_BC_MAGIC, 4) != 0)
+    {
+        fprintf(stderr, "%s: ERROR: Not a .spyc file.\n", file_path);
+        goto defer;
+    }
+    if (bc_read_u16(data + 4) != SPY_BC_VERSION)
+    {
+        fprintf(stderr, "%s: ERROR: Unsupported .spyc version %u, expected %u.\n", file_path, bc_read_u16(data + 4), SPY_BC_VERSION);
+        goto defer;
+    }
+    size_t functions_count = bc_read_u16(data + 6);
+    module->main = bc_read_u16(data + 8);
+    size_t code_size = bc_read_u32(data + 12);
+    size_t code_start = SPY_BC_HEADER_SIZE + functions_count * SPY_BC_FUNCTION_SIZE;
+    if (functions_count == 0 || module->main >= functions_count || code_start > file.count || file.count - code_start != code_size)
+    {
+        fprintf(stderr, "%s: ERROR: Corrupted .spyc file.\n", file_path);
+        goto defer;
+    }
+    for (size_t i = 0; i < functions_count; i++)
+    {
+        spy_bc_function function = {
+            .code_offset = bc_read_u32(data + SPY_BC_HEADER_SIZE + i * SPY_BC_FUNCTION_SIZE),
+            .slots_count = bc_read_u32(data + SPY_BC_HEADER_SIZE + i * SPY_BC_FUNCTION_SIZE + 4),
+        };
+        nob_da_append(&module->functions, function);
+    }
+    nob_sb_append_buf(&module->code, data + code_start, code_size);
+    starts = calloc(code_size + 1, 1);
+    for (size_t i = 0; i < functions_count; i++)
+    {
+        if (!validate_bytecode_function(module, i, starts))
+        {
+            fprintf(stderr, "%s: ERROR: Corrupted .spyc file, invalid code in function %zu.\n", file_path, i);
+            goto defer;
+        }
+    }
+    result = true;
+defer:
+    free(starts);
+    nob_sb_free(file);
+    return result;
+}
+
+typedef struct
+{
+    uint8_t *return_pc;
+    size_t slots_base;
+} spy_bc_frame;
+
+typedef struct
+{
+    spy_bc_frame *items;
+    size_t count;
+    size_t capacity;
+} spy_bc_frames;
+
+bool run_bytecode(spy_bc_module *module, int *exit_code)
+{
+    uint8_t *code = (uint8_t *)module->code.items;
+    spy_bc_frames frames = {0};
+    spy_run_values values = {0};
+    bool result = false;
+
+    static void *dispatch[] = {
+        [SPY_BC_mov_ss] = &&bc_mov_ss,
+        [SPY_BC_mov_si] = &&bc_mov_si,
+        [SPY_BC_add_sss] = &&bc_add_sss,
+        [SPY_BC_add_ssi] = &&bc_add_ssi,
+        [SPY_BC_add_sis] = &&bc_add_sis,
+        [SPY_BC_sub_sss] = &&bc_sub_sss,
+        [SPY_BC_sub_ssi] = &&bc_sub_ssi,
+        [SPY_BC_sub_sis] = &&bc_sub_sis,
+        [SPY_BC_mul_sss] = &&bc_mul_sss,
+        [SPY_BC_mul_ssi] = &&bc_mul_ssi,
+        [SPY_BC_mul_sis] = &&bc_mul_sis,
+        [SPY_BC_lt_sss] = &&bc_lt_sss,
+        [SPY_BC_lt_ssi] = &&bc_lt_ssi,
+        [SPY_BC_lt_sis] = &&bc_lt_sis,
+        [SPY_BC_lte_sss] = &&bc_lte_sss,
+        [SPY_BC_lte_ssi] = &&bc_lte_ssi,
+        [SPY_BC_lte_sis] = &&bc_lte_sis,
+        [SPY_BC_gt_sss] = &&bc_gt_sss,
+        [SPY_BC_gt_ssi] = &&bc_gt_ssi,
+        [SPY_BC_gt_sis] = &&bc_gt_sis,
+        [SPY_BC_gte_sss] = &&bc_gte_sss,
+        [SPY_BC_gte_ssi] = &&bc_gte_ssi,
+        [SPY_BC_gte_sis] = &&bc_gte_sis,
+        [SPY_BC_eq_sss] = &&bc_eq_sss,
+        [SPY_BC_eq_ssi] = &&bc_eq_ssi,
+        [SPY_BC_eq_sis] = &&bc_eq_sis,
+        [SPY_BC_neq_sss] = &&bc_neq_sss,
+        [SPY_BC_neq_ssi] = &&bc_neq_ssi,
+        [SPY_BC_neq_sis] = &&bc_neq_sis,
+        [SPY_BC_floordiv_sss] = &&bc_floordiv_sss,
+        [SPY_BC_floordiv_ssi] = &&bc_floordiv_ssi,
+        [SPY_BC_floordiv_sis] = &&bc_floordiv_sis,
+        [SPY_BC_mod_sss] = &&bc_mod_sss,
+        [SPY_BC_mod_ssi] = &&bc_mod_ssi,
+        [SPY_BC_mod_sis] = &&bc_mod_sis,
+        [SPY_BC_jmp_t] = &&bc_jmp_t,
+        [SPY_BC_jz_st] = &&bc_jz_st,
+        [SPY_BC_jlt_sst] = &&bc_jlt_sst,
+        [SPY_BC_jlt_sit] = &&bc_jlt_sit,
+        [SPY_BC_jlte_sst] = &&bc_jlte_sst,
+        [SPY_BC_jlte_sit] = &&bc_jlte_sit,
+        [SPY_BC_jgt_sst] = &&bc_jgt_sst,
+        [SPY_BC_jgt_sit] = &&bc_jgt_sit,
+        [SPY_BC_jgte_sst] = &&bc_jgte_sst,
+        [SPY_BC_jgte_sit] = &&bc_jgte_sit,
+        [SPY_BC_jeq_sst] = &&bc_jeq_sst,
+        [SPY_BC_jeq_sit] = &&bc_jeq_sit,
+        [SPY_BC_jneq_sst] = &&bc_jneq_sst,
+        [SPY_BC_jneq_sit] = &&bc_jneq_sit,
+        [SPY_BC_call_f] = &&bc_call_f,
+        [SPY_BC_tail_call_f] = &&bc_tail_call_f,
+        [SPY_BC_putchar_s] = &&bc_putchar_s,
+        [SPY_BC_putchar_i] = &&bc_putchar_i,
+        [SPY_BC_ret] = &&bc_ret,
+    };
+    static_assert(sizeof dispatch / sizeof(void *) == SPY_BC_COUNT, "Every bytecode op needs a handler");
+
+    size_t slots_base = 0;
+    int32_t *slots = NULL;
+    uint8_t *pc = NULL;
+
+#define BC_S(offset) slots[bc_read_u16(pc + (offset))]
+#define BC_I(offset) ((int32_t)bc_read_u32(pc + (offset)))
+#define BC_NEXT(size)          \
+    do                         \
+    {                          \
+        pc += (size);          \
+        goto *dispatch[*pc];   \
+    } while (0)
+#define BC_ENTER(index)                                                      \
+    do                                                                       \
+    {                                                                        \
+        spy_bc_function *function = module->functions.items + (index);      \
+        values.count = slots_base;                                           \
+        for (size_t i = 0; i < function->slots_count; i++)                   \
+            nob_da_append(&values, 0);                                       \
+        slots = values.items + slots_base;                                   \
+        pc = code + function->code_offset;                                   \
+        goto *dispatch[*pc];                                                 \
+    } while (0)
+// Wrap around like the 32 bit registers on the native targets do
+#define BC_BINOP(name, expr)                                       \
+    bc_##name##_sss:                                               \
+    {                                                              \
+        int32_t a = BC_S(3), b = BC_S(5);                          \
+        BC_S(1) = (expr);                                          \
+        BC_NEXT(7);                                                \
+    }                                                              \
+    bc_##name##_ssi:                                               \
+    {                                                              \
+        int32_t a = BC_S(3), b = BC_I(5);                          \
+        BC_S(1) = (expr);                                          \
+        BC_NEXT(9);                                                \
+    }                                                              \
+    bc_##name##_sis:                                               \
+    {                                                              \
+        int32_t a = BC_I(3), b = BC_S(7);                          \
+        BC_S(1) = (expr);                                          \
+        BC_NEXT(9);                                                \
+    }
+#define BC_DIVISION(name, function)                                \
+    bc_##name##_sss:                                               \
+    {                                                              \
+        int32_t a = BC_S(3), b = BC_S(5);                          \
+        if (b == 0)                                                \
+            goto division_by_zero;                                 \
+        BC_S(1) = function(a, b);                                  \
+        BC_NEXT(7);                                                \
+    }                                                              \
+    bc_##name##_ssi:                                               \
+    {                                                              \
+        int32_t a = BC_S(3), b = BC_I(5);                          \
+        if (b == 0)                                                \
+            goto division_by_zero;                                 \
+        BC_S(1) = function(a, b);                                  \
+        BC_NEXT(9);                                                \
+    }                                                              \
+    bc_##name##_sis:                                               \
+    {                                                              \
+        int32_t a = BC_I(3), b = BC_S(7);                          \
+        if (b == 0)                                                \
+            goto division_by_zero;                                 \
+        BC_S(1) = function(a, b);                                  \
+        BC_NEXT(9);                                                \
+    }
+#define BC_BRANCH(name, cond)                                      \
+    bc_##name##_sst:                                               \
+    {                                                              \
+        int32_t a = BC_S(1), b = BC_S(3);                          \
+        if (cond)                                                  \
+        {                                                          \
+            pc = code + bc_read_u32(pc + 5);                       \
+            goto *dispatch[*pc];                                   \
+        }                                                          \
+        BC_NEXT(9);                                                \
+    }                                                              \
+    bc_##name##_sit:                                               \
+    {                                                              \
+        int32_t a = BC_S(1), b = BC_I(3);                          \
+        if (cond)                                                  \
+        {                                                          \
+            pc = code + bc_read_u32(pc + 7);                       \
+            goto *dispatch[*pc];                                   \
+        }                                                          \
+        BC_NEXT(11);                                               \
+    }
+
+    BC_ENTER(module->main);
+
+bc_mov_ss:
+    BC_S(1) = BC_S(3);
+    BC_NEXT(5);
+bc_mov_si:
+    BC_S(1) = BC_I(3);
+    BC_NEXT(7);
+    BC_BINOP(add, (int32_t)((uint32_t)a + (uint32_t)b))
+    BC_BINOP(sub, (int32_t)((uint32_t)a - (uint32_t)b))
+    BC_BINOP(mul, (int32_t)((uint32_t)a * (uint32_t)b))
+    BC_BINOP(lt, a < b)
+    BC_BINOP(lte, a <= b)
+    BC_BINOP(gt, a > b)
+    BC_BINOP(gte, a >= b)
+    BC_BINOP(eq, a == b)
+    BC_BINOP(neq, a != b)
+    BC_DIVISION(floordiv, spy_floordiv)
+    BC_DIVISION(mod, spy_mod)
+bc_jmp_t:
+    pc = code + bc_read_u32(pc + 1);
+    goto *dispatch[*pc];
+bc_jz_st:
+    if (BC_S(1) == 0)
+    {
+        pc = code + bc_read_u32(pc + 3);
+        goto *dispatch[*pc];
+    }
+    BC_NEXT(7);
+    BC_BRANCH(jlt, a < b)
+    BC_BRANCH(jlte, a <= b)
+    BC_BRANCH(jgt, a > b)
+    BC_BRANCH(jgte, a >= b)
+    BC_BRANCH(jeq, a == b)
+    BC_BRANCH(jneq, a != b)
+bc_call_f:
+{
+    if (frames.count >= SPY_RUN_MAX_FRAMES)
+    {
+        fprintf(stderr, "ERROR: Stack overflow, more than %d nested calls.\n", SPY_RUN_MAX_FRAMES);
+        goto defer;
+    }
+    spy_bc_frame frame = {
+        .return_pc = pc + 3,
+        .slots_base = slots_base,
+    };
+    nob_da_append(&frames, frame);
+    slots_base = values.count;
+    BC_ENTER(bc_read_u16(pc + 1));
+}
+bc_tail_call_f:
+    // The callee takes over our frame
+    BC_ENTER(bc_read_u16(pc + 1));
+bc_putchar_s:
+    putchar(BC_S(1));
+    BC_NEXT(3);
+bc_putchar_i:
+    putchar(BC_I(1));
+    BC_NEXT(5);
+bc_ret:
+    if (frames.count == 0)
+    {
+        result = true;
+        *exit_code = 0;
+        goto defer;
+    }
+    {
+        spy_bc_frame frame = frames.items[--frames.count];
+        values.count = slots_base;
+        slots_base = frame.slots_base;
+        slots = values.items + slots_base;
+        pc = frame.return_pc;
+        goto *dispatch[*pc];
+    }
+division_by_zero:
+    fprintf(stderr, "ERROR: Division by zero.\n");
+    goto defer;
+
+#undef BC_S
+#undef BC_I
+#undef BC_NEXT
+#undef BC_ENTER
+#undef BC_BINOP
+#undef BC_DIVISION
+#undef BC_BRANCH
+
+defer:
+    fflush(stdout);
+    nob_da_free(frames);
+    nob_da_free(values);
+    return result;
+}
+
+/*
+    PYTHON 3.11 BYTECODE (.pyc)
+*/
+
+// A .pyc is a 16 byte header followed by the module's code object in `marshal` format.
+// The bytecode is made of 2 byte code units, an opcode and an argument, with EXTENDED_ARG
+// prefixes for arguments over 255. Specialising opcodes are followed by inline cache units
+// the interpreter fills in at run time. Jumps are relative and count code units.
+//
+// The module is what `-target python311` prints: functions whose var slots are all
+// LOAD_FAST/STORE_FAST locals, plus the `__main__` guard that runs `main`.
+
+#define PYC_MAGIC "\xa7\x0d\x0d\x0a" // 3495, CPython 3.11
+#define PYC_CO_OPTIMIZED 0x1
+#define PYC_CO_NEWLOCALS 0x2
+#define PYC_CO_FAST_LOCAL 0x20
+#define PYC_NO_TARGET SIZE_MAX
+
+enum pyc_opcode
+{
+    PYC_CACHE = 0,
+    PYC_POP_TOP = 1,
+    PYC_PUSH_NULL = 2,
+    PYC_BINARY_SUBSCR = 25,
+    PYC_PUSH_EXC_INFO = 35,
+    PYC_CHECK_EXC_MATCH = 36,
+    PYC_RETURN_VALUE = 83,
+    PYC_POP_EXCEPT = 89,
+    PYC_STORE_NAME = 90,
+    PYC_LOAD_CONST = 100,
+    PYC_LOAD_NAME = 101,
+    PYC_LOAD_ATTR = 106,
+    PYC_COMPARE_OP = 107,
+    PYC_IMPORT_NAME = 108,
+    PYC_JUMP_FORWARD = 110,
+    PYC_POP_JUMP_FORWARD_IF_FALSE = 114,
+    PYC_LOAD_GLOBAL = 116,
+    PYC_RERAISE = 119,
+    PYC_COPY = 120,
+    PYC_BINARY_OP = 122,
+    PYC_LOAD_FAST = 124,
+    PYC_STORE_FAST = 125,
+    PYC_MAKE_FUNCTION = 132,
+    PYC_JUMP_BACKWARD = 140,
+    PYC_EXTENDED_ARG = 144,
+    PYC_RESUME = 151,
+    PYC_LOAD_METHOD = 160,
+    PYC_PRECALL = 166,
+    PYC_CALL = 171,
+    PYC_POP_JUMP_BACKWARD_IF_FALSE = 175,
+};
+
+// Arguments of BINARY_OP
+enum pyc_nb
+{
+    PYC_NB_ADD = 0,
+    PYC_NB_AND = 1,
+    PYC_NB_FLOOR_DIVIDE = 2,
+    PYC_NB_MULTIPLY = 5,
+    PYC_NB_REMAINDER = 6,
+    PYC_NB_SUBTRACT = 10,
+};
+
+size_t pyc_caches(enum pyc_opcode opcode)
+{
+    switch (opcode)
+    {
+    case PYC_BINARY_OP:
+    case PYC_PRECALL:
+        return 1;
+    case PYC_COMPARE_OP:
+        return 2;
+    case PYC_BINARY_SUBSCR:
+    case PYC_LOAD_ATTR:
+    case PYC_CALL:
+        return 4;
+    case PYC_LOAD_GLOBAL:
+        return 5;
+    case PYC_LOAD_METHOD:
+        return 10;
+    default:
+        return 0;
+    }
+}
+
+typedef struct
+{
+    uint8_t opcode;
+    uint32_t arg;
+    size_t target; // Instruction a jump goes to, the direction is picked when laying out
+} pyc_instr;
+
+typedef struct
+{
+    pyc_instr *items;
+    size_t count;
+    size_t capacity;
+} pyc_instrs;
+
+typedef struct
+{
+    size_t *items;
+    size_t count;
+    size_t capacity;
+} pyc_offsets;
+
+// Marshalled objects back to back, so equal constants and names are shared by comparing bytes
+typedef struct
+{
+    Nob_String_Builder data;
+    pyc_offsets starts;
+} pyc_objects;
+
+typedef struct
+{
+    size_t start; // Instructions [start, end) jump to `handler` when they raise
+    size_t end;
+    size_t handler;
+    uint32_t depth;
+    bool lasti;
+} pyc_handler;
+
+typedef struct
+{
+    pyc_handler *items;
+    size_t count;
+    size_t capacity;
+} pyc_handlers;
+
+typedef struct
+{
+    pyc_instrs instrs;
+    pyc_objects consts;
+    pyc_objects names;
+    pyc_objects locals;
+    pyc_handlers handlers;
+} pyc_code;
+
+void pyc_code_free(pyc_code *code)
+{
+    nob_da_free(code->instrs);
+    nob_sb_free(code->consts.data);
+    nob_da_free(code->consts.starts);
+    nob_sb_free(code->names.data);
+    nob_da_free(code->names.starts);
+    nob_sb_free(code->locals.data);
+    nob_da_free(code->locals.starts);
+    nob_da_free(code->handlers);
+}
+
+void pyc_write_u32(Nob_String_Builder *output, uint32_t value)
+{
+    for (size_t i = 0; i < 4; i++)
+        nob_da_append(output, (char)((value >> (i * 8)) & 0xff));
+}
+
+void pyc_marshal_int(Nob_String_Builder *output, int64_t value)
+{
+    if (value >= INT32_MIN && value <= INT32_MAX)
+    {
+        nob_da_append(output, 'i');
+        pyc_write_u32(output, (uint32_t)value);
+        return;
+    }
+    // Anything wider is a long made of 15 bit digits, the sign goes on the digit count
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    int32_t digits = 0;
+    for (uint64_t rest = magnitude; rest != 0; rest >>= 15)
+        digits++;
+    nob_da_append(output, 'l');
+    pyc_write_u32(output, (uint32_t)(value < 0 ? -digits : digits));
+    for (; magnitude != 0; magnitude >>= 15)
+    {
+        nob_da_append(output, (char)(magnitude & 0xff));
+        nob_da_append(output, (char)((magnitude >> 8) & 0x7f));
+    }
+}
+
+void pyc_marshal_bytes(Nob_String_Builder *output, const char *bytes, size_t count)
+{
+    nob_da_append(output, 's');
+    pyc_write_u32(output, count);
+    if (count > 0)
+        nob_sb_append_buf(output, bytes, count);
+}
+
+void pyc_marshal_str(Nob_String_Builder *output, const char *string, bool interned)
+{
+    // Spy identifiers and our own strings are ASCII
+    size_t length = strlen(string);
+    if (length < 256)
+    {
+        nob_da_append(output, interned ? 'Z' : 'z');
+        nob_da_append(output, (char)length);
+    }
+    else
+    {
+        nob_da_append(output, interned ? 'A' : 'a');
+        pyc_write_u32(output, length);
+    }
+    nob_sb_append_buf(output, string, length);
+}
+
+void pyc_marshal_tuple(Nob_String_Builder *output, pyc_objects *objects)
+{
+    if (objects->starts.count < 256)
+    {
+        nob_da_append(output, ')');
+        nob_da_append(output, (char)objects->starts.count);
+    }
+    else
+    {
+        nob_da_append(output, '(');
+        pyc_write_u32(output, objects->starts.count);
+    }
+    if (objects->data.count > 0)
+        nob_sb_append_buf(output, objects->data.items, objects->data.count);
+}
+
+uint32_t pyc_add_object(pyc_objects *objects, Nob_String_Builder *object)
+{
+    for (size_t i = 0; i < objects->starts.count; i++)
+    {
+        size_t start = objects->starts.items[i];
+        size_t end = i + 1 < objects->starts.count ? objects->starts.items[i + 1] : objects->data.count;
+        if (end - start == object->count && memcmp(objects->data.items + start, object->items, object->count) == 0)
+        {
+            object->count = 0;
+            return i;
+        }
+    }
+    nob_da_append(&objects->starts, objects->data.count);
+    nob_sb_append_buf(&objects->data, object->items, object->count);
+    object->count = 0;
+    return objects->starts.count - 1;
+}
+
+uint32_t pyc_const_none(pyc_code *code)
+{
+    Nob_String_Builder object = {0};
+    nob_da_append(&object, 'N');
+    uint32_t index = pyc_add_object(&code->consts, &object);
+    nob_sb_free(object);
+    return index;
+}
+
+uint32_t pyc_const_int(pyc_code *code, int64_t value)
+{
+    Nob_String_Builder object = {0};
+    pyc_marshal_int(&object, value);
+    uint32_t index = pyc_add_object(&code->consts, &object);
+    nob_sb_free(object);
+    return index;
+}
+
+uint32_t pyc_const_str(pyc_code *code, const char *string)
+{
+    Nob_String_Builder object = {0};
+    pyc_marshal_str(&object, string, false);
+    uint32_t index = pyc_add_object(&code->consts, &object);
+    nob_sb_free(object);
+    return index;
+}
+
+uint32_t pyc_const_bytes(pyc_code *code, const char *bytes, size_t count)
+{
+    Nob_String_Builder object = {0};
+    pyc_marshal_bytes(&object, bytes, count);
+    uint32_t index = pyc_add_object(&code->consts, &object);
+    nob_sb_free(object);
+    return index;
+}
+
+uint32_t pyc_name(pyc_objects *names, const char *name)
+{
+    Nob_String_Builder object = {0};
+    pyc_marshal_str(&object, name, true);
+    uint32_t index = pyc_add_object(names, &object);
+    nob_sb_free(object);
+    return index;
+}
+
+size_t pyc_emit(pyc_code *code, enum pyc_opcode opcode, uint32_t arg)
+{
+    pyc_instr instr = {.opcode = opcode, .arg = arg, .target = PYC_NO_TARGET};
+    nob_da_append(&code->instrs, instr);
+    return code->instrs.count - 1;
+}
+
+size_t pyc_emit_jump(pyc_code *code, enum pyc_opcode opcode, size_t target)
+{
+    size_t index = pyc_emit(code, opcode, 0);
+    code->instrs.items[index].target = target;
+    return index;
+}
+
+void pyc_emit_wrap(pyc_code *code)
+{
+    // (x + 0x80000000 & 0xFFFFFFFF) - 0x80000000, Spy integers wrap around at 32 bits
+    pyc_emit(code, PYC_LOAD_CONST, pyc_const_int(code, 0x80000000));
+    pyc_emit(code, PYC_BINARY_OP, PYC_NB_ADD);
+    pyc_emit(code, PYC_LOAD_CONST, pyc_const_int(code, 0xFFFFFFFF));
+    pyc_emit(code, PYC_BINARY_OP, PYC_NB_AND);
+    pyc_emit(code, PYC_LOAD_CONST, pyc_const_int(code, 0x80000000));
+    pyc_emit(code, PYC_BINARY_OP, PYC_NB_SUBTRACT);
+}
+
+void pyc_emit_term(pyc_code *code, spy_op_term term)
+{
+    if (term.type == SPY_OP_TERM_var)
+        pyc_emit(code, PYC_LOAD_FAST, term.data.var_index);
+    else
+        pyc_emit(code, PYC_LOAD_CONST, pyc_const_int(code, term.data.intlit));
+}
+
+void pyc_emit_binop(pyc_code *code, spy_op_stmt *op)
+{
+    pyc_emit_term(code, spy_op_lhs(op));
+    pyc_emit_term(code, spy_op_rhs(op));
+    switch ((enum spy_op_expr_binop_type)op->binop)
+    {
+    case SPY_OP_EXPR_BINOP_add:
+        pyc_emit(code, PYC_BINARY_OP, PYC_NB_ADD);
+        break;
+    case SPY_OP_EXPR_BINOP_sub:
+        pyc_emit(code, PYC_BINARY_OP, PYC_NB_SUBTRACT);
+        break;
+    case SPY_OP_EXPR_BINOP_mul:
+        pyc_emit(code, PYC_BINARY_OP, PYC_NB_MULTIPLY);
+        break;
+    case SPY_OP_EXPR_BINOP_floordiv:
+        pyc_emit(code, PYC_BINARY_OP, PYC_NB_FLOOR_DIVIDE);
+        break;
+    case SPY_OP_EXPR_BINOP_mod:
+        pyc_emit(code, PYC_BINARY_OP, PYC_NB_REMAINDER);
+        break;
+    case SPY_OP_EXPR_BINOP_lt:
+        pyc_emit(code, PYC_COMPARE_OP, 0);
+        break;
+    case SPY_OP_EXPR_BINOP_lte:
+        pyc_emit(code, PYC_COMPARE_OP, 1);
+        break;
+    case SPY_OP_EXPR_BINOP_eq:
+        pyc_emit(code, PYC_COMPARE_OP, 2);
+        break;
+    case SPY_OP_EXPR_BINOP_neq:
+        pyc_emit(code, PYC_COMPARE_OP, 3);
+        break;
+    case SPY_OP_EXPR_BINOP_gt:
+        pyc_emit(code, PYC_COMPARE_OP, 4);
+        break;
+    case SPY_OP_EXPR_BINOP_gte:
+        pyc_emit(code, PYC_COMPARE_OP, 5);
+        break;
+    }
+    if (python311_can_overflow(op))
+        pyc_emit_wrap(code);
+}
+
+size_t pyc_extended_args(uint32_t arg)
+{
+    size_t count = 0;
+    for (arg >>= 8; arg != 0; arg >>= 8)
+        count++;
+    return count;
+}
+
+bool pyc_is_jump(enum pyc_opcode opcode)
+{
+    return opcode == PYC_JUMP_FORWARD || opcode == PYC_POP_JUMP_FORWARD_IF_FALSE;
+}
+
+void pyc_assemble(pyc_code *code, Nob_String_Builder *bytecode, Nob_String_Builder *exception_table)
+{
+    // Jump arguments depend on how far the jump goes, which depends on how many EXTENDED_ARGs
+    // the jumps in between need. Sizes only ever grow, so this settles quickly.
+    size_t count = code->instrs.count;
+    size_t *offsets = malloc((count + 1) * sizeof(size_t));
+    uint8_t *extended = calloc(count, 1);
+    for (size_t i = 0; i < count; i++)
+        extended[i] = pyc_extended_args(code->instrs.items[i].arg);
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        offsets[0] = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            pyc_instr *instr = code->instrs.items + i;
+            offsets[i + 1] = offsets[i] + extended[i] + 1 + pyc_caches(instr->opcode);
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            pyc_instr *instr = code->instrs.items + i;
+            if (!pyc_is_jump(instr->opcode))
+                continue;
+            size_t from = offsets[i + 1];
+            size_t to = offsets[instr->target];
+            instr->arg = to >= from ? to - from : from - to;
+            if (pyc_extended_args(instr->arg) > extended[i])
             {
-                spy_op_assign *assign = &op_stmt.data.assign;
-                spy_op_term *term = &assign->term;
-                nob_sb_appendf(output, "    var_%ld: int = ", assign->var_index);
-                if (!compile_dump_python311_term(term, output))
-                    return false;
-                nob_sb_appendf(output, "\n");
-                break;
+                extended[i] = pyc_extended_args(instr->arg);
+                changed = true;
             }
-            case SPY_OP_assign_binop:
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        pyc_instr *instr = code->instrs.items + i;
+        uint8_t opcode = instr->opcode;
+        if (pyc_is_jump(opcode) && offsets[instr->target] < offsets[i + 1])
+            opcode = opcode == PYC_JUMP_FORWARD ? PYC_JUMP_BACKWARD : PYC_POP_JUMP_BACKWARD_IF_FALSE;
+        for (size_t j = extended[i]; j > 0; j--)
+        {
+            nob_da_append(bytecode, (char)PYC_EXTENDED_ARG);
+            nob_da_append(bytecode, (char)((instr->arg >> (j * 8)) & 0xff));
+        }
+        nob_da_append(bytecode, (char)opcode);
+        nob_da_append(bytecode, (char)(instr->arg & 0xff));
+        for (size_t j = 0; j < pyc_caches(opcode); j++)
+        {
+            nob_da_append(bytecode, (char)PYC_CACHE);
+            nob_da_append(bytecode, 0);
+        }
+    }
+    // Every entry is start, size, target and depth, in code units, as big endian groups of
+    // 6 bits with 0x40 on all but the last group and 0x80 on the first byte of an entry
+    for (size_t i = 0; i < code->handlers.count; i++)
+    {
+        pyc_handler *handler = code->handlers.items + i;
+        size_t values[4] = {
+            offsets[handler->start],
+            offsets[handler->end] - offsets[handler->start],
+            offsets[handler->handler],
+            handler->depth << 1 | handler->lasti,
+        };
+        size_t entry = exception_table->count;
+        for (size_t j = 0; j < 4; j++)
+        {
+            size_t shift = 0;
+            while (values[j] >> (shift + 6) != 0)
+                shift += 6;
+            for (;; shift -= 6)
             {
-                nob_sb_appendf(output, "    var_%ld = ", op_stmt.data.assign.var_index);
-                if (!compile_dump_python311_term(&op_stmt.data.assign_binop.lhs, output))
-                    return false;
-                switch (op_stmt.data.assign_binop.type)
-                {
-                case SPY_OP_EXPR_BINOP_add:
-                    nob_sb_appendf(output, " + ");
-                    break;
-                case SPY_OP_EXPR_BINOP_sub:
-                    nob_sb_appendf(output, " - ");
-                    break;
-                case SPY_OP_EXPR_BINOP_mul:
-                    nob_sb_appendf(output, " * ");
-                    break;
-                case SPY_OP_EXPR_BINOP_lt:
-                    nob_sb_appendf(output, " < ");
-                    break;
-                case SPY_OP_EXPR_BINOP_gt:
-                    nob_sb_appendf(output, " > ");
-                    break;
-                case SPY_OP_EXPR_BINOP_lte:
-                    nob_sb_appendf(output, " <= ");
-                    break;
-                case SPY_OP_EXPR_BINOP_gte:
-                    nob_sb_appendf(output, " >= ");
-                    break;
-                case SPY_OP_EXPR_BINOP_eq:
-                    nob_sb_appendf(output, " == ");
+                uint8_t byte = (values[j] >> shift) & 0x3f;
+                nob_da_append(exception_table, (char)(shift != 0 ? byte | 0x40 : byte));
+                if (shift == 0)
                     break;
-                case SPY_OP_EXPR_BINOP_neq:
-                    nob_sb_appendf(output, " != ");
-                    break;
-                }
-                if (!compile_dump_python311_term(&op_stmt.data.assign_binop.rhs, output))
-                    return false;
-                nob_sb_appendf(output, "\n");
-                break;
             }
-            case SPY_OP_declare_assign_binop:
+        }
+        exception_table->items[entry] |= (char)0x80;
+    }
+    free(offsets);
+    free(extended);
+}
+
+void pyc_marshal_code(pyc_code *code, const char *name, uint32_t stacksize, uint32_t flags, Nob_String_Builder *output)
+{
+    Nob_String_Builder bytecode = {0};
+    Nob_String_Builder exception_table = {0};
+    Nob_String_Builder kinds = {0};
+    Nob_String_Builder line_table = {0};
+    pyc_assemble(code, &bytecode, &exception_table);
+    for (size_t i = 0; i < code->locals.starts.count; i++)
+        nob_da_append(&kinds, (char)PYC_CO_FAST_LOCAL);
+    // Spy has no line numbers in the IR, every instruction gets "no location" in chunks of 8 units
+    for (size_t units = bytecode.count / 2; units > 0;)
+    {
+        size_t chunk = units < 8 ? units : 8;
+        nob_da_append(&line_table, (char)(0x80 | 15 << 3 | (chunk - 1)));
+        units -= chunk;
+    }
+
+    nob_da_append(output, 'c');
+    pyc_write_u32(output, 0); // argcount
+    pyc_write_u32(output, 0); // posonlyargcount
+    pyc_write_u32(output, 0); // kwonlyargcount
+    pyc_write_u32(output, stacksize);
+    pyc_write_u32(output, flags);
+    pyc_marshal_bytes(output, bytecode.items, bytecode.count);
+    pyc_marshal_tuple(output, &code->consts);
+    pyc_marshal_tuple(output, &code->names);
+    pyc_marshal_tuple(output, &code->locals);
+    pyc_marshal_bytes(output, kinds.items, kinds.count);
+    pyc_marshal_str(output, "<spy>", false); // filename
+    pyc_marshal_str(output, name, true);
+    pyc_marshal_str(output, name, true); // qualname
+    pyc_write_u32(output, 1); // firstlineno
+    pyc_marshal_bytes(output, line_table.items, line_table.count);
+    pyc_marshal_bytes(output, exception_table.items, exception_table.count);
+    nob_sb_free(bytecode);
+    nob_sb_free(exception_table);
+    nob_sb_free(kinds);
+    nob_sb_free(line_table);
+}
+
+bool pyc_is_putchar(spy_ops *ops, spy_op_stmt *op)
+{
+    return (op->type == SPY_OP_func_call || op->type == SPY_OP_tail_call) && op->rhs == 1 && str_eq(ops->names.items[op->index], "putchar");
+}
+
+bool compile_pyc311_function(spy_ops *ops, spy_op_function *function, Nob_String_Builder *output)
+{
+    pyc_code code = {0};
+    spy_op_stmt *stmts = function->stmts.items;
+    size_t count = function->stmts.count;
+    size_t *stmt_instrs = malloc((count + 1) * sizeof(size_t));
+    pyc_const_none(&code); // The docstring slot
+
+    // Var slots are the first locals, so LOAD_FAST n is var_n
+    uint32_t slots = 0;
+    int32_t max_args = 0;
+    bool writes = false;
+    bool writes_bytes = false;
+    for (size_t i = 0; i < count; i++)
+    {
+        spy_op_stmt *op = stmts + i;
+        if (op->type == SPY_OP_func_call || op->type == SPY_OP_tail_call)
+        {
+            spy_op_term *args = spy_op_args(function, op);
+            writes = writes || pyc_is_putchar(ops, op);
+            writes_bytes = writes_bytes || (pyc_is_putchar(ops, op) && (args[0].type == SPY_OP_TERM_var || op->type == SPY_OP_tail_call));
+            for (int32_t j = 0; j < op->rhs; j++)
+                if (args[j].type == SPY_OP_TERM_var && args[j].data.var_index >= slots)
+                    slots = args[j].data.var_index + 1;
+            max_args = op->rhs > max_args ? op->rhs : max_args;
+            continue;
+        }
+        if (op->type == SPY_OP_jump || op->type == SPY_OP_block_mark_start || op->type == SPY_OP_block_mark_end)
+            continue;
+        if (op->type != SPY_OP_conditional_jump && op->index >= slots)
+            slots = op->index + 1;
+        spy_op_term lhs = spy_op_lhs(op);
+        spy_op_term rhs = spy_op_rhs(op);
+        if (lhs.type == SPY_OP_TERM_var && lhs.data.var_index >= slots)
+            slots = lhs.data.var_index + 1;
+        if (is_binop_assign(op) && rhs.type == SPY_OP_TERM_var && rhs.data.var_index >= slots)
+            slots = rhs.data.var_index + 1;
+    }
+    for (uint32_t i = 0; i < slots; i++)
+    {
+        char *name = nob_temp_sprintf("var_%u", i);
+        pyc_name(&code.locals, name);
+    }
+    uint32_t spy_write = pyc_name(&code.locals, "spy_write");
+    uint32_t spy_bytes = pyc_name(&code.locals, "spy_bytes");
+
+    pyc_emit(&code, PYC_RESUME, 0);
+    if (writes)
+    {
+        // spy_write = sys.stdout.buffer.write
+        pyc_emit(&code, PYC_LOAD_GLOBAL, pyc_name(&code.names, "sys") << 1);
+        pyc_emit(&code, PYC_LOAD_ATTR, pyc_name(&code.names, "stdout"));
+        pyc_emit(&code, PYC_LOAD_ATTR, pyc_name(&code.names, "buffer"));
+        pyc_emit(&code, PYC_LOAD_ATTR, pyc_name(&code.names, "write"));
+        pyc_emit(&code, PYC_STORE_FAST, spy_write);
+    }
+    if (writes_bytes)
+    {
+        // spy_bytes = SPY_BYTES
+        pyc_emit(&code, PYC_LOAD_GLOBAL, pyc_name(&code.names, "SPY_BYTES") << 1);
+        pyc_emit(&code, PYC_STORE_FAST, spy_bytes);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        spy_op_stmt *op = stmts + i;
+        stmt_instrs[i] = code.instrs.count;
+        switch ((enum spy_op_stmt_type)op->type)
+        {
+        case SPY_OP_assign:
+        case SPY_OP_declare_assign:
+            pyc_emit_term(&code, spy_op_lhs(op));
+            pyc_emit(&code, PYC_STORE_FAST, op->index);
+            break;
+        case SPY_OP_assign_binop:
+        case SPY_OP_declare_assign_binop:
+            pyc_emit_binop(&code, op);
+            // A fused comparison stays on the stack for the conditional jump
+            if (can_fuse_compare_and_branch(function, i))
             {
-                nob_sb_appendf(output, "    var_%ld: int = ", op_stmt.data.assign.var_index);
-                if (!compile_dump_python311_term(&op_stmt.data.assign_binop.lhs, output))
-                    return false;
-                switch (op_stmt.data.assign_binop.type)
-                {
-                case SPY_OP_EXPR_BINOP_add:
-                    nob_sb_appendf(output, " + ");
-                    break;
-                case SPY_OP_EXPR_BINOP_sub:
-                    nob_sb_appendf(output, " - ");
-                    break;
-                case SPY_OP_EXPR_BINOP_mul:
-                    nob_sb_appendf(output, " * ");
-                    break;
-                case SPY_OP_EXPR_BINOP_lt:
-                    nob_sb_appendf(output, " < ");
-                    break;
-                case SPY_OP_EXPR_BINOP_gt:
-                    nob_sb_appendf(output, " > ");
-                    break;
-                case SPY_OP_EXPR_BINOP_lte:
-                    nob_sb_appendf(output, " <= ");
-                    break;
-                case SPY_OP_EXPR_BINOP_gte:
-                    nob_sb_appendf(output, " >= ");
-                    break;
-                case SPY_OP_EXPR_BINOP_eq:
-                    nob_sb_appendf(output, " == ");
-                    break;
-                case SPY_OP_EXPR_BINOP_neq:
-                    nob_sb_appendf(output, " != ");
-                    break;
-                }
-                if (!compile_dump_python311_term(&op_stmt.data.assign_binop.rhs, output))
-                    return false;
-                nob_sb_appendf(output, "\n");
+                i++;
+                stmt_instrs[i] = code.instrs.count;
+                pyc_emit_jump(&code, PYC_POP_JUMP_FORWARD_IF_FALSE, stmts[i].index);
                 break;
             }
-            case SPY_OP_func_call:
+            pyc_emit(&code, PYC_STORE_FAST, op->index);
+            break;
+        case SPY_OP_func_call:
+        case SPY_OP_tail_call:
+        {
+            spy_op_term *args = spy_op_args(function, op);
+            if (pyc_is_putchar(ops, op))
             {
-                spy_op_func_call func_call = op_stmt.data.func_call;
-                nob_sb_appendf(output, "    %s(", func_call.name);
-                for (size_t i = 0; i < func_call.args.count; i++)
+                pyc_emit(&code, PYC_PUSH_NULL, 0);
+                pyc_emit(&code, PYC_LOAD_FAST, spy_write);
+                if (args[0].type == SPY_OP_TERM_intlit && op->type == SPY_OP_func_call)
                 {
-                    if (!compile_dump_ir_term(func_call.args.items + i, output))
-                        return false;
-                    if (i < func_call.args.count - 1)
+                    // Consecutive constant putchars are written as one bytes constant
+                    Nob_String_Builder bytes = {0};
+                    size_t first = i;
+                    while (i < count && stmts[i].type == SPY_OP_func_call && pyc_is_putchar(ops, stmts + i) &&
+                           spy_op_args(function, stmts + i)[0].type == SPY_OP_TERM_intlit)
                     {
-                        nob_sb_appendf(output, ", ");
+                        nob_da_append(&bytes, (char)(spy_op_args(function, stmts + i)[0].data.intlit & 0xff));
+                        stmt_instrs[i++] = stmt_instrs[first];
                     }
+                    i--;
+                    pyc_emit(&code, PYC_LOAD_CONST, pyc_const_bytes(&code, bytes.items, bytes.count));
+                    nob_sb_free(bytes);
+                }
+                else
+                {
+                    // spy_bytes[x & 255]
+                    pyc_emit(&code, PYC_LOAD_FAST, spy_bytes);
+                    pyc_emit_term(&code, args[0]);
+                    pyc_emit(&code, PYC_LOAD_CONST, pyc_const_int(&code, 255));
+                    pyc_emit(&code, PYC_BINARY_OP, PYC_NB_AND);
+                    pyc_emit(&code, PYC_BINARY_SUBSCR, 0);
                 }
-                nob_sb_appendf(output, ")\n");
-                break;
             }
-            case SPY_OP_jump:
-            case SPY_OP_conditional_jump:
-            case SPY_OP_block_mark_start:
-            case SPY_OP_block_mark_end:
-                fprintf(stderr, "Compiling jumps etc. is not implemented in Python 3.11 yet!\n");
-                return false;
+            else
+            {
+                pyc_emit(&code, PYC_LOAD_GLOBAL, pyc_name(&code.names, ops->names.items[op->index]) << 1 | 1);
+                for (int32_t j = 0; j < op->rhs; j++)
+                    pyc_emit_term(&code, args[j]);
             }
+            pyc_emit(&code, PYC_PRECALL, op->rhs);
+            pyc_emit(&code, PYC_CALL, op->rhs);
+            pyc_emit(&code, op->type == SPY_OP_tail_call ? PYC_RETURN_VALUE : PYC_POP_TOP, 0);
+            break;
+        }
+        case SPY_OP_jump:
+            pyc_emit_jump(&code, PYC_JUMP_FORWARD, op->index);
+            break;
+        case SPY_OP_conditional_jump:
+            pyc_emit_term(&code, spy_op_lhs(op));
+            pyc_emit_jump(&code, PYC_POP_JUMP_FORWARD_IF_FALSE, op->index);
+            break;
+        case SPY_OP_block_mark_start:
+        case SPY_OP_block_mark_end:
+            break;
+        }
+    }
+    stmt_instrs[count] = code.instrs.count;
+    pyc_emit(&code, PYC_LOAD_CONST, 0);
+    pyc_emit(&code, PYC_RETURN_VALUE, 0);
+    for (size_t i = 0; i < code.instrs.count; i++)
+    {
+        if (code.instrs.items[i].target != PYC_NO_TARGET)
+            code.instrs.items[i].target = stmt_instrs[code.instrs.items[i].target];
+    }
+
+    // NULL, spy_write, spy_bytes, x and 255 is the deepest the stack gets outside of calls
+    uint32_t stacksize = 5 + max_args;
+    pyc_marshal_code(&code, function->name, stacksize, PYC_CO_OPTIMIZED | PYC_CO_NEWLOCALS, output);
+    free(stmt_instrs);
+    pyc_code_free(&code);
+    return true;
+}
+
+void pyc_emit_method_call(pyc_code *code, char *object, char *attribute, char *method, int32_t arg)
+{
+    // sys.<attribute>.<method>(arg), arg is a constant index or -1 for no argument
+    pyc_emit(code, PYC_LOAD_NAME, pyc_name(&code->names, object));
+    pyc_emit(code, PYC_LOAD_ATTR, pyc_name(&code->names, attribute));
+    pyc_emit(code, PYC_LOAD_METHOD, pyc_name(&code->names, method));
+    if (arg >= 0)
+        pyc_emit(code, PYC_LOAD_CONST, arg);
+    pyc_emit(code, PYC_PRECALL, arg >= 0);
+    pyc_emit(code, PYC_CALL, arg >= 0);
+    pyc_emit(code, PYC_POP_TOP, 0);
+}
+
+bool compile_pyc311(spy_ops *ops, Nob_String_Builder *output)
+{
+    pyc_code code = {0};
+    pyc_const_int(&code, 0);
+    uint32_t none = pyc_const_none(&code);
+    pyc_emit(&code, PYC_RESUME, 0);
+
+    // import sys
+    pyc_emit(&code, PYC_LOAD_CONST, 0);
+    pyc_emit(&code, PYC_LOAD_CONST, none);
+    pyc_emit(&code, PYC_IMPORT_NAME, pyc_name(&code.names, "sys"));
+    pyc_emit(&code, PYC_STORE_NAME, pyc_name(&code.names, "sys"));
+
+    // SPY_BYTES = (b"\x00", b"\x01", ...), putchar writes one byte like on every other target
+    Nob_String_Builder object = {0};
+    nob_da_append(&object, '(');
+    pyc_write_u32(&object, 256);
+    for (size_t i = 0; i < 256; i++)
+    {
+        char byte = (char)i;
+        pyc_marshal_bytes(&object, &byte, 1);
+    }
+    pyc_emit(&code, PYC_LOAD_CONST, pyc_add_object(&code.consts, &object));
+    pyc_emit(&code, PYC_STORE_NAME, pyc_name(&code.names, "SPY_BYTES"));
+
+    bool has_main = false;
+    for (size_t i = 0; i < ops->count; i++)
+    {
+        spy_op_function *function = ops->items + i;
+        if (!compile_pyc311_function(ops, function, &object))
+        {
+            nob_sb_free(object);
+            pyc_code_free(&code);
+            return false;
+        }
+        pyc_emit(&code, PYC_LOAD_CONST, pyc_add_object(&code.consts, &object));
+        pyc_emit(&code, PYC_MAKE_FUNCTION, 0);
+        pyc_emit(&code, PYC_STORE_NAME, pyc_name(&code.names, function->name));
+        has_main = has_main || str_eq(function->name, "main");
+    }
+    nob_sb_free(object);
+
+    if (has_main)
+    {
+        // if __name__ == "__main__":
+        //     try:
+        //         main()
+        //     except ZeroDivisionError:
+        //         sys.stdout.flush()
+        //         sys.stderr.write("ERROR: Division by zero.\n")
+        //         sys.exit(1)
+        pyc_emit(&code, PYC_LOAD_NAME, pyc_name(&code.names, "__name__"));
+        pyc_emit(&code, PYC_LOAD_CONST, pyc_const_str(&code, "__main__"));
+        pyc_emit(&code, PYC_COMPARE_OP, 2);
+        size_t not_main = pyc_emit_jump(&code, PYC_POP_JUMP_FORWARD_IF_FALSE, PYC_NO_TARGET);
+
+        size_t try_start = pyc_emit(&code, PYC_PUSH_NULL, 0);
+        pyc_emit(&code, PYC_LOAD_NAME, pyc_name(&code.names, "main"));
+        pyc_emit(&code, PYC_PRECALL, 0);
+        pyc_emit(&code, PYC_CALL, 0);
+        pyc_emit(&code, PYC_POP_TOP, 0);
+        size_t try_end = pyc_emit(&code, PYC_LOAD_CONST, none);
+        pyc_emit(&code, PYC_RETURN_VALUE, 0);
+
+        size_t except = pyc_emit(&code, PYC_PUSH_EXC_INFO, 0);
+        pyc_emit(&code, PYC_LOAD_NAME, pyc_name(&code.names, "ZeroDivisionError"));
+        pyc_emit(&code, PYC_CHECK_EXC_MATCH, 0);
+        size_t no_match = pyc_emit_jump(&code, PYC_POP_JUMP_FORWARD_IF_FALSE, PYC_NO_TARGET);
+        pyc_emit(&code, PYC_POP_TOP, 0);
+        pyc_emit_method_call(&code, "sys", "stdout", "flush", -1);
+        pyc_emit_method_call(&code, "sys", "stderr", "write", pyc_const_str(&code, "ERROR: Division by zero.\n"));
+        pyc_emit(&code, PYC_PUSH_NULL, 0);
+        pyc_emit(&code, PYC_LOAD_NAME, pyc_name(&code.names, "sys"));
+        pyc_emit(&code, PYC_LOAD_ATTR, pyc_name(&code.names, "exit"));
+        pyc_emit(&code, PYC_LOAD_CONST, pyc_const_int(&code, 1));
+        pyc_emit(&code, PYC_PRECALL, 1);
+        pyc_emit(&code, PYC_CALL, 1);
+        pyc_emit(&code, PYC_POP_TOP, 0);
+        size_t except_end = pyc_emit(&code, PYC_POP_EXCEPT, 0);
+        pyc_emit(&code, PYC_LOAD_CONST, none);
+        pyc_emit(&code, PYC_RETURN_VALUE, 0);
+
+        size_t reraise = pyc_emit(&code, PYC_RERAISE, 0);
+        size_t cleanup = pyc_emit(&code, PYC_COPY, 3);
+        pyc_emit(&code, PYC_POP_EXCEPT, 0);
+        pyc_emit(&code, PYC_RERAISE, 1);
+
+        code.instrs.items[not_main].target = code.instrs.count;
+        code.instrs.items[no_match].target = reraise;
+        nob_da_append(&code.handlers, ((pyc_handler){.start = try_start, .end = try_end, .handler = except}));
+        nob_da_append(&code.handlers, ((pyc_handler){.start = except, .end = except_end, .handler = cleanup, .depth = 1, .lasti = true}));
+        nob_da_append(&code.handlers, ((pyc_handler){.start = reraise, .end = cleanup, .handler = cleanup, .depth = 1, .lasti = true}));
+    }
+    pyc_emit(&code, PYC_LOAD_CONST, none);
+    pyc_emit(&code, PYC_RETURN_VALUE, 0);
+
+    // Flags 0 means the last two words are the source mtime and size, there is no source
+    nob_sb_append_buf(output, PYC_MAGIC, 4);
+    pyc_write_u32(output, 0);
+    pyc_write_u32(output, 0);
+    pyc_write_u32(output, 0);
+    pyc_marshal_code(&code, "<module>", 8, 0, output);
+    pyc_code_free(&code);
+    return true;
+}
+
+/*
+    X86-64 MACHINE CODE
+*/
+
+enum x86_reloc_type
+{
+    X86_RELOC_branch, // call or jmp to a function
+    X86_RELOC_data,   // %rip relative memory operand
+};
+
+// The rel32 field at `offset` becomes symbol + addend - offset
+typedef struct
+{
+    size_t offset;
+    uint32_t symbol; // Or the label for local jumps
+    int32_t addend;
+    uint8_t type;
+} x86_reloc;
+
+typedef struct
+{
+    x86_reloc *items;
+    size_t count;
+    size_t capacity;
+} x86_relocs;
+
+void x86_encode_u8(Nob_String_Builder *code, uint8_t value)
+{
+    nob_da_append(code, (char)value);
+}
+
+void x86_encode_u32(Nob_String_Builder *code, uint32_t value)
+{
+    for (size_t i = 0; i < 4; i++)
+        x86_encode_u8(code, (value >> (i * 8)) & 0xff);
+}
+
+void x86_patch_u32(Nob_String_Builder *code, size_t offset, uint32_t value)
+{
+    for (size_t i = 0; i < 4; i++)
+        code->items[offset + i] = (char)((value >> (i * 8)) & 0xff);
+}
+
+void x86_encode_rex(Nob_String_Builder *code, uint8_t size, uint8_t reg, x86_operand rm)
+{
+    uint8_t rex = 0x40;
+    if (size == 8)
+        rex |= 0x08;
+    if (reg >= 8)
+        rex |= 0x04;
+    if (rm.reg >= 8 && (rm.kind == X86_OPERAND_reg || rm.kind == X86_OPERAND_mem))
+        rex |= 0x01;
+    if (rm.kind == X86_OPERAND_mem && rm.scale != 0 && rm.index >= 8)
+        rex |= 0x02;
+    // spl, bpl, sil and dil are only reachable with a REX prefix
+    bool byte_reg = size == 1 && ((rm.kind == X86_OPERAND_reg && rm.reg >= 4) || reg >= 4);
+    if (rex != 0x40 || byte_reg)
+        x86_encode_u8(code, rex);
+}
+
+void x86_encode_modrm(Nob_String_Builder *code, uint8_t reg, x86_operand rm, x86_relocs *relocs)
+{
+    if (rm.kind == X86_OPERAND_reg)
+    {
+        x86_encode_u8(code, 0xc0 | (reg & 7) << 3 | (rm.reg & 7));
+        return;
+    }
+    if (rm.kind == X86_OPERAND_rip)
+    {
+        // The addend is fixed up once the whole instruction is known
+        x86_encode_u8(code, (reg & 7) << 3 | 0x05);
+        x86_reloc reloc = {.offset = code->count, .symbol = rm.value, .type = X86_RELOC_data};
+        nob_da_append(relocs, reloc);
+        x86_encode_u32(code, 0);
+        return;
+    }
+    uint8_t mod = 0x80;
+    // [rbp] and [r13] always need a displacement
+    if (rm.value == 0 && (rm.reg & 7) != X86_REG_rbp)
+        mod = 0x00;
+    else if (x86_fits_i8(rm.value))
+        mod = 0x40;
+    if (rm.scale != 0)
+    {
+        uint8_t scale_bits = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+        x86_encode_u8(code, mod | (reg & 7) << 3 | 0x04);
+        x86_encode_u8(code, scale_bits << 6 | (rm.index & 7) << 3 | (rm.reg & 7));
+    }
+    else
+    {
+        x86_encode_u8(code, mod | (reg & 7) << 3 | (rm.reg & 7));
+        // [rsp] and [r12] need a SIB byte
+        if ((rm.reg & 7) == X86_REG_rsp)
+            x86_encode_u8(code, 0x24);
+    }
+    if (mod == 0x40)
+        x86_encode_u8(code, (uint8_t)rm.value);
+    else if (mod == 0x80)
+        x86_encode_u32(code, rm.value);
+}
+
+// `opcode reg, rm` where the ModRM reg field is either a register or an opcode extension
+void x86_encode_op_rm(Nob_String_Builder *code, uint8_t size, uint32_t opcode, uint8_t reg, x86_operand rm, x86_relocs *relocs)
+{
+    x86_encode_rex(code, size, reg, rm);
+    if (opcode > 0xff)
+        x86_encode_u8(code, opcode >> 8);
+    x86_encode_u8(code, opcode & 0xff);
+    x86_encode_modrm(code, reg, rm, relocs);
+}
+
+uint8_t x86_alu_extension(enum x86_opcode opcode)
+{
+    switch (opcode)
+    {
+    case X86_add:
+        return 0;
+    case X86_sub:
+        return 5;
+    case X86_and:
+        return 4;
+    case X86_xor:
+        return 6;
+    case X86_cmp:
+        return 7;
+    default:
+        return 0;
+    }
+}
+
+bool x86_encode_instr_operands(x86_instr *instr, size_t *labels, Nob_String_Builder *code, x86_relocs *label_fixups, x86_relocs *relocs)
+{
+    x86_operand src = instr->src;
+    x86_operand dst = instr->dst;
+    switch ((enum x86_opcode)instr->opcode)
+    {
+    case X86_label:
+        labels[dst.value] = code->count;
+        return true;
+    case X86_mov:
+        if (src.kind == X86_OPERAND_imm && dst.kind == X86_OPERAND_reg && instr->size == 4)
+        {
+            x86_encode_rex(code, 4, 0, dst);
+            x86_encode_u8(code, 0xb8 + (dst.reg & 7));
+            x86_encode_u32(code, src.value);
+        }
+        else if (src.kind == X86_OPERAND_imm && instr->size == 1)
+        {
+            x86_encode_op_rm(code, 1, 0xc6, 0, dst, relocs);
+            x86_encode_u8(code, (uint8_t)src.value);
+        }
+        else if (src.kind == X86_OPERAND_imm)
+        {
+            x86_encode_op_rm(code, instr->size, 0xc7, 0, dst, relocs);
+            x86_encode_u32(code, src.value);
+        }
+        else if (src.kind == X86_OPERAND_reg)
+            x86_encode_op_rm(code, instr->size, instr->size == 1 ? 0x88 : 0x89, src.reg, dst, relocs);
+        else if (dst.kind == X86_OPERAND_reg)
+            x86_encode_op_rm(code, instr->size, instr->size == 1 ? 0x8a : 0x8b, dst.reg, src, relocs);
+        else
+            break;
+        return true;
+    case X86_add:
+    case X86_sub:
+    case X86_and:
+    case X86_xor:
+    case X86_cmp:
+    {
+        uint8_t ext = x86_alu_extension(instr->opcode);
+        if (src.kind == X86_OPERAND_imm && !x86_fits_i8(src.value) && dst.kind == X86_OPERAND_reg && dst.reg == X86_REG_rax)
+        {
+            // Short form for the accumulator
+            if (instr->size == 8)
+                x86_encode_u8(code, 0x48);
+            x86_encode_u8(code, ext * 8 + 0x05);
+            x86_encode_u32(code, src.value);
+        }
+        else if (src.kind == X86_OPERAND_imm)
+        {
+            x86_encode_op_rm(code, instr->size, x86_fits_i8(src.value) ? 0x83 : 0x81, ext, dst, relocs);
+            if (x86_fits_i8(src.value))
+                x86_encode_u8(code, (uint8_t)src.value);
+            else
+                x86_encode_u32(code, src.value);
+        }
+        else if (src.kind == X86_OPERAND_reg)
+            x86_encode_op_rm(code, instr->size, ext * 8 + 0x01, src.reg, dst, relocs);
+        else if (dst.kind == X86_OPERAND_reg)
+            x86_encode_op_rm(code, instr->size, ext * 8 + 0x03, dst.reg, src, relocs);
+        else
+            break;
+        return true;
+    }
+    case X86_imul:
+        if (dst.kind != X86_OPERAND_reg)
+            break;
+        if (src.kind == X86_OPERAND_imm)
+        {
+            x86_encode_op_rm(code, instr->size, x86_fits_i8(src.value) ? 0x6b : 0x69, dst.reg, dst, relocs);
+            if (x86_fits_i8(src.value))
+                x86_encode_u8(code, (uint8_t)src.value);
+            else
+                x86_encode_u32(code, src.value);
         }
-        nob_sb_appendf(output, "\n");
+        else
+            x86_encode_op_rm(code, instr->size, 0x0faf, dst.reg, src, relocs);
+        return true;
+    case X86_shl:
+    case X86_sar:
+        if (src.kind != X86_OPERAND_imm)
+            break;
+        x86_encode_op_rm(code, instr->size, 0xc1, instr->opcode == X86_shl ? 4 : 7, dst, relocs);
+        x86_encode_u8(code, (uint8_t)src.value);
+        return true;
+    case X86_movsx:
+        if (dst.kind != X86_OPERAND_reg)
+            break;
+        x86_encode_op_rm(code, 8, 0x63, dst.reg, src, relocs);
+        return true;
+    case X86_cqo:
+        x86_encode_u8(code, 0x48);
+        x86_encode_u8(code, 0x99);
+        return true;
+    case X86_idiv:
+        x86_encode_op_rm(code, instr->size, 0xf7, 7, src, relocs);
+        return true;
+    case X86_inc:
+    case X86_dec:
+        x86_encode_op_rm(code, instr->size, 0xff, instr->opcode == X86_inc ? 0 : 1, dst, relocs);
+        return true;
+    case X86_test:
+        if (src.kind != X86_OPERAND_reg)
+            break;
+        x86_encode_op_rm(code, instr->size, 0x85, src.reg, dst, relocs);
+        return true;
+    case X86_setcc:
+        x86_encode_op_rm(code, 1, 0x0f90 + instr->cc, 0, dst, relocs);
+        return true;
+    case X86_jcc:
+    case X86_jmp:
+    case X86_call:
+    {
+        if (instr->opcode == X86_jcc)
+        {
+            x86_encode_u8(code, 0x0f);
+            x86_encode_u8(code, 0x80 + instr->cc);
+        }
+        else
+            x86_encode_u8(code, instr->opcode == X86_jmp ? 0xe9 : 0xe8);
+        x86_reloc reloc = {.offset = code->count, .symbol = dst.value, .addend = -4, .type = X86_RELOC_branch};
+        if (dst.kind == X86_OPERAND_label)
+            nob_da_append(label_fixups, reloc);
+        else
+            nob_da_append(relocs, reloc);
+        x86_encode_u32(code, 0);
+        return true;
     }
-    return true;
+    case X86_push:
+    case X86_pop:
+        if (src.reg >= 8)
+            x86_encode_u8(code, 0x41);
+        x86_encode_u8(code, (instr->opcode == X86_push ? 0x50 : 0x58) + (src.reg & 7));
+        return true;
+    case X86_lea:
+        if (dst.kind != X86_OPERAND_reg)
+            break;
+        x86_encode_op_rm(code, instr->size, 0x8d, dst.reg, src, relocs);
+        return true;
+    case X86_leave:
+        x86_encode_u8(code, 0xc9);
+        return true;
+    case X86_ret:
+        x86_encode_u8(code, 0xc3);
+        return true;
+    case X86_syscall:
+        x86_encode_u8(code, 0x0f);
+        x86_encode_u8(code, 0x05);
+        return true;
+    }
+    fprintf(stderr, "Unreachable! Unable to encode x86-64 instruction %d\n", instr->opcode);
+    return false;
 }
 
-bool compile_x86_64_macos_file_header(Nob_String_Builder *output)
+bool x86_encode_instr(x86_instr *instr, size_t *labels, Nob_String_Builder *code, x86_relocs *label_fixups, x86_relocs *relocs)
 {
-    nob_sb_appendf(output, "    .globl _main\n");
+    size_t first_reloc = relocs->count;
+    if (!x86_encode_instr_operands(instr, labels, code, label_fixups, relocs))
+        return false;
+    // %rip is the address of the next instruction, which may come after an immediate
+    for (size_t i = first_reloc; i < relocs->count; i++)
+    {
+        if (relocs->items[i].type == X86_RELOC_data)
+            relocs->items[i].addend = -(int32_t)(code->count - relocs->items[i].offset);
+    }
     return true;
 }
 
-bool compile_x86_64_macos_file_footer()
+// Appends the machine code of `function` to `code`. Local jumps are resolved, everything else is left in `relocs`
+bool encode_x86_64_function(x86_function *function, Nob_String_Builder *code, x86_relocs *relocs)
 {
-    return true;
+    size_t labels_count = 0;
+    for (size_t i = 0; i < function->instrs.count; i++)
+    {
+        x86_instr *instr = function->instrs.items + i;
+        if (instr->opcode == X86_label && (size_t)instr->dst.value >= labels_count)
+            labels_count = instr->dst.value + 1;
+    }
+    x86_relocs label_fixups = {0};
+    size_t *labels = calloc(labels_count + 1, sizeof(size_t));
+    bool result = true;
+    for (size_t i = 0; i < function->instrs.count && result; i++)
+    {
+        result = x86_encode_instr(function->instrs.items + i, labels, code, &label_fixups, relocs);
+    }
+    for (size_t i = 0; i < label_fixups.count && result; i++)
+    {
+        x86_reloc *fixup = label_fixups.items + i;
+        x86_patch_u32(code, fixup->offset, labels[fixup->symbol] + fixup->addend - fixup->offset);
+    }
+    free(labels);
+    nob_da_free(label_fixups);
+    return result;
 }
 
-bool compile_x86_64_macos_statement(spy_op_stmt *op, Nob_String_Builder *output)
+/*
+    JIT
+*/
+
+bool run_jit(spy_ops *ops, int *exit_code)
 {
-    switch (op->type)
-    {
-    case SPY_OP_assign:
-    case SPY_OP_declare_assign:
+    x86_module module = {0};
+    Nob_String_Builder code = {0};
+    x86_relocs relocs = {0};
+    size_t *function_offsets = NULL;
+    size_t *symbol_targets = NULL;
+    void *memory = MAP_FAILED;
+    size_t memory_size = 0;
+    bool result = false;
+
+    if (!compile_x86_64_module(ops, false, &module))
+        goto defer;
+    int64_t main_index = x86_module_function(&module, spy_op_name_index(&module.symbols, "main"));
+    if (main_index < 0)
     {
-        spy_op_assign *assign = &op->data.assign;
-        spy_op_term *term = &assign->term;
-        switch (term->type)
-        {
-        case SPY_OP_TERM_intlit:
-            nob_sb_appendf(output, "    movl $%ld, -%ld(%%rbp)\n", term->data.intlit, assign->var_index * 4);
-            break;
-        case SPY_OP_TERM_var:
-            nob_sb_appendf(output, "    movl -%ld(%%rbp), %%eax\n", term->data.var_index * 4);
-            nob_sb_appendf(output, "    movl %%eax, -%ld(%%rbp)\n", assign->var_index * 4);
-            break;
-        }
-        break;
+        fprintf(stderr, "ERROR: Program does not contain a main function (no entry point).\n");
+        goto defer;
     }
-    case SPY_OP_assign_binop:
-    case SPY_OP_declare_assign_binop:
+    function_offsets = malloc(module.functions.count * sizeof(size_t));
+    for (size_t i = 0; i < module.functions.count; i++)
     {
-        spy_op_assign_binop *assign = &op->data.assign_binop;
-        // spy_op_term *term = &assign->term;
-        switch (assign->lhs.type)
-        {
-        case SPY_OP_TERM_intlit:
-            nob_sb_appendf(output, "    movl $%ld, %%eax\n", assign->lhs.data.intlit);
-            break;
-        case SPY_OP_TERM_var:
-            nob_sb_appendf(output, "    movl -%ld(%%rbp), %%eax\n", assign->lhs.data.var_index * 4);
-            break;
-        }
-        switch (assign->type)
-        {
-        case SPY_OP_EXPR_BINOP_add:
-        {
-            switch (assign->rhs.type)
-            {
-            case SPY_OP_TERM_intlit:
-                nob_sb_appendf(output, "    addl $%ld, %%eax\n", assign->rhs.data.intlit);
-                break;
-            case SPY_OP_TERM_var:
-                nob_sb_appendf(output, "    addl -%ld(%%rbp), %%eax\n", assign->rhs.data.var_index * 4);
-                break;
-            }
-            break;
-        }
-        case SPY_OP_EXPR_BINOP_sub:
-        {
-            switch (assign->rhs.type)
-            {
-            case SPY_OP_TERM_intlit:
-                nob_sb_appendf(output, "    subl $%ld, %%eax\n", assign->rhs.data.intlit);
-                break;
-            case SPY_OP_TERM_var:
-                nob_sb_appendf(output, "    subl -%ld(%%rbp), %%eax\n", assign->rhs.data.var_index * 4);
-                break;
-            }
-            break;
-        }
-        case SPY_OP_EXPR_BINOP_mul:
-        {
-            switch (assign->rhs.type)
-            {
-            case SPY_OP_TERM_intlit:
-                nob_sb_appendf(output, "    imull $%ld, %%eax\n", assign->rhs.data.intlit);
-                break;
-            case SPY_OP_TERM_var:
-                nob_sb_appendf(output, "    imull -%ld(%%rbp), %%eax\n", assign->rhs.data.var_index * 4);
-                break;
-            }
-            break;
-        }
-        case SPY_OP_EXPR_BINOP_lt:
-        case SPY_OP_EXPR_BINOP_gt:
-        case SPY_OP_EXPR_BINOP_lte:
-        case SPY_OP_EXPR_BINOP_gte:
-        case SPY_OP_EXPR_BINOP_eq:
-        case SPY_OP_EXPR_BINOP_neq:
-        {
-            // Use ecx as temporary register, not ebx, because ebx causes segfault on my machine.
-            nob_sb_appendf(output, "    xor %%ecx,  %%ecx\n");
-            switch (assign->rhs.type)
-            {
-            case SPY_OP_TERM_intlit:
-                nob_sb_appendf(output, "    cmp $%ld, %%eax\n", assign->rhs.data.intlit);
-                break;
-            case SPY_OP_TERM_var:
-                nob_sb_appendf(output, "    cmp -%ld(%%rbp), %%eax\n", assign->rhs.data.var_index * 4);
-                break;
-            }
-            switch (assign->type)
-            {
-            case SPY_OP_EXPR_BINOP_add:
-            case SPY_OP_EXPR_BINOP_sub:
-            case SPY_OP_EXPR_BINOP_mul:
-            case SPY_OP_EXPR_BINOP_lt:
-                nob_sb_appendf(output, "    setl %%cl\n");
-                break;
-            case SPY_OP_EXPR_BINOP_gt:
-                nob_sb_appendf(output, "    setg %%cl\n");
-                break;
-            case SPY_OP_EXPR_BINOP_lte:
-                nob_sb_appendf(output, "    setle %%cl\n");
-                break;
-            case SPY_OP_EXPR_BINOP_gte:
-                nob_sb_appendf(output, "    setge %%cl\n");
-                break;
-            case SPY_OP_EXPR_BINOP_eq:
-                nob_sb_appendf(output, "    sete %%cl\n");
-                break;
-            case SPY_OP_EXPR_BINOP_neq:
-                nob_sb_appendf(output, "    setne %%cl\n");
-                break;
-            }
-            nob_sb_appendf(output, "    movl %%ecx, %%eax\n");
-            break;
-        }
-        }
-        nob_sb_appendf(output, "    movl %%eax, -%ld(%%rbp)\n", assign->var_index * 4);
-        break;
+        function_offsets[i] = code.count;
+        if (!encode_x86_64_function(module.functions.items + i, &code, &relocs))
+            goto defer;
     }
-    case SPY_OP_func_call:
+
+    symbol_targets = malloc(module.symbols.count * sizeof(size_t));
+    for (size_t i = 0; i < module.symbols.count; i++)
     {
-        spy_op_func_call func_call = op->data.func_call;
-        if (func_call.args.count == 1)
-        {
-            switch (func_call.args.items[0].type)
-            {
-            case SPY_OP_TERM_intlit:
-                nob_sb_appendf(output, "    movl $%ld, %%edi\n", func_call.args.items[0].data.intlit);
-                break;
-            case SPY_OP_TERM_var:
-                nob_sb_appendf(output, "    movl -%ld(%%rbp), %%edi\n", func_call.args.items[0].data.var_index * 4);
-                break;
-            }
-        }
-        else if (func_call.args.count > 1)
+        int64_t function = x86_module_function(&module, i);
+        int64_t data = x86_module_data(&module, i);
+        if (function >= 0)
         {
-            fprintf(stderr, "Comiling function calls with more than 1 argument on `x86-64-macos` is not supported yet!\n");
-            return false;
+            symbol_targets[i] = function_offsets[function];
+            continue;
         }
-        if (str_eq(func_call.name, "putchar"))
+        if (data >= 0)
         {
-            nob_sb_appendf(output, "    call _putchar\n");
+            // Only read only data is emitted without the static runtime, and the code is readable
+            symbol_targets[i] = code.count;
+            nob_sb_append_buf(&code, module.datas.items[data].bytes, module.datas.items[data].size);
+            continue;
         }
+        void *address = NULL;
+        if (str_eq(module.symbols.items[i], "putchar"))
+            address = (void *)&putchar;
+        else if (str_eq(module.symbols.items[i], "printf"))
+            address = (void *)&printf;
         else
         {
-            nob_sb_appendf(output, "    call %s\n", func_call.name);
+            fprintf(stderr, "ERROR: Undefined function `%s`.\n", module.symbols.items[i]);
+            goto defer;
         }
+        // libc may be further away than a rel32 reaches, so calls go through `jmp *0(%rip)`
+        while (code.count % 8 != 2)
+            x86_encode_u8(&code, 0xcc);
+        symbol_targets[i] = code.count;
+        x86_encode_u8(&code, 0xff);
+        x86_encode_u8(&code, 0x25);
+        x86_encode_u32(&code, 0);
+        uint64_t libc_address = (uint64_t)(uintptr_t)address;
+        nob_sb_append_buf(&code, &libc_address, sizeof libc_address);
+    }
 
-        break;
+    for (size_t i = 0; i < relocs.count; i++)
+    {
+        x86_reloc *reloc = relocs.items + i;
+        x86_patch_u32(&code, reloc->offset, symbol_targets[reloc->symbol] + reloc->addend - reloc->offset);
     }
-    case SPY_OP_jump:
-        nob_sb_appendf(output, "    jmp label_%zu\n", op->data.jump.index);
-        break;
-    case SPY_OP_conditional_jump:
-        nob_sb_appendf(output, "    cmp $0, %%rax\n");
-        nob_sb_appendf(output, "    je label_%zu\n", op->data.jump.index);
-        break;
-    case SPY_OP_block_mark_start:
-    case SPY_OP_block_mark_end:
-        nob_sb_appendf(output, "label_%zu:\n", op->data.jump.index);
-        break;
+
+    // Never writable and executable at the same time
+    long page_size = sysconf(_SC_PAGESIZE);
+    memory_size = (code.count + page_size - 1) / page_size * page_size;
+    memory = mmap(NULL, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: Unable to map memory for the JIT: %s\n", strerror(errno));
+        goto defer;
     }
-    return true;
+    memcpy(memory, code.items, code.count);
+    if (mprotect(memory, memory_size, PROT_READ | PROT_EXEC) != 0)
+    {
+        fprintf(stderr, "ERROR: Unable to make JIT code executable: %s\n", strerror(errno));
+        goto defer;
+    }
+
+    int (*entry)(void) = (int (*)(void))((uint8_t *)memory + function_offsets[main_index]);
+    *exit_code = entry();
+    fflush(stdout);
+    result = true;
+defer:
+    if (memory != MAP_FAILED)
+        munmap(memory, memory_size);
+    free(function_offsets);
+    free(symbol_targets);
+    nob_da_free(relocs);
+    nob_sb_free(code);
+    x86_module_free(&module);
+    return result;
+}
+
+/*
+    ELF64 OBJECT
+*/
+
+// Only what a relocatable x86-64 object needs. Fields are written in host byte order,
+// which is little endian on every host we run on.
+
+#define ELF_SHT_PROGBITS 1
+#define ELF_SHT_SYMTAB 2
+#define ELF_SHT_STRTAB 3
+#define ELF_SHT_RELA 4
+#define ELF_SHT_NOBITS 8
+#define ELF_SHF_WRITE 0x1
+#define ELF_SHF_ALLOC 0x2
+#define ELF_SHF_EXECINSTR 0x4
+#define ELF_SHF_INFO_LINK 0x40
+#define ELF_STB_LOCAL 0
+#define ELF_STB_GLOBAL 1
+#define ELF_STT_NOTYPE 0
+#define ELF_STT_OBJECT 1
+#define ELF_STT_FUNC 2
+#define ELF_STT_SECTION 3
+#define ELF_R_X86_64_PC32 2
+#define ELF_R_X86_64_PLT32 4
+
+typedef struct
+{
+    uint8_t ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint64_t entry;
+    uint64_t phoff;
+    uint64_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} elf64_header;
+
+typedef struct
+{
+    uint32_t name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t addr;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t link;
+    uint32_t info;
+    uint64_t addralign;
+    uint64_t entsize;
+} elf64_section;
+
+typedef struct
+{
+    uint32_t name;
+    uint8_t info;
+    uint8_t other;
+    uint16_t shndx;
+    uint64_t value;
+    uint64_t size;
+} elf64_symbol;
+
+typedef struct
+{
+    uint64_t offset;
+    uint64_t info;
+    int64_t addend;
+} elf64_rela;
+
+static_assert(sizeof(elf64_header) == 64, "ELF64 header is 64 bytes");
+static_assert(sizeof(elf64_section) == 64, "ELF64 section header is 64 bytes");
+static_assert(sizeof(elf64_symbol) == 24, "ELF64 symbol is 24 bytes");
+static_assert(sizeof(elf64_rela) == 24, "ELF64 relocation is 24 bytes");
+
+enum elf_section_index
+{
+    ELF_SECTION_null,
+    ELF_SECTION_text,
+    ELF_SECTION_rela_text,
+    ELF_SECTION_rodata,
+    ELF_SECTION_bss,
+    ELF_SECTION_symtab,
+    ELF_SECTION_strtab,
+    ELF_SECTION_shstrtab,
+    ELF_SECTION_note_gnu_stack,
+    ELF_SECTION_COUNT,
+};
+
+void elf_align(Nob_String_Builder *output, size_t alignment)
+{
+    while (output->count % alignment != 0)
+        nob_da_append(output, '\0');
+}
+
+uint32_t elf_append_string(Nob_String_Builder *strings, char *string)
+{
+    uint32_t offset = strings->count;
+    nob_sb_append_buf(strings, string, strlen(string) + 1);
+    return offset;
 }
 
-bool compile_x86_64_macos_function_body(spy_op_function *ops, Nob_String_Builder *output)
+bool compile_elf_object(spy_ops *ops, bool static_runtime, Nob_String_Builder *output)
 {
-    if (str_eq(ops->name, "main"))
+    x86_module module = {0};
+    Nob_String_Builder text = {0};
+    Nob_String_Builder rodata = {0};
+    Nob_String_Builder strtab = {0};
+    Nob_String_Builder shstrtab = {0};
+    x86_relocs relocs = {0};
+    size_t *function_offsets = NULL;
+    size_t *function_sizes = NULL;
+    size_t *data_offsets = NULL;
+    uint32_t *elf_symbols = NULL;
+    struct
     {
-        nob_sb_appendf(output, "_%s:\n", ops->name);
+        elf64_symbol *items;
+        size_t count;
+        size_t capacity;
+    } symbols = {0};
+    bool result = false;
+
+    if (!compile_x86_64_module(ops, static_runtime, &module))
+        goto defer;
+    function_offsets = malloc(module.functions.count * sizeof(size_t));
+    function_sizes = malloc(module.functions.count * sizeof(size_t));
+    for (size_t i = 0; i < module.functions.count; i++)
+    {
+        // Pad between functions with int3
+        while (text.count % 16 != 0)
+            nob_da_append(&text, (char)0xcc);
+        function_offsets[i] = text.count;
+        if (!encode_x86_64_function(module.functions.items + i, &text, &relocs))
+            goto defer;
+        function_sizes[i] = text.count - function_offsets[i];
     }
-    else
+    size_t bss_size = 0;
+    data_offsets = malloc(module.datas.count * sizeof(size_t) + 1);
+    for (size_t i = 0; i < module.datas.count; i++)
     {
-        nob_sb_appendf(output, "%s:\n", ops->name);
+        x86_data *data = module.datas.items + i;
+        switch (data->section)
+        {
+        case X86_DATA_bss:
+            bss_size = (bss_size + 7) & ~(size_t)7;
+            data_offsets[i] = bss_size;
+            bss_size += data->size;
+            break;
+        case X86_DATA_rodata:
+            data_offsets[i] = rodata.count;
+            nob_sb_append_buf(&rodata, data->bytes, data->size);
+            break;
+        }
     }
-    nob_sb_appendf(output, "    push %%rbp\n");
-    for (size_t i = 0; i < ops->stmts.count; i++)
+
+    // Relocations only name what is referenced, `main` and the data need an index too
+    for (size_t i = 0; i < module.functions.count; i++)
+        spy_op_name_index(&module.symbols, module.functions.items[i].name);
+    for (size_t i = 0; i < module.datas.count; i++)
+        spy_op_name_index(&module.symbols, module.datas.items[i].name);
+
+    // Locals have to come before globals. Only the global functions are exported, like in the assembly output
+    elf_symbols = calloc(module.symbols.count, sizeof(uint32_t));
+    elf_append_string(&strtab, "");
+    elf64_symbol null_symbol = {0};
+    nob_da_append(&symbols, null_symbol);
+    elf64_symbol text_symbol = {.info = ELF_STB_LOCAL << 4 | ELF_STT_SECTION, .shndx = ELF_SECTION_text};
+    nob_da_append(&symbols, text_symbol);
+    uint32_t first_global = 0;
+    for (int binding = ELF_STB_LOCAL; binding <= ELF_STB_GLOBAL; binding++)
     {
-        spy_op_stmt *op = ops->stmts.items + i;
-        if (!compile_x86_64_macos_statement(op, output))
-            return false;
+        if (binding == ELF_STB_GLOBAL)
+            first_global = symbols.count;
+        for (size_t i = 0; i < module.functions.count; i++)
+        {
+            x86_function *function = module.functions.items + i;
+            if ((function->global ? ELF_STB_GLOBAL : ELF_STB_LOCAL) != binding)
+                continue;
+            elf64_symbol symbol = {
+                .name = elf_append_string(&strtab, function->name),
+                .info = binding << 4 | ELF_STT_FUNC,
+                .shndx = ELF_SECTION_text,
+                .value = function_offsets[i],
+                .size = function_sizes[i],
+            };
+            elf_symbols[spy_op_name_index(&module.symbols, function->name)] = symbols.count;
+            nob_da_append(&symbols, symbol);
+        }
+        for (size_t i = 0; i < module.datas.count && binding == ELF_STB_LOCAL; i++)
+        {
+            x86_data *data = module.datas.items + i;
+            elf64_symbol symbol = {
+                .name = elf_append_string(&strtab, data->name),
+                .info = ELF_STB_LOCAL << 4 | ELF_STT_OBJECT,
+                .shndx = data->section == X86_DATA_bss ? ELF_SECTION_bss : ELF_SECTION_rodata,
+                .value = data_offsets[i],
+                .size = data->size,
+            };
+            elf_symbols[spy_op_name_index(&module.symbols, data->name)] = symbols.count;
+            nob_da_append(&symbols, symbol);
+        }
+    }
+    for (size_t i = 0; i < relocs.count; i++)
+    {
+        // Whatever is not defined here, like putchar, is left to the linker
+        uint32_t symbol = relocs.items[i].symbol;
+        if (elf_symbols[symbol] != 0)
+            continue;
+        elf64_symbol undefined = {
+            .name = elf_append_string(&strtab, module.symbols.items[symbol]),
+            .info = ELF_STB_GLOBAL << 4 | ELF_STT_NOTYPE,
+        };
+        elf_symbols[symbol] = symbols.count;
+        nob_da_append(&symbols, undefined);
     }
-    // TODO proper return
-    nob_sb_appendf(output, "    movl $0, %%eax\n");
-    nob_sb_appendf(output, "    pop %%rbp\n");
-    nob_sb_appendf(output, "    ret\n");
-    return true;
-}
 
-bool compile_x86_64_macos(spy_ops *ops, Nob_String_Builder *output)
-{
-    if (!compile_x86_64_macos_file_header(output))
-        return false;
-    for (size_t i = 0; i < ops->count; i++)
+    elf64_section sections[ELF_SECTION_COUNT] = {0};
+    elf_append_string(&shstrtab, "");
+    sections[ELF_SECTION_text] = (elf64_section){
+        .name = elf_append_string(&shstrtab, ".text"),
+        .type = ELF_SHT_PROGBITS,
+        .flags = ELF_SHF_ALLOC | ELF_SHF_EXECINSTR,
+        .size = text.count,
+        .addralign = 16,
+    };
+    sections[ELF_SECTION_rela_text] = (elf64_section){
+        .name = elf_append_string(&shstrtab, ".rela.text"),
+        .type = ELF_SHT_RELA,
+        .flags = ELF_SHF_INFO_LINK,
+        .size = relocs.count * sizeof(elf64_rela),
+        .link = ELF_SECTION_symtab,
+        .info = ELF_SECTION_text,
+        .addralign = 8,
+        .entsize = sizeof(elf64_rela),
+    };
+    sections[ELF_SECTION_rodata] = (elf64_section){
+        .name = elf_append_string(&shstrtab, ".rodata"),
+        .type = ELF_SHT_PROGBITS,
+        .flags = ELF_SHF_ALLOC,
+        .size = rodata.count,
+        .addralign = 1,
+    };
+    sections[ELF_SECTION_bss] = (elf64_section){
+        .name = elf_append_string(&shstrtab, ".bss"),
+        .type = ELF_SHT_NOBITS,
+        .flags = ELF_SHF_ALLOC | ELF_SHF_WRITE,
+        .size = bss_size,
+        .addralign = 8,
+    };
+    sections[ELF_SECTION_symtab] = (elf64_section){
+        .name = elf_append_string(&shstrtab, ".symtab"),
+        .type = ELF_SHT_SYMTAB,
+        .size = symbols.count * sizeof(elf64_symbol),
+        .link = ELF_SECTION_strtab,
+        .info = first_global,
+        .addralign = 8,
+        .entsize = sizeof(elf64_symbol),
+    };
+    sections[ELF_SECTION_strtab] = (elf64_section){
+        .name = elf_append_string(&shstrtab, ".strtab"),
+        .type = ELF_SHT_STRTAB,
+        .size = strtab.count,
+        .addralign = 1,
+    };
+    // Without it linkers assume the object needs an executable stack
+    sections[ELF_SECTION_note_gnu_stack] = (elf64_section){
+        .name = elf_append_string(&shstrtab, ".note.GNU-stack"),
+        .type = ELF_SHT_PROGBITS,
+        .addralign = 1,
+    };
+    sections[ELF_SECTION_shstrtab] = (elf64_section){
+        .name = elf_append_string(&shstrtab, ".shstrtab"),
+        .type = ELF_SHT_STRTAB,
+        .size = shstrtab.count,
+        .addralign = 1,
+    };
+
+    elf64_header header = {
+        .ident = {0x7f, 'E', 'L', 'F', 2 /* 64 bit */, 1 /* little endian */, 1 /* version */},
+        .type = 1, // Relocatable
+        .machine = 62, // x86-64
+        .version = 1,
+        .ehsize = sizeof(elf64_header),
+        .shentsize = sizeof(elf64_section),
+        .shnum = ELF_SECTION_COUNT,
+        .shstrndx = ELF_SECTION_shstrtab,
+    };
+    nob_sb_append_buf(output, &header, sizeof header);
+
+    elf_align(output, 16);
+    sections[ELF_SECTION_text].offset = output->count;
+    nob_sb_append_buf(output, text.items, text.count);
+
+    elf_align(output, 8);
+    sections[ELF_SECTION_rela_text].offset = output->count;
+    for (size_t i = 0; i < relocs.count; i++)
     {
-        if (!compile_x86_64_macos_function_body(&ops->items[i], output))
-            return false;
+        x86_reloc *reloc = relocs.items + i;
+        elf64_rela rela = {
+            .offset = reloc->offset,
+            .info = (uint64_t)elf_symbols[reloc->symbol] << 32 | (reloc->type == X86_RELOC_branch ? ELF_R_X86_64_PLT32 : ELF_R_X86_64_PC32),
+            .addend = reloc->addend,
+        };
+        nob_sb_append_buf(output, &rela, sizeof rela);
     }
-    if (!compile_x86_64_macos_file_footer())
-        return false;
-    return true;
+    sections[ELF_SECTION_rodata].offset = output->count;
+    if (rodata.count > 0)
+        nob_sb_append_buf(output, rodata.items, rodata.count);
+    sections[ELF_SECTION_bss].offset = output->count;
+
+    sections[ELF_SECTION_symtab].offset = output->count;
+    nob_sb_append_buf(output, symbols.items, symbols.count * sizeof(elf64_symbol));
+
+    sections[ELF_SECTION_strtab].offset = output->count;
+    nob_sb_append_buf(output, strtab.items, strtab.count);
+    sections[ELF_SECTION_note_gnu_stack].offset = output->count;
+    sections[ELF_SECTION_shstrtab].offset = output->count;
+    nob_sb_append_buf(output, shstrtab.items, shstrtab.count);
+
+    elf_align(output, 8);
+    header.shoff = output->count;
+    memcpy(output->items + offsetof(elf64_header, shoff), &header.shoff, sizeof header.shoff);
+    nob_sb_append_buf(output, sections, sizeof sections);
+    result = true;
+defer:
+    free(function_offsets);
+    free(function_sizes);
+    free(data_offsets);
+    free(elf_symbols);
+    nob_da_free(symbols);
+    nob_da_free(relocs);
+    nob_sb_free(text);
+    nob_sb_free(rodata);
+    nob_sb_free(strtab);
+    nob_sb_free(shstrtab);
+    x86_module_free(&module);
+    return result;
 }
 
-bool compile(spy_ops *ops, Nob_String_Builder *output, enum spy_output_target target)
+bool compile(spy_ops *ops, spy_writer *writer, enum spy_output_target target, bool static_runtime)
 {
+    // The binary formats patch offsets into their headers and are written in one go
     switch (target)
     {
     case SPY_OUTPUT_TARGET_x86_64_macos:
-        return compile_x86_64_macos(ops, output);
+        return compile_x86_64_macos(ops, writer);
+    case SPY_OUTPUT_TARGET_x86_64_linux:
+        return compile_x86_64_linux(ops, static_runtime, writer);
     case SPY_OUTPUT_TARGET_dump_ir:
-        return compile_dump_ir(ops, output);
+        return compile_dump_ir(ops, writer);
     case SPY_OUTPUT_TARGET_aarch64_mac_m1:
-        fprintf(stderr, "Target `aarch64-mac-m1` is not supported yet!\n");
-        return false;
+    case SPY_OUTPUT_TARGET_aarch64_linux:
+        return compile_aarch64(target, ops, writer);
     case SPY_OUTPUT_TARGET_python311:
-        return compile_python311(ops, output);
+        return compile_python311(ops, writer);
+    case SPY_OUTPUT_TARGET_c:
+        return compile_c(ops, writer);
+    case SPY_OUTPUT_TARGET_llvm:
+        return compile_llvm(ops, writer);
+    case SPY_OUTPUT_TARGET_pyc311:
+        return compile_pyc311(ops, &writer->buffer);
     case SPY_OUTPUT_TARGET_dump_lexer:
         fprintf(stderr, "Unreachable! Target `lexer` should not call compile!\n");
         return false;
+    case SPY_OUTPUT_TARGET_spyir:
+        return compile_spyir(ops, &writer->buffer);
+    case SPY_OUTPUT_TARGET_run:
+    case SPY_OUTPUT_TARGET_jit:
+        fprintf(stderr, "Unreachable! Targets `run` and `jit` should not call compile!\n");
+        return false;
+    case SPY_OUTPUT_TARGET_spyc:
+        return compile_spyc(ops, &writer->buffer);
     }
     return true;
 }
@@ -1564,6 +9038,7 @@ void default_output_path(char *input_path, enum spy_output_target target, Nob_St
     switch (target)
     {
     case SPY_OUTPUT_TARGET_x86_64_macos:
+    case SPY_OUTPUT_TARGET_x86_64_linux:
         nob_sb_append_cstr(output, ".s");
         break;
     case SPY_OUTPUT_TARGET_dump_ir:
@@ -1571,11 +9046,31 @@ void default_output_path(char *input_path, enum spy_output_target target, Nob_St
         nob_sb_append_cstr(output, ".txt");
         break;
     case SPY_OUTPUT_TARGET_aarch64_mac_m1:
+    case SPY_OUTPUT_TARGET_aarch64_linux:
         nob_sb_append_cstr(output, ".s");
         break;
     case SPY_OUTPUT_TARGET_python311:
         nob_sb_append_cstr(output, ".py");
         break;
+    case SPY_OUTPUT_TARGET_c:
+        nob_sb_append_cstr(output, ".c");
+        break;
+    case SPY_OUTPUT_TARGET_llvm:
+        nob_sb_append_cstr(output, ".ll");
+        break;
+    case SPY_OUTPUT_TARGET_pyc311:
+        nob_sb_append_cstr(output, ".pyc");
+        break;
+    case SPY_OUTPUT_TARGET_spyir:
+        nob_sb_append_cstr(output, ".spyir");
+        break;
+    case SPY_OUTPUT_TARGET_run:
+    case SPY_OUTPUT_TARGET_jit:
+        // Nothing is written
+        break;
+    case SPY_OUTPUT_TARGET_spyc:
+        nob_sb_append_cstr(output, ".spyc");
+        break;
     }
     nob_sb_append_null(output);
 }
@@ -1603,6 +9098,12 @@ int main(int argc, char **argv)
 {
     char **output_path = flag_str("o", NULL, "Path to the output file (MANDATORY)");
     char **output_target = flag_str("target", NULL, "Target compilation output");
+    bool *opt_O0 = flag_bool("O0", false, "Do not optimise");
+    bool *opt_O1 = flag_bool("O1", false, "Optimise (default)");
+    bool *opt_O2 = flag_bool("O2", false, "Optimise more, even if the code gets bigger");
+    bool *opt_Os = flag_bool("Os", false, "Optimise for code size");
+    bool *pass_stats = flag_bool("pass-stats", false, "Print the time and IR size after every optimisation pass");
+    bool *static_runtime = flag_bool("static-runtime", false, "x86-64-linux: Use a built in runtime instead of libc, link with `-nostdlib -static`");
 
     char *file_path = NULL;
     while (argc > 0)
@@ -1633,15 +9134,54 @@ int main(int argc, char **argv)
         fprintf(stderr, "ERROR: No input path was provided\n");
         return 1;
     }
+    bool is_spyc = nob_sv_end_with(nob_sv_from_cstr(file_path), ".spyc");
     if (*output_target == NULL)
     {
-        output_target = &TARGET_STRINGS[0];
+        // Bytecode can only be run
+        output_target = is_spyc ? &TARGET_STRINGS[SPY_OUTPUT_TARGET_run] : &TARGET_STRINGS[0];
     }
 
     enum spy_output_target target = get_target(*output_target);
     if (target < 0)
         return 1;
 
+    if (*static_runtime && target != SPY_OUTPUT_TARGET_x86_64_linux)
+    {
+        usage();
+        fprintf(stderr, "ERROR: -static-runtime is only supported by target `x86-64-linux`\n");
+        return 1;
+    }
+
+    if (*opt_O0 + *opt_O1 + *opt_O2 + *opt_Os > 1)
+    {
+        usage();
+        fprintf(stderr, "ERROR: Only one of -O0, -O1, -O2 and -Os can be given\n");
+        return 1;
+    }
+    enum spy_opt_level opt_level = SPY_OPT_LEVEL_O1;
+    if (*opt_O0)
+        opt_level = SPY_OPT_LEVEL_O0;
+    else if (*opt_O2)
+        opt_level = SPY_OPT_LEVEL_O2;
+    else if (*opt_Os)
+        opt_level = SPY_OPT_LEVEL_Os;
+
+    if (is_spyc)
+    {
+        if (target != SPY_OUTPUT_TARGET_run)
+        {
+            fprintf(stderr, "ERROR: A .spyc file can only be used with target `run`\n");
+            return 1;
+        }
+        spy_bc_module module = {0};
+        int exit_code = 1;
+        if (load_spyc(file_path, &module) && !run_bytecode(&module, &exit_code))
+            exit_code = 1;
+        nob_da_free(module.functions);
+        nob_sb_free(module.code);
+        return exit_code;
+    }
+
     Nob_String_Builder default_output_path_sb = {0};
     if (*output_path == NULL)
     {
@@ -1650,64 +9190,124 @@ int main(int argc, char **argv)
     }
 
     Nob_String_Builder sb = {0};
-
-    if (!nob_read_entire_file(file_path, &sb))
-    {
-        fprintf(stderr, "Unable to read file `%s`.\n", file_path);
-        return 1;
-    }
+    spy_ir_file ir_file = {0};
 
     stb_lexer lexer = {0};
     char string_store[1024];
 
-    p_lexer_init(&lexer, sb.items, sb.items + sb.count, string_store, sizeof string_store);
-
-    Nob_String_Builder output = {0};
+    spy_writer writer = {.fd = -1};
 
     spy_vars vars = {0};
     spy_funcs funcs = {0};
 
     spy_ops ops = {0};
+    spy_pass_stats stats = {0};
 
 #define free_all()                           \
     do                                       \
     {                                        \
         nob_sb_free(default_output_path_sb); \
         nob_sb_free(sb);                     \
-        nob_sb_free(output);                 \
+        spy_writer_abort(&writer);           \
         nob_da_free(vars);                   \
         nob_da_free(funcs);                  \
+        nob_da_free(ops.names);              \
         nob_da_free(ops);                    \
+        nob_da_free(stats);                  \
+        unload_spyir(&ir_file);              \
     } while (0)
 
-    if (target == SPY_OUTPUT_TARGET_dump_lexer)
+    if (nob_sv_end_with(nob_sv_from_cstr(file_path), ".spyir"))
+    {
+        // Already lowered and optimised, straight to the backend
+        if (target == SPY_OUTPUT_TARGET_dump_lexer)
+        {
+            fprintf(stderr, "ERROR: Target `lexer` needs a source file, not a .spyir file\n");
+            free_all();
+            return 1;
+        }
+        if (!load_spyir(file_path, &ir_file, &ops))
+        {
+            free_all();
+            return 1;
+        }
+    }
+    else
     {
-        dump_lexer(&lexer, file_path, &output);
-        if (!nob_write_entire_file(*output_path, output.items, output.count))
+        if (!nob_read_entire_file(file_path, &sb))
+        {
+            fprintf(stderr, "Unable to read file `%s`.\n", file_path);
+            return 1;
+        }
+
+        p_lexer_init(&lexer, sb.items, sb.items + sb.count, string_store, sizeof string_store);
+
+        if (target == SPY_OUTPUT_TARGET_dump_lexer)
+        {
+            if (!spy_writer_open(&writer, *output_path))
+            {
+                free_all();
+                return 1;
+            }
+            dump_lexer(&lexer, file_path, &writer);
+            bool written = spy_writer_close(&writer);
+            free_all();
+            return written ? 0 : 1;
+        }
+
+        if (!parse_program(&lexer, file_path, &funcs, &vars, &ops))
         {
-            fprintf(stderr, "ERROR: Unable to write to %s\n", *output_path);
+            free_all();
+            return false;
+        }
+
+        run_passes(&ops, opt_level, &stats);
+        if (*pass_stats)
+            print_pass_stats(&stats, stderr);
+    }
 
+    if (target == SPY_OUTPUT_TARGET_run)
+    {
+        int exit_code = 1;
+        if (!run_program(&ops, &exit_code))
+        {
+            free_all();
             return 1;
         }
         free_all();
-        return 0;
+        return exit_code;
     }
 
-    if (!parse_program(&lexer, file_path, &funcs, &vars, &ops))
+    if (target == SPY_OUTPUT_TARGET_jit)
     {
+        int exit_code = 1;
+        if (!run_jit(&ops, &exit_code))
+        {
+            free_all();
+            return 1;
+        }
         free_all();
-        return false;
+        return exit_code;
     }
 
-    if (!compile(&ops, &output, target))
+    bool is_object = nob_sv_end_with(nob_sv_from_cstr(*output_path), ".o");
+    if (is_object && target != SPY_OUTPUT_TARGET_x86_64_linux)
     {
+        // Only ELF objects are written, Mach-O would need its own symbol names and relocations
+        fprintf(stderr, "ERROR: Object files are ELF only, use `-target x86-64-linux`\n");
         free_all();
         return 1;
     }
 
-    if (!nob_write_entire_file(*output_path, output.items, output.count))
+    if (!spy_writer_open(&writer, *output_path))
+    {
+        free_all();
+        return 1;
+    }
+    // Skip the assembly text and the assembler for object files
+    bool compiled = is_object ? compile_elf_object(&ops, *static_runtime, &writer.buffer) : compile(&ops, &writer, target, *static_runtime);
+    if (!compiled || !spy_writer_close(&writer))
     {
-        fprintf(stderr, "ERROR: Unable to write to %s\n", *output_path);
         free_all();
         return 1;
     }
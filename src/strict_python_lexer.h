@@ -67,6 +67,7 @@ enum
     PLEX_eqarrow,
     PLEX_shleq,
     PLEX_shreq,
+    PLEX_floordiv,
     PLEX_indent,
     PLEX_deindent,
     PLEX_newline,
@@ -418,8 +419,13 @@ int p_lexer_get_token(stb_lexer *lexer)
             return p_lex_token(lexer, PLEX_muleq, p, p + 1);
         goto single_char;
     case '/':
-        if (p + 1 != lexer->eof && p[1] == '=')
-            return p_lex_token(lexer, PLEX_diveq, p, p + 1);
+        if (p + 1 != lexer->eof)
+        {
+            if (p[1] == '=')
+                return p_lex_token(lexer, PLEX_diveq, p, p + 1);
+            if (p[1] == '/')
+                return p_lex_token(lexer, PLEX_floordiv, p, p + 1);
+        }
         goto single_char;
     case '<':
         if (p + 1 != lexer->eof)
@@ -4,6 +4,8 @@ import os
 import json
 import pprint
 import argparse
+import platform
+import shutil
 
 class bcolors:
     HEADER = '\033[95m'
@@ -20,7 +22,9 @@ class bcolors:
 
 REPO_ROOT = subprocess.run(['git', 'rev-parse', '--show-toplevel'], stdout=subprocess.PIPE, stderr=subprocess.PIPE).stdout.decode().strip()
 
-SpyTarget = Literal["x86-64-macos", "aarch64-mac-m1", "python311", "ir", "lexer"]
+SpyTarget = Literal["x86-64-macos", "x86-64-linux", "x86-64-linux-static", "x86-64-linux-object", "aarch64-mac-m1", "aarch64-linux", "c", "llvm", "python311", "pyc311", "ir", "lexer", "spyir", "run", "spyc", "jit"]
+DEFAULT_TARGET: SpyTarget = "x86-64-macos"
+NATIVE_TARGETS: tuple[SpyTarget, ...] = ("x86-64-macos", "x86-64-linux", "x86-64-linux-static", "x86-64-linux-object", "aarch64-mac-m1", "aarch64-linux", "c", "llvm", "pyc311")
 
 
 class SpyResult(TypedDict):
@@ -43,22 +47,129 @@ def format_result(result: SpyResult) -> str:
     return os.linesep.join(output)
 
 
+def linker_for(target: SpyTarget) -> list[str] | None:
+    """How to link and run an executable for `target` on this machine, None if it can not be run here"""
+    if target == "x86-64-macos":
+        # Mach-O symbol names and sections, only an Intel Mac links it
+        if platform.system() == "Darwin" and platform.machine() == "x86_64":
+            return ["gcc"]
+        return None
+    if target in ("x86-64-linux", "x86-64-linux-static", "x86-64-linux-object"):
+        return ["gcc"]
+    if target == "c":
+        return ["gcc", "-O2"]
+    if target == "llvm" and shutil.which("clang") is not None:
+        return ["clang", "-O2"]
+    if target == "aarch64-mac-m1" and platform.system() == "Darwin" and platform.machine() == "arm64":
+        return ["cc"]
+    if target == "pyc311" and shutil.which("python3.11") is not None:
+        # Bytecode only loads in the exact Python version it was written for
+        return ["python3.11"]
+    if target == "aarch64-linux":
+        if platform.system() == "Linux" and platform.machine() == "aarch64":
+            return ["gcc"]
+        # Cross compiled programs run under qemu-user, static so no sysroot is needed
+        if shutil.which("aarch64-linux-gnu-gcc") is not None and shutil.which("qemu-aarch64") is not None:
+            return ["aarch64-linux-gnu-gcc", "-static"]
+    return None
+
+
 def run_spy(input_file: str, target: SpyTarget, run: bool = False) -> SpyResult:
-    should_run: bool = run and target == "x86-64-macos"
-    temp_file_name: str = 'temp_run_file.s'
+    if target == "run" or target == "jit":
+        # Compiling and running is a single step, the program writes straight to our stdout
+        run_result = subprocess.run(
+            [os.path.join(REPO_ROOT, "build", "spy"), input_file, "-target", target],
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+        )
+        return SpyResult(
+            input_file=input_file,
+            target=target,
+            comp_stdout="",
+            comp_stderr="",
+            run_stdout=run_result.stdout.decode(),
+            run_stderr=run_result.stderr.decode(),
+        )
+    if target == "spyc":
+        # Compile to bytecode, then run the bytecode
+        temp_spyc_name: str = 'temp_run_file.spyc'
+        comp_result = subprocess.run(
+            [os.path.join(REPO_ROOT, "build", "spy"), input_file, "-target", target, "-o", temp_spyc_name],
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+        )
+        run_stdout, run_stderr = "", ""
+        if comp_result.returncode == 0:
+            run_result = subprocess.run(
+                [os.path.join(REPO_ROOT, "build", "spy"), temp_spyc_name],
+                stdout=subprocess.PIPE,
+                stderr=subprocess.PIPE,
+            )
+            run_stdout, run_stderr = run_result.stdout.decode(), run_result.stderr.decode()
+            os.remove(temp_spyc_name)
+        return SpyResult(
+            input_file=input_file,
+            target=target,
+            comp_stdout=comp_result.stdout.decode(),
+            comp_stderr=comp_result.stderr.decode(),
+            run_stdout=run_stdout,
+            run_stderr=run_stderr,
+        )
+    if target == "python311" or target == "pyc311":
+        # The module runs main itself when it is the script
+        temp_py_name: str = 'temp_run_file.py' if target == "python311" else 'temp_run_file.pyc'
+        interpreter: list[str] | None = ["python3"] if target == "python311" else linker_for(target)
+        comp_result = subprocess.run(
+            [os.path.join(REPO_ROOT, "build", "spy"), input_file, "-target", target, "-o", temp_py_name],
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+        )
+        run_stdout, run_stderr = "", ""
+        if comp_result.returncode == 0 and interpreter is not None:
+            run_result = subprocess.run(
+                [*interpreter, temp_py_name],
+                stdout=subprocess.PIPE,
+                stderr=subprocess.PIPE,
+            )
+            run_stdout, run_stderr = run_result.stdout.decode(), run_result.stderr.decode()
+        if os.path.exists(temp_py_name):
+            os.remove(temp_py_name)
+        return SpyResult(
+            input_file=input_file,
+            target=target,
+            comp_stdout=comp_result.stdout.decode(),
+            comp_stderr=comp_result.stderr.decode(),
+            run_stdout=run_stdout,
+            run_stderr=run_stderr,
+        )
+    linker: list[str] | None = linker_for(target)
+    should_run: bool = run and linker is not None
+    temp_file_name: str = {"c": "temp_run_file.c", "llvm": "temp_run_file.ll", "x86-64-linux-object": "temp_run_file.o"}.get(target, "temp_run_file.s")
     args: list[str] = [os.path.join(REPO_ROOT, "build", "spy"), input_file, "-target", target]
+    link_args: list[str] = []
+    if target == "x86-64-linux-static":
+        # Same target, but with the built in runtime instead of libc
+        args = [os.path.join(REPO_ROOT, "build", "spy"), input_file, "-target", "x86-64-linux", "-static-runtime"]
+        link_args = ["-nostdlib", "-static"]
+    if target == "x86-64-linux-object":
+        # Same target, but the ELF object is written directly instead of assembly text
+        args = [os.path.join(REPO_ROOT, "build", "spy"), input_file, "-target", "x86-64-linux"]
     if should_run:
         args.append("-o")
         args.append(temp_file_name)
+    if target == "ir":
+        # The dump is the result, checking it pins down what the optimisations did
+        args.append("-o")
+        args.append("/dev/stdout")
     comp_result = subprocess.run(
         args,
         stdout=subprocess.PIPE,
         stderr=subprocess.PIPE,
     )
     if comp_result.returncode == 0 and should_run:
-        exe_name: str = temp_file_name.removesuffix(".s")
+        exe_name: str = os.path.splitext(temp_file_name)[0]
         link_result = subprocess.run(
-            ["gcc", temp_file_name, "-o", exe_name],
+            [*linker, *link_args, temp_file_name, "-o", exe_name],
             stdout=subprocess.PIPE,
             stderr=subprocess.PIPE,
         )
@@ -72,8 +183,11 @@ def run_spy(input_file: str, target: SpyTarget, run: bool = False) -> SpyResult:
                 run_stdout=link_result.stdout.decode(),
                 run_stderr=link_result.stderr.decode(),
             )
+        run_args: list[str] = [f"./{exe_name}"]
+        if target == "aarch64-linux" and platform.machine() != "aarch64":
+            run_args = ["qemu-aarch64", *run_args]
         run_result = subprocess.run(
-            [f"./{exe_name}"],
+            run_args,
             stdout=subprocess.PIPE,
             stderr=subprocess.PIPE,
         )
@@ -106,12 +220,18 @@ def test_spy(input_file: str, target: SpyTarget, write_anyway: bool = False) ->
     print(f"Testing `{bcolors.OKBLUE}{input_file}{bcolors.ENDC}` `{target}`: ", end='')
     result = run_spy(input_file, target, run=True)
     name, _ = os.path.splitext(input_file)
-    json_file: str = f"{name}.json"
+    json_file: str = f"{name}.json" if target == DEFAULT_TARGET else f"{name}.{target}.json"
     formatted_result = format_result(result)
     if os.path.exists(json_file):
         with open(json_file, 'r') as f:
             expected_json = f.read()
         formatted_expected = expected_json
+        if target in NATIVE_TARGETS and linker_for(target) is None:
+            # The program can not run here, only the compilation is checked
+            expected = json.loads(expected_json)
+            result["run_stdout"], result["run_stderr"] = expected["run_stdout"], expected["run_stderr"]
+            formatted_result = format_result(result)
+            write_anyway = False
         if formatted_expected != formatted_result:
             if write_anyway:
                 print(bcolors.WARNING, "UPDATED", bcolors.ENDC)
@@ -128,6 +248,9 @@ def test_spy(input_file: str, target: SpyTarget, write_anyway: bool = False) ->
             return True
         print(bcolors.OKGREEN, "PASSED", bcolors.ENDC)
         return True
+    if target in NATIVE_TARGETS and linker_for(target) is None:
+        print(bcolors.WARNING, "SKIPPED, can not run here", bcolors.ENDC)
+        return True
     print(bcolors.OKBLUE, "CREATED", bcolors.ENDC)
     write_result(result, json_file)
     return True
@@ -158,7 +281,7 @@ if __name__ == '__main__':
     parser = argparse.ArgumentParser()
     parser.add_argument("dir")
     parser.add_argument("action", choices=["test", "update"])
-    parser.add_argument("--target", default="x86-64-macos", choices=["x86-64-macos", "aarch64-mac-m1", "python311", "ir", "lexer"])
+    parser.add_argument("--target", default=DEFAULT_TARGET, choices=["x86-64-macos", "x86-64-linux", "x86-64-linux-static", "x86-64-linux-object", "aarch64-mac-m1", "aarch64-linux", "c", "llvm", "python311", "pyc311", "ir", "lexer", "spyir", "run", "spyc", "jit"])
 
     args = parser.parse_args()
 